@@ -1,4 +1,4 @@
 #!/bin/bash
 
-rm -f init sh hello
+rm -f init sh hello sysstat
 rm -f *.o
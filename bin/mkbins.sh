@@ -11,3 +11,4 @@ function build() {
 build init
 build sh
 build hello
+build sysstat
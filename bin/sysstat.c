@@ -0,0 +1,135 @@
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const char *names[] = {
+#define SYSCALL(nr, kname, uname, nargs) [nr] = #kname,
+#include "../kernel/include/syscalls.h"
+#undef SYSCALL
+};
+
+#define NR_SYSCALLS (sizeof(names) / sizeof(names[0]))
+
+static char line[128];
+static int len;
+
+static void put_str(const char *s, int width)
+{
+    int n = 0;
+
+    while (*s) {
+        line[len++] = *s++;
+        n++;
+    }
+    while (n++ < width)
+        line[len++] = ' ';
+}
+
+static void put_num(unsigned int n, int width)
+{
+    char buf[12];
+    int i = sizeof(buf) - 1;
+
+    buf[i] = '\0';
+    do {
+        buf[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+
+    while (width-- > (int)sizeof(buf) - 1 - i)
+        line[len++] = ' ';
+    put_str(&buf[i], 0);
+}
+
+static void flush()
+{
+    line[len++] = '\n';
+    write(STDOUT_FILENO, line, len);
+    len = 0;
+}
+
+/* Average cycles per call without 64-bit division, which needs libgcc. */
+static unsigned int average(unsigned long long cycles, unsigned long long count)
+{
+    while (cycles >> 32) {
+        cycles >>= 1;
+        count >>= 1;
+    }
+    return count ? (unsigned int)cycles / (unsigned int)count : 0;
+}
+
+int main()
+{
+    struct syscall_stats st;
+    struct buffer_stats bst;
+    struct block_stats kst;
+    unsigned int nr, avg, peak, i;
+    int khz = 0;
+
+    put_str("syscall", 20);
+    put_str("calls", 0);
+    put_str("  avg cycles", 0);
+    put_str("  avg us", 0);
+    put_str("  most 2^n", 0);
+    flush();
+
+    for (nr = 0; nr < NR_SYSCALLS; nr++) {
+        khz = syscall_stats(nr, &st);
+        if (khz < 0 || st.count == 0 || !names[nr])
+            continue;
+
+        avg = average(st.cycles, st.count);
+        peak = 0;
+        for (i = 1; i < SYSCALL_HIST_BUCKETS; i++) {
+            if (st.hist[i] > st.hist[peak])
+                peak = i;
+        }
+
+        put_str(names[nr], 20);
+        put_num((unsigned int)st.count, 5);
+        put_num(avg, 12);
+        put_num(khz >= 1000 ? avg / (khz / 1000) : 0, 8);
+        put_num(peak, 10);
+        flush();
+    }
+
+    if (buffer_stats(&bst) == 0) {
+        put_str("buffer cache: ", 0);
+        put_num(bst.nbuffers, 0);
+        put_str(" blocks, ", 0);
+        put_num(bst.hits, 0);
+        put_str(" hits, ", 0);
+        put_num(bst.misses, 0);
+        put_str(" misses, ", 0);
+        put_num(bst.reclaimed, 0);
+        put_str(" pages reclaimed", 0);
+        flush();
+        put_str("buffer writeback: ", 0);
+        put_num(bst.dirty, 0);
+        put_str(" dirty, ", 0);
+        put_num(bst.written, 0);
+        put_str(" written", 0);
+        flush();
+    }
+
+    if (block_stats(&kst) == 0) {
+        put_str("block i/o: ", 0);
+        put_num(kst.submitted, 0);
+        put_str(" buffers, ", 0);
+        put_num(kst.merged, 0);
+        put_str(" merged, ", 0);
+        put_num(kst.dispatched, 0);
+        put_str(" requests in ", 0);
+        put_num(kst.commands, 0);
+        put_str(" commands", 0);
+        flush();
+        put_str("block seeks: ", 0);
+        put_num(kst.seeks, 0);
+        put_str(" over ", 0);
+        put_num(kst.seek_cyls, 0);
+        put_str(" cylinders", 0);
+        flush();
+    }
+
+    return 0;
+}
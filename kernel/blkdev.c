@@ -8,22 +8,308 @@
 #include <fs.h>
 #include <blkdev.h>
 #include <buffer.h>
+#include <sched.h>
+#include <mm.h>
+#include <x86.h>
+#include <floppy.h>
 
-extern bool floppy_rw(void *buf, uint8_t minor, int lba, int nblk, bool write);
+/**
+ * Request for a run of consecutive blocks of a device, all read or all
+ * written, made of the buffers submitted for them.
+ */
+struct request {
+    int rw;
+    dev_t dev;
+    unsigned int block;        /* First block */
+    unsigned int nblocks;
+    struct buffer *bufs;       /* Buffers in block order */
+    struct buffer *last;
+    unsigned int deadline;     /* Jiffies by which it should be started */
+    struct request *next;      /* Queue in block order */
+    struct request *fifo_next; /* Queue in order of arrival */
+};
 
-bool block_rw(int rw, struct buffer *b)
+/**
+ * Queue of requests for a block device driver, serviced by its own thread.
+ */
+struct request_queue {
+    struct request *head;      /* Requests sorted by block */
+    struct request *fifo;      /* Requests oldest first */
+    struct thread *thread;
+    struct wait_queue wait;    /* Driver thread waiting for requests */
+    dev_t pos_dev;             /* Device and cylinder of the last request */
+    unsigned int pos_cyl;
+    unsigned int pos;          /* Block after the last request */
+    bool (*submit)(struct bio *bio);
+    struct bio bio;            /* Bio being issued by the driver thread */
+};
+
+static struct kcache request_cache = KCACHE_INIT(struct request, next);
+static struct request_queue floppy_queue;
+static struct block_stats stats;
+
+/* Threads waiting for synchronous I/O to finish. */
+static struct wait_queue io_wait;
+
+static struct request_queue *get_queue(dev_t dev)
 {
-    if (rw != READ && rw != WRITE)
-        return false;
+    switch (MAJOR(dev)) {
+    case 2:
+        return &floppy_queue;
+    default:
+        return NULL;
+    }
+}
 
-    switch (MAJOR(b->dev)) {
+/**
+ * Get the number of blocks on a device, or 0 if it isn't known.
+ */
+unsigned int block_dev_size(dev_t dev)
+{
+    switch (MAJOR(dev)) {
+    case 2:
+        return 1440; /* 1.44 MB floppy */
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Get the number of blocks a device can transfer in one command from the start
+ * of a track, which read-ahead aligns to and bios don't cross, or 1 if there's
+ * no such unit.
+ */
+unsigned int block_track_size(dev_t dev)
+{
+    switch (MAJOR(dev)) {
     case 2:
-        return floppy_rw(b->data, MINOR(b->dev), 2*b->block, 2, rw);
+        return 18; /* Both tracks of a 1.44 MB floppy cylinder */
     default:
-        printk("block_rw: attempted %s on invalid device %d:%d\n",
+        return 1;
+    }
+}
+
+/* Try to add a buffer to the end or start of a queued request. */
+static bool merge_request(struct request_queue *q, int rw, struct buffer *b)
+{
+    struct request *req;
+
+    for (req = q->head; req; req = req->next) {
+        if (req->rw != rw || req->dev != b->dev
+            || req->nblocks >= BLK_MAX_REQUEST)
+            continue;
+
+        if (req->block + req->nblocks == b->block) {
+            b->io_next = NULL;
+            req->last->io_next = b;
+            req->last = b;
+            req->nblocks++;
+            return true;
+        } else if (b->block + 1 == req->block) {
+            b->io_next = req->bufs;
+            req->bufs = b;
+            req->block--;
+            req->nblocks++;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Insert a request in block order and at the end of the FIFO. */
+static void add_request(struct request_queue *q, struct request *req)
+{
+    struct request **rp;
+
+    for (rp = &q->head; *rp; rp = &(*rp)->next) {
+        if ((*rp)->dev > req->dev
+            || ((*rp)->dev == req->dev && (*rp)->block > req->block))
+            break;
+    }
+    req->next = *rp;
+    *rp = req;
+
+    for (rp = &q->fifo; *rp; rp = &(*rp)->fifo_next)
+        ;
+    req->fifo_next = NULL;
+    *rp = req;
+}
+
+static void remove_request(struct request_queue *q, struct request *req)
+{
+    struct request **rp;
+
+    for (rp = &q->head; *rp != req; rp = &(*rp)->next)
+        ;
+    *rp = req->next;
+    for (rp = &q->fifo; *rp != req; rp = &(*rp)->fifo_next)
+        ;
+    *rp = req->fifo_next;
+}
+
+/* Choose the next request to service. The oldest one goes first if its
+ * deadline has passed, otherwise the head sweeps upwards through the blocks
+ * and jumps back to the lowest request once there are none above it
+ * (C-LOOK). */
+static struct request *elevator_next(struct request_queue *q)
+{
+    struct request *req;
+
+    if (!q->head)
+        return NULL;
+    if (q->fifo->deadline <= jiffies())
+        return q->fifo;
+
+    for (req = q->head; req; req = req->next) {
+        if (req->dev == q->pos_dev && req->block >= q->pos)
+            return req;
+    }
+    return q->head;
+}
+
+/* Hand a request's buffers to the driver as bios, each gathering the buffers up
+ * to the next track boundary so it goes to the drive as one command, and
+ * complete the buffers of each bio as soon as it's done. */
+static void dispatch_request(struct request_queue *q, struct request *req)
+{
+    struct bio *bio = &q->bio;
+    unsigned int track = block_track_size(req->dev);
+    struct buffer *b, *next, *end;
+    bool ok;
+
+    for (b = req->bufs; b; b = end) {
+        bio->rw = req->rw;
+        bio->dev = req->dev;
+        bio->sector = b->block * (BUF_BLOCKSIZE / SECTOR_SIZE);
+        bio->nsectors = 0;
+        bio->nvecs = 0;
+
+        end = b;
+        do {
+            bio->vecs[bio->nvecs].data = end->data;
+            bio->vecs[bio->nvecs].len = BUF_BLOCKSIZE;
+            bio->nvecs++;
+            bio->nsectors += BUF_BLOCKSIZE / SECTOR_SIZE;
+            end = end->io_next;
+        } while (end && end->block % track != 0 && bio->nvecs < BIO_MAX_VECS);
+
+        stats.commands++;
+        ok = q->submit(bio);
+        for (; b != end; b = next) {
+            next = b->io_next;
+            b->end_io(b, ok);
+        }
+    }
+}
+
+/* Driver thread servicing a request queue. */
+static void queue_thread(void *data)
+{
+    struct request_queue *q = data;
+    struct request *req;
+    unsigned int cyl;
+
+    for (;;) {
+        DISABLE_INTERRUPTS;
+        while (!(req = elevator_next(q)))
+            wait_queue_sleep(&q->wait);
+        remove_request(q, req);
+        ENABLE_INTERRUPTS;
+
+        cyl = req->block / block_track_size(req->dev);
+        if (req->dev != q->pos_dev || cyl != q->pos_cyl) {
+            stats.seeks++;
+            stats.seek_cyls += cyl > q->pos_cyl ? cyl - q->pos_cyl
+                                                : q->pos_cyl - cyl;
+        }
+        q->pos_dev = req->dev;
+        q->pos_cyl = (req->block + req->nblocks - 1)
+                     / block_track_size(req->dev);
+        q->pos = req->block + req->nblocks;
+        stats.dispatched++;
+
+        dispatch_request(q, req);
+        kcache_free(&request_cache, req);
+    }
+}
+
+/**
+ * Queue I/O on a locked buffer without waiting for it. The buffer's end_io
+ * function is called from the driver thread once it's done, and must unlock
+ * it if it's to be released. Returns false if there's no driver for the
+ * device or no memory for a request.
+ */
+bool submit_buffer(int rw, struct buffer *b,
+                   void (*end_io)(struct buffer *b, bool ok))
+{
+    struct request_queue *q = get_queue(b->dev);
+    struct request *req;
+    uint32_t flags;
+
+    if (!q || !q->thread) {
+        printk("submit_buffer: attempted %s on invalid device %d:%d\n",
                rw ? "write" : "read", MAJOR(b->dev), MINOR(b->dev));
         return false;
     }
+
+    b->end_io = end_io;
+    b->io_next = NULL;
+    b->flags |= BUF_IO;
+    b->flags &= ~BUF_ERROR;
+
+    SAVE_INTERRUPTS(flags);
+    stats.submitted++;
+    if (merge_request(q, rw, b)) {
+        stats.merged++;
+        RESTORE_INTERRUPTS(flags);
+        return true;
+    }
+    RESTORE_INTERRUPTS(flags);
+
+    req = kcache_alloc(&request_cache);
+    if (!req) {
+        b->flags &= ~BUF_IO;
+        return false;
+    }
+    req->rw = rw;
+    req->dev = b->dev;
+    req->block = b->block;
+    req->nblocks = 1;
+    req->bufs = req->last = b;
+    req->deadline = jiffies() + (rw == READ ? BLK_READ_EXPIRE
+                                            : BLK_WRITE_EXPIRE);
+
+    SAVE_INTERRUPTS(flags);
+    add_request(q, req);
+    wait_queue_wake(&q->wait);
+    RESTORE_INTERRUPTS(flags);
+    return true;
+}
+
+static void end_sync_io(struct buffer *b, bool ok)
+{
+    if (!ok)
+        b->flags |= BUF_ERROR;
+    b->flags &= ~BUF_IO;
+    wait_queue_wake(&io_wait);
+}
+
+/**
+ * Read or write a locked buffer, waiting until it's done. Returns whether the
+ * operation succeeded.
+ */
+bool block_rw(int rw, struct buffer *b)
+{
+    if (rw != READ && rw != WRITE)
+        return false;
+    if (!submit_buffer(rw, b, end_sync_io))
+        return false;
+
+    DISABLE_INTERRUPTS;
+    while (b->flags & BUF_IO)
+        wait_queue_sleep(&io_wait);
+    ENABLE_INTERRUPTS;
+    return !(b->flags & BUF_ERROR);
 }
 
 struct buffer *readblk(dev_t dev, unsigned int blk)
@@ -38,3 +324,54 @@ struct buffer *readblk(dev_t dev, unsigned int blk)
     }
     return b;
 }
+
+static void end_readahead(struct buffer *b, bool ok)
+{
+    if (ok)
+        b->flags |= BUF_UPTODATE;
+    b->flags &= ~BUF_IO;
+    relbuf(b);
+}
+
+/**
+ * Start reading blocks into the buffer cache in the background. Blocks that
+ * are cached or locked are skipped, and the rest once no buffer can be taken
+ * without waiting, since nobody is waiting for them yet. Returns how many
+ * blocks were dealt with before that.
+ */
+int block_readahead(dev_t dev, unsigned int *blocks, int n)
+{
+    struct buffer *b;
+    bool locked;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        b = trygetbuf(dev, blocks[i], &locked);
+        if (!b && locked)
+            continue;
+        else if (!b)
+            break;
+        if ((b->flags & BUF_UPTODATE) || !submit_buffer(READ, b, end_readahead))
+            relbuf(b);
+    }
+    return i;
+}
+
+/**
+ * Copy the block I/O statistics.
+ */
+void block_get_stats(struct block_stats *st)
+{
+    *st = stats;
+}
+
+/**
+ * Start the request queue threads of the block device drivers.
+ */
+void block_init()
+{
+    floppy_queue.submit = floppy_submit_bio;
+    floppy_queue.thread = kthread_create(queue_thread, &floppy_queue);
+    if (!floppy_queue.thread)
+        panic("failed to create floppy queue thread");
+}
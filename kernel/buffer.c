@@ -9,58 +9,732 @@
 #include <blkdev.h>
 #include <buffer.h>
 #include <sched.h>
+#include <mm.h>
+#include <x86.h>
 
-static struct buffer buffers[NUM_BUFFERS];
+#define BUF_HASH(dev, block) (((dev) ^ (block)) & (BUF_HASH_SIZE - 1))
+
+/**
+ * Page of buffer data along with the buffers using it. Pages given back under
+ * memory pressure keep their kernel address, and are backed again when the
+ * cache next grows.
+ */
+struct buf_page {
+    char *data;
+    struct buf_page *next;  /* Pages given back */
+    struct buffer bufs[BUFS_PER_PAGE];
+};
+
+/**
+ * Ghost entry of the A1out list, remembering a block evicted from A1in.
+ */
+struct buf_ghost {
+    dev_t dev;
+    int block;
+    struct buf_ghost *hash_next;
+};
+
+/* Replacement queues a buffer can belong to. */
+enum {
+    BUFQ_A1IN,
+    BUFQ_AM,
+    BUFQ_META,
+    NR_BUFQ
+};
+
+static struct kcache buf_page_cache = KCACHE_INIT(struct buf_page, next);
+static struct buf_page *spare_pages;
+static struct buffer *buf_hash[BUF_HASH_SIZE];
 static spinlock_t buffers_lock;
+static struct buffer_stats stats;
+
+/* Buffers of each queue, oldest first. Am and metadata only list unlocked
+ * buffers, moving them to the end when released, but A1in is a FIFO whose
+ * buffers stay in place while locked, so hits don't reorder it. The lists are
+ * circular through these dummy heads, so buffers can be unlinked without
+ * checking for the ends. qlen counts all buffers of a queue. */
+static struct buffer queues[NR_BUFQ];
+static unsigned int qlen[NR_BUFQ];
+
+/* A1out, as a ring of ghost entries that are also hashed for lookup. */
+static struct buf_ghost ghosts[BUF_GHOSTS];
+static struct buf_ghost *ghost_hash[BUF_HASH_SIZE];
+static unsigned int ghost_first, nghosts;
+
+/* Lookups and misses so far in the current window of BUF_WINDOW lookups, and
+ * whether the last window missed enough for the cache to grow. */
+static unsigned int window_lookups, window_misses;
+static bool grow_on_miss = true;
+
+/* Threads waiting for a buffer to be unlocked. */
+static struct wait_queue buf_wait;
+
+/* Dirty buffers in the order they became dirty, circular through a dummy head
+ * like the queues, and the writes in flight. */
+static struct buffer dirty_list;
+static unsigned int nwriteback, write_errors;
+static struct wait_queue writeback_wait;
+
+static struct thread *flusher_thread;
+static bool flush_wanted;
 
-static void lockbuf(struct buffer *b)
+static unsigned int shrink_buffers(unsigned int nr);
+static struct shrinker buffer_shrinker = { shrink_buffers, NULL };
+
+static void list_remove(struct buffer *b)
 {
-    while (b->flags & BUF_LOCK)
-        yield_thread();
-    b->flags |= BUF_LOCK;
+    b->lru_prev->lru_next = b->lru_next;
+    b->lru_next->lru_prev = b->lru_prev;
 }
 
-struct buffer *getbuf(dev_t dev, int block)
+static void list_add_tail(struct buffer *head, struct buffer *b)
+{
+    b->lru_prev = head->lru_prev;
+    b->lru_next = head;
+    head->lru_prev->lru_next = b;
+    head->lru_prev = b;
+}
+
+static void list_add_head(struct buffer *head, struct buffer *b)
+{
+    b->lru_next = head->lru_next;
+    b->lru_prev = head;
+    head->lru_next->lru_prev = b;
+    head->lru_next = b;
+}
+
+static void dirty_add(struct buffer *b)
 {
-    struct buffer *b, *buf;
+    b->dirty_prev = dirty_list.dirty_prev;
+    b->dirty_next = &dirty_list;
+    dirty_list.dirty_prev->dirty_next = b;
+    dirty_list.dirty_prev = b;
+}
+
+static void dirty_remove(struct buffer *b)
+{
+    b->dirty_prev->dirty_next = b->dirty_next;
+    b->dirty_next->dirty_prev = b->dirty_prev;
+}
+
+static void hash_remove(struct buffer *b)
+{
+    struct buffer **bp;
+
+    bp = &buf_hash[BUF_HASH(b->dev, b->block)];
+    for (; *bp; bp = &(*bp)->hash_next) {
+        if (*bp == b) {
+            *bp = b->hash_next;
+            return;
+        }
+    }
+}
+
+static void set_queue(struct buffer *b, int queue)
+{
+    qlen[b->queue]--;
+    b->queue = queue;
+    qlen[queue]++;
+}
+
+static void ghost_unhash(struct buf_ghost *g)
+{
+    struct buf_ghost **gp;
+
+    gp = &ghost_hash[BUF_HASH(g->dev, g->block)];
+    for (; *gp; gp = &(*gp)->hash_next) {
+        if (*gp == g) {
+            *gp = g->hash_next;
+            return;
+        }
+    }
+}
+
+/* Remember a block evicted from A1in, forgetting the oldest ones to keep A1out
+ * at most half the cache size. */
+static void ghost_add(dev_t dev, int block)
+{
+    struct buf_ghost *g;
+    unsigned int max = MIN(stats.nbuffers / 2, BUF_GHOSTS);
+
+    while (nghosts > 0 && nghosts >= max) {
+        ghost_unhash(&ghosts[ghost_first]);
+        ghost_first = (ghost_first + 1) % BUF_GHOSTS;
+        nghosts--;
+    }
+    if (max == 0)
+        return;
+
+    g = &ghosts[(ghost_first + nghosts) % BUF_GHOSTS];
+    g->dev = dev;
+    g->block = block;
+    g->hash_next = ghost_hash[BUF_HASH(dev, block)];
+    ghost_hash[BUF_HASH(dev, block)] = g;
+    nghosts++;
+}
+
+/* Check whether a block is in A1out, and forget it if so. Its ring slot stays
+ * until it ages out. */
+static bool ghost_take(dev_t dev, int block)
+{
+    struct buf_ghost *g;
+
+    for (g = ghost_hash[BUF_HASH(dev, block)]; g; g = g->hash_next) {
+        if (g->dev == dev && g->block == block) {
+            ghost_unhash(g);
+            g->dev = 0;
+            g->block = -1;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Add a page of buffers to the cache, at the front of A1in so they're used
+ * first. The page comes from below DMA_LIMIT if possible, so drivers can
+ * transfer straight to and from it. Called with buffers_lock held. */
+static bool grow_buffers()
+{
+    struct buf_page *pg;
+    struct buffer *b;
+
+    if (spare_pages) {
+        pg = spare_pages;
+        if (!refill_kernel_page((uint32_t)pg->data, PAGE_WRITABLE | PAGE_DMA))
+            return false;
+        spare_pages = pg->next;
+    } else {
+        pg = kcache_alloc(&buf_page_cache);
+        if (!pg)
+            return false;
+        pg->data = (char *)alloc_kernel_page(PAGE_WRITABLE | PAGE_DMA);
+        if (!pg->data) {
+            kcache_free(&buf_page_cache, pg);
+            return false;
+        }
+    }
+
+    for (b = pg->bufs; b < pg->bufs + BUFS_PER_PAGE; b++) {
+        b->data = pg->data + (b - pg->bufs) * BUF_BLOCKSIZE;
+        b->page = pg;
+        b->flags = 0;
+        b->dev = 0;
+        b->block = -1;
+        b->queue = BUFQ_A1IN;
+        qlen[BUFQ_A1IN]++;
+        list_add_head(&queues[BUFQ_A1IN], b);
+    }
+    stats.nbuffers += BUFS_PER_PAGE;
+    return true;
+}
+
+/* Check that no buffer of a page is locked or dirty. */
+static bool page_idle(struct buf_page *pg)
+{
+    struct buffer *b;
+
+    for (b = pg->bufs; b < pg->bufs + BUFS_PER_PAGE; b++) {
+        if (b->flags & (BUF_LOCK | BUF_DIRTY))
+            return false;
+    }
+    return true;
+}
+
+/* Shrinker called by the page allocator when memory runs low. Gives back up to
+ * nr pages whose buffers are all clean and unlocked, scanning A1in, then Am,
+ * then metadata, but keeps at least NUM_BUFFERS buffers. */
+static unsigned int shrink_buffers(unsigned int nr)
+{
+    struct buffer *b, *next, *head;
+    struct buf_page *pg;
+    unsigned int freed = 0;
+    int q;
+
+    if (!spin_trylock(&buffers_lock))
+        return 0;
+
+    for (q = 0; q < NR_BUFQ; q++) {
+        head = &queues[q];
+        for (b = head->lru_next; b != head; b = next) {
+            if (freed == nr || stats.nbuffers - BUFS_PER_PAGE < NUM_BUFFERS)
+                goto done;
+            next = b->lru_next;
+            pg = b->page;
+            if (!page_idle(pg))
+                continue;
+
+            while (next != head && next->page == pg)
+                next = next->lru_next;
+            for (b = pg->bufs; b < pg->bufs + BUFS_PER_PAGE; b++) {
+                list_remove(b);
+                hash_remove(b);
+                qlen[b->queue]--;
+            }
+            release_kernel_page((uint32_t)pg->data);
+            pg->next = spare_pages;
+            spare_pages = pg;
+            stats.nbuffers -= BUFS_PER_PAGE;
+            stats.reclaimed++;
+            freed++;
+        }
+    }
+
+done:
+    spin_unlock(&buffers_lock);
+    return freed;
+}
+
+/* Count a lookup, deciding at the end of each window whether misses are
+ * frequent enough to grow the cache. */
+static void count_lookup(bool hit)
+{
+    if (hit) {
+        stats.hits++;
+    } else {
+        stats.misses++;
+        window_misses++;
+    }
+
+    if (++window_lookups == BUF_WINDOW) {
+        grow_on_miss = window_misses * BUF_GROW_MISS_RATIO >= BUF_WINDOW;
+        window_lookups = window_misses = 0;
+    }
+}
+
+/* Pick the unlocked, clean buffer to take over for a new block. Metadata is
+ * only evicted once it outgrows its share. Otherwise A1in goes first while
+ * it's over its share or Am is empty, else the least recently used block of
+ * Am. Returns NULL if every buffer is locked or dirty. Called with
+ * buffers_lock held. */
+static struct buffer *pick_victim()
+{
+    struct buffer *b, *head;
+    int order[NR_BUFQ], i;
+
+    if (qlen[BUFQ_META] * 100 > stats.nbuffers * BUF_META_SHARE) {
+        order[0] = BUFQ_META;
+        order[1] = BUFQ_A1IN;
+        order[2] = BUFQ_AM;
+    } else if (qlen[BUFQ_A1IN] * 100 > stats.nbuffers * BUF_A1IN_SHARE
+               || qlen[BUFQ_AM] == 0) {
+        order[0] = BUFQ_A1IN;
+        order[1] = BUFQ_AM;
+        order[2] = BUFQ_META;
+    } else {
+        order[0] = BUFQ_AM;
+        order[1] = BUFQ_A1IN;
+        order[2] = BUFQ_META;
+    }
+
+    for (i = 0; i < NR_BUFQ; i++) {
+        head = &queues[order[i]];
+        for (b = head->lru_next; b != head; b = b->lru_next) {
+            if (!(b->flags & (BUF_LOCK | BUF_DIRTY)))
+                return b;
+        }
+    }
+    return NULL;
+}
+
+static bool dirty_over(unsigned int ratio)
+{
+    return stats.dirty * 100 > stats.nbuffers * ratio;
+}
+
+static void wake_flusher()
+{
+    flush_wanted = true;
+    if (flusher_thread)
+        wake_thread(flusher_thread);
+}
+
+/* Lock an unlocked dirty buffer to write it back, counting it as clean from
+ * now on. Called with buffers_lock held. */
+static void start_writeback(struct buffer *b)
+{
+    if (b->queue != BUFQ_A1IN)
+        list_remove(b);
+    dirty_remove(b);
+    b->flags = (b->flags | BUF_LOCK) & ~BUF_DIRTY;
+    stats.dirty--;
+    nwriteback++;
+}
+
+/* Take up to BUF_FLUSH_BATCH unlocked dirty buffers, oldest first, of a device
+ * or of all devices if dev is 0, and lock them for writing back. Unless all is
+ * set, only those dirty for longer than BUF_DIRTY_EXPIRE are taken. */
+static int collect_dirty(dev_t dev, bool all, struct buffer **batch)
+{
+    struct buffer *b, *next;
+    int n = 0;
+
+    spin_lock(&buffers_lock);
+    for (b = dirty_list.dirty_next; b != &dirty_list && n < BUF_FLUSH_BATCH;
+         b = next) {
+        next = b->dirty_next;
+        if (!all && jiffies() - b->dirtied < BUF_DIRTY_EXPIRE)
+            break;
+        if ((dev && b->dev != dev) || (b->flags & BUF_LOCK))
+            continue;
+        start_writeback(b);
+        batch[n++] = b;
+    }
+    spin_unlock(&buffers_lock);
+    return n;
+}
+
+/* Completion of a write back. The buffer goes back as the oldest of its queue,
+ * since it was written because it was old, unless it kept its place in A1in.
+ * A failed write is counted, but the
+ * buffer isn't dirtied again to retry forever. */
+static void end_writeback(struct buffer *b, bool ok)
+{
+    spin_lock(&buffers_lock);
+    b->flags &= ~(BUF_IO | BUF_LOCK);
+    if (ok) {
+        stats.written++;
+    } else {
+        b->flags |= BUF_ERROR;
+        write_errors++;
+        printk("buffer: lost write of block %d (dev %d:%d)\n", b->block,
+               MAJOR(b->dev), MINOR(b->dev));
+    }
+    if (b->queue != BUFQ_A1IN)
+        list_add_head(&queues[b->queue], b);
+    nwriteback--;
+    spin_unlock(&buffers_lock);
+    wait_queue_wake(&buf_wait);
+    wait_queue_wake(&writeback_wait);
+}
+
+/* Submit the writes of collected buffers in block order, so the block layer
+ * can merge them into as few requests as possible. */
+static void write_batch(struct buffer **batch, int n)
+{
+    struct buffer *b;
+    int i, j;
+
+    for (i = 1; i < n; i++) {
+        b = batch[i];
+        for (j = i; j > 0 && (batch[j-1]->dev > b->dev
+                              || (batch[j-1]->dev == b->dev
+                                  && batch[j-1]->block > b->block)); j--)
+            batch[j] = batch[j-1];
+        batch[j] = b;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!submit_buffer(WRITE, batch[i], end_writeback))
+            end_writeback(batch[i], false);
+    }
+}
+
+/* Sleep until no writes back are in flight. */
+static void wait_writeback()
+{
+    DISABLE_INTERRUPTS;
+    while (nwriteback > 0)
+        wait_queue_sleep(&writeback_wait);
+    ENABLE_INTERRUPTS;
+}
+
+/* Flusher thread, writing back expired dirty buffers, or the oldest ones while
+ * too much of the cache is dirty. */
+static void flusher(void *data)
+{
+    struct buffer *batch[BUF_FLUSH_BATCH];
+    int n;
+
+    for (;;) {
+        while ((n = collect_dirty(0, dirty_over(BUF_DIRTY_BG_RATIO), batch)))
+            write_batch(batch, n);
+
+        DISABLE_INTERRUPTS;
+        if (!flush_wanted)
+            sleep_thread((uint64_t)BUF_FLUSH_INTERVAL * TICK_NSEC);
+        flush_wanted = false;
+        ENABLE_INTERRUPTS;
+    }
+}
+
+/**
+ * Set up the initial buffers, and let the page allocator shrink the cache.
+ */
+void buffer_init()
+{
+    int q;
+
+    for (q = 0; q < NR_BUFQ; q++)
+        queues[q].lru_next = queues[q].lru_prev = &queues[q];
+    dirty_list.dirty_next = dirty_list.dirty_prev = &dirty_list;
+
+    while (stats.nbuffers < NUM_BUFFERS) {
+        if (!grow_buffers())
+            panic("buffer_init: out of memory");
+    }
+    register_shrinker(&buffer_shrinker);
+
+    flusher_thread = kthread_create(flusher, NULL);
+    if (!flusher_thread)
+        panic("buffer_init: failed to create flusher thread");
+}
+
+/**
+ * Copy the buffer cache statistics.
+ */
+void buffer_get_stats(struct buffer_stats *st)
+{
+    *st = stats;
+}
+
+/* Sleep until some buffer is unlocked, releasing buffers_lock. */
+static void wait_for_buffer()
+{
+    DISABLE_INTERRUPTS;
+    spin_unlock(&buffers_lock);
+    wait_queue_sleep(&buf_wait);
+    ENABLE_INTERRUPTS;
+}
+
+/* Find or take over the buffer for a block, locking it. If wait is false,
+ * gives up with NULL rather than sleep, setting *locked if the block is cached
+ * but locked rather than no buffer being free. */
+static struct buffer *do_getbuf(dev_t dev, int block, bool wait, bool *locked)
+{
+    struct buffer *b;
 
 repeat:
     spin_lock(&buffers_lock);
 
-    buf = buffers;
-    for (b = buffers + 1; b < buffers + NUM_BUFFERS; b++) {
-        if (b->dev == dev && b->block == block) {
-            lockbuf(b);
+    for (b = buf_hash[BUF_HASH(dev, block)]; b; b = b->hash_next) {
+        if (b->dev == dev && b->block == block)
+            break;
+    }
+    if (b) {
+        if ((b->flags & BUF_LOCK) && !wait) {
+            *locked = true;
             spin_unlock(&buffers_lock);
-            b->time = jiffies();
-            return b;
+            return NULL;
+        } else if (b->flags & BUF_LOCK) {
+            wait_for_buffer();
+            goto repeat;
         }
-        
-        if (b->time <= buf->time && !(b->flags & BUF_LOCK))
-            buf = b;
+        if (b->queue != BUFQ_A1IN)
+            list_remove(b);
+        b->flags |= BUF_LOCK;
+        if (wait)
+            count_lookup(true);
+        spin_unlock(&buffers_lock);
+        return b;
     }
-    if (buf->flags & BUF_LOCK) {
-        // All buffers are locked, so wait until one is free
+
+    /* Take a new buffer rather than evicting one if misses are frequent and
+     * memory is plentiful. */
+    if (grow_on_miss && mem_free() > BUF_GROW_MIN_FREE * PAGE_SIZE)
+        grow_buffers();
+
+    /* With every buffer locked or dirty, wait for the flusher to clean some
+     * rather than writing one back here. */
+    b = pick_victim();
+    if (!b && !wait) {
         spin_unlock(&buffers_lock);
-        yield_thread();
+        return NULL;
+    } else if (!b) {
+        wake_flusher();
+        wait_for_buffer();
         goto repeat;
     }
+    list_remove(b);
+    b->flags |= BUF_LOCK;
+
+    hash_remove(b);
+    if (b->queue == BUFQ_A1IN && b->block >= 0)
+        ghost_add(b->dev, b->block);
+    set_queue(b, ghost_take(dev, block) ? BUFQ_AM : BUFQ_A1IN);
+    if (b->queue == BUFQ_A1IN)
+        list_add_tail(&queues[BUFQ_A1IN], b);
+    count_lookup(false);
+
+    b->flags &= ~BUF_UPTODATE;
+    b->dev = dev;
+    b->block = block;
+    b->hash_next = buf_hash[BUF_HASH(dev, block)];
+    buf_hash[BUF_HASH(dev, block)] = b;
+    spin_unlock(&buffers_lock);
+    return b;
+}
+
+/**
+ * Get the locked buffer for a block, which may not be up to date. If it isn't
+ * cached, a clean victim chosen by the 2Q policy is taken over for it. Sleeps
+ * while the buffer is locked by someone else, or while all buffers are locked
+ * or dirty.
+ */
+struct buffer *getbuf(dev_t dev, int block)
+{
+    return do_getbuf(dev, block, true, NULL);
+}
 
-    buf->flags |= BUF_LOCK;
+/**
+ * Like getbuf(), but returns NULL instead of sleeping. Used to start I/O that
+ * nobody is waiting for yet. *locked tells whether that was because the block
+ * is locked by someone else, or because no buffer could be taken over.
+ */
+struct buffer *trygetbuf(dev_t dev, int block, bool *locked)
+{
+    *locked = false;
+    return do_getbuf(dev, block, false, locked);
+}
+
+/**
+ * Mark a locked buffer as filesystem metadata, such as the superblock, an
+ * inode table block or a directory block, so it's kept in the protected
+ * segment. Does nothing unless BUF_PROTECT_META is defined.
+ */
+void buf_mark_meta(struct buffer *b)
+{
+#ifdef BUF_PROTECT_META
+    spin_lock(&buffers_lock);
+    if (b->queue == BUFQ_A1IN)
+        list_remove(b);
+    set_queue(b, BUFQ_META);
     spin_unlock(&buffers_lock);
+#endif
+}
 
-    if (buf->flags & BUF_DIRTY) {
-        block_rw(WRITE, buf);
-        buf->flags &= ~BUF_DIRTY;
+/**
+ * Mark a locked buffer as modified, to be written back by the flusher thread.
+ */
+void buf_mark_dirty(struct buffer *b)
+{
+    spin_lock(&buffers_lock);
+    if (!(b->flags & BUF_DIRTY)) {
+        b->flags |= BUF_DIRTY;
+        b->dirtied = jiffies();
+        dirty_add(b);
+        stats.dirty++;
     }
-    buf->flags &= ~BUF_UPTODATE;
-    buf->dev = dev;
-    buf->block = block;
-    buf->time = jiffies();
-    return buf;
+    spin_unlock(&buffers_lock);
 }
 
+/**
+ * Unlock a buffer, making it the most recently used of its queue. A buffer in
+ * A1in keeps the place it was given when its block was first read.
+ */
 void relbuf(struct buffer *b)
 {
+    spin_lock(&buffers_lock);
     b->flags &= ~BUF_LOCK;
+    if (b->queue != BUFQ_A1IN)
+        list_add_tail(&queues[b->queue], b);
+    spin_unlock(&buffers_lock);
+    wait_queue_wake(&buf_wait);
+}
+
+/**
+ * Throttle a process that has dirtied buffers. Over BUF_DIRTY_RATIO percent
+ * dirty, it writes back a batch of the oldest buffers itself and waits for
+ * them, and over BUF_DIRTY_BG_RATIO percent, it wakes the flusher. Must be
+ * called without buffers locked.
+ */
+void balance_dirty()
+{
+    struct buffer *batch[BUF_FLUSH_BATCH];
+    int n;
+
+    if (dirty_over(BUF_DIRTY_RATIO)) {
+        n = collect_dirty(0, true, batch);
+        write_batch(batch, n);
+        wait_writeback();
+    } else if (dirty_over(BUF_DIRTY_BG_RATIO)) {
+        wake_flusher();
+    }
+}
+
+/* Check whether a dirty buffer of a device, or of any device if dev is 0, is
+ * locked by someone else, so a sync has to wait for it. Called with
+ * buffers_lock held. */
+static bool dirty_locked(dev_t dev)
+{
+    struct buffer *b;
+
+    for (b = dirty_list.dirty_next; b != &dirty_list; b = b->dirty_next) {
+        if ((!dev || b->dev == dev) && (b->flags & BUF_LOCK))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Write back the dirty buffers of a device, or of all devices if dev is 0, and
+ * wait until every write in flight is done. Buffers locked by someone else are
+ * waited for and written once released. Returns -EIO if any write failed in
+ * the meantime.
+ */
+int sync_buffers(dev_t dev)
+{
+    struct buffer *batch[BUF_FLUSH_BATCH];
+    unsigned int errors = write_errors;
+    int n;
+
+    for (;;) {
+        while ((n = collect_dirty(dev, true, batch)))
+            write_batch(batch, n);
+
+        spin_lock(&buffers_lock);
+        if (!dirty_locked(dev)) {
+            spin_unlock(&buffers_lock);
+            break;
+        }
+        wait_for_buffer();
+    }
+    wait_writeback();
+    return write_errors == errors ? 0 : -EIO;
+}
+
+/**
+ * Write back whichever of the given blocks of a device are cached and dirty,
+ * in batches of BUF_FLUSH_BATCH, and wait until every write in flight is done.
+ * Blocks locked by someone else are waited for and written once released.
+ * Returns -EIO if any write failed in the meantime.
+ */
+int sync_blocks(dev_t dev, unsigned int *blocks, int n)
+{
+    struct buffer *batch[BUF_FLUSH_BATCH];
+    struct buffer *b;
+    unsigned int errors = write_errors;
+    bool busy;
+    int i, nbatch;
+
+    for (;;) {
+        nbatch = 0;
+        busy = false;
+        spin_lock(&buffers_lock);
+        for (i = 0; i < n && nbatch < BUF_FLUSH_BATCH; i++) {
+            for (b = buf_hash[BUF_HASH(dev, blocks[i])]; b; b = b->hash_next) {
+                if (b->dev == dev && b->block == (int)blocks[i])
+                    break;
+            }
+            if (!b || !(b->flags & BUF_DIRTY))
+                continue;
+            if (b->flags & BUF_LOCK) {
+                busy = true;
+                continue;
+            }
+            start_writeback(b);
+            batch[nbatch++] = b;
+        }
+
+        if (nbatch > 0) {
+            spin_unlock(&buffers_lock);
+            write_batch(batch, nbatch);
+        } else if (busy) {
+            wait_for_buffer();
+        } else {
+            spin_unlock(&buffers_lock);
+            break;
+        }
+    }
+    wait_writeback();
+    return write_errors == errors ? 0 : -EIO;
 }
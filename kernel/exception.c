@@ -11,11 +11,12 @@
 #include <mm.h>
 #include <fs.h>
 #include <signal.h>
+#include <softirq.h>
+#include <fpu.h>
 
 extern void handle_timer_irq();
 extern void handle_keyboard_irq();
 extern void handle_floppy_irq();
-extern void floppy_update_timer();
 
 extern void handle_page_fault(struct exception *e);
 extern void syscall(struct exception *e);
@@ -31,12 +32,26 @@ void dump_exception(struct exception *e)
     printk("  EFL=%x CR0=%x CR2=%x CR3=%x\n", e->eflags, e->cr0, e->cr2, e->cr3);
 }
 
+/* Work done on the way out of every exception, ending with interrupts
+ * disabled. */
+static void exception_return(struct exception *e)
+{
+    /* Bottom halves run with interrupts on, so not if they were off before. */
+    if ((e->eflags & EFLAGS_IF) && this_cpu()->softirq_pending)
+        do_softirq();
+
+    DISABLE_INTERRUPTS;
+    if (this_cpu()->need_resched && !this_cpu()->in_softirq)
+        schedule();
+    if (USER_EXCEPTION((*e)) && signal_pending())
+        handle_signal(e);
+}
+
 void handle_exception(struct exception e)
 {
     switch (e.eno) {
     case ENO_IRQ0:
         handle_timer_irq();
-        floppy_update_timer();
         break;
     case ENO_IRQ1:
         handle_keyboard_irq();
@@ -47,12 +62,15 @@ void handle_exception(struct exception e)
     case ENO_IRQ12:
         // TODO: PS/2 mouse interrupt
         break;
+    case ENO_IPI_RESCHEDULE:
+        lapic_eoi();
+        break;
     case ENO_DIVISION_BY_ZERO:
         if (KERNEL_EXCEPTION(e)) {
             dump_exception(&e);
             panic("division by zero");
         } else {
-            thread->signal |= (1 << SIGFPE);
+            curthread->signal |= (1 << SIGFPE);
         }
         break;
     case ENO_BREAKPOINT:
@@ -71,7 +89,7 @@ void handle_exception(struct exception e)
             dump_exception(&e);
             panic("invalid opcode");
         } else {
-            thread->signal |= (1 << SIGILL);
+            curthread->signal |= (1 << SIGILL);
         }
         break;
     case ENO_GENERAL_PROTECTION_FAULT:
@@ -79,7 +97,19 @@ void handle_exception(struct exception e)
             dump_exception(&e);
             panic("general protection fault");
         } else {
-            thread->signal |= (1 << SIGILL);
+            curthread->signal |= (1 << SIGILL);
+        }
+        break;
+    case ENO_NO_COPROCESSOR:
+        fpu_handle_trap(&e);
+        break;
+    case ENO_COPROCESSOR_FAULT:
+    case ENO_SIMD_FP:
+        if (KERNEL_EXCEPTION(e)) {
+            dump_exception(&e);
+            panic("floating point exception");
+        } else {
+            curthread->signal |= (1 << SIGFPE);
         }
         break;
     case ENO_PAGE_FAULT:
@@ -93,7 +123,58 @@ void handle_exception(struct exception e)
         panic("unhandled exception");
     }
 
-    DISABLE_INTERRUPTS;
-    if (USER_EXCEPTION(e) && signal_pending())
-        handle_signal(&e);
+    exception_return(&e);
+}
+
+/* Check that len bytes of user memory at addr are mapped for user mode, so the
+ * kernel can read them without faulting or reading kernel memory. */
+static bool user_readable(uint32_t addr, uint32_t len)
+{
+    uint32_t page;
+
+    if (addr < KERNEL_SPACE_END || addr > 0xffffffff - len)
+        return false;
+    for (page = PAGE_BASE(addr); page < addr + len; page += PAGE_SIZE) {
+        if ((check_page(page) & (PAGE_PRESENT | PAGE_USER))
+            != (PAGE_PRESENT | PAGE_USER))
+            return false;
+        if (page + PAGE_SIZE < page)
+            break;
+    }
+    return true;
+}
+
+/**
+ * Fast system call entry, called from x86/idt.s after SYSENTER with the same
+ * frame int 255 leaves, except that the return address and the caller's EBP,
+ * EDX and ECX are still on the user stack where the library pushed them.
+ * Returns whether SYSEXIT can return to the caller, which it can unless the
+ * thread is being sent somewhere else, like a signal handler.
+ */
+bool handle_sysenter(struct exception *e)
+{
+    uint32_t *frame = (uint32_t *)e->esp;
+    uint32_t eip;
+
+    ENABLE_INTERRUPTS;
+
+    /* With a bad stack pointer there's no return address to go back to or to
+     * give a signal handler, so the process is killed as if by SIGSEGV rather
+     * than letting the kernel read through it. */
+    if (!user_readable(e->esp, 4 * sizeof(uint32_t))) {
+        printk("warning: pid %d segmentation fault [sysenter with esp 0x%x]\n",
+               curproc->pid, e->esp);
+        sched_terminate(SIGSEGV | TERM_SIGNALED);
+    }
+
+    e->eip = eip = frame[0];
+    e->ebp = frame[1];
+    e->edx = frame[2];
+    e->ecx = frame[3];
+    e->esp += 4;
+    e->eflags |= EFLAGS_IF;
+
+    syscall(e);
+    exception_return(e);
+    return e->eip == eip;
 }
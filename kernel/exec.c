@@ -10,6 +10,7 @@
 #include <sched.h>
 #include <fs.h>
 #include <signal.h>
+#include <vdso.h>
 
 static int verify_elf(struct inode *exe, struct elf32_ehdr *ehdr)
 {
@@ -102,12 +103,12 @@ int sys_execve(struct exception *e)
     else if (ret < 0)
         goto read_error;
 
-    printk("execve: pid %d: %s\n", proc->pid, filename);
+    printk("execve: pid %d: %s\n", curproc->pid, filename);
 
     sched_stop_other_threads();
     mm_free_proc_memory();
-    if (proc->exe)
-        iput(proc->exe);
+    if (curproc->exe)
+        iput(curproc->exe);
 
     ret = load_elf(exe, &ehdr);
     if (ret == -ENOEXEC)
@@ -116,20 +117,20 @@ int sys_execve(struct exception *e)
         goto read_error;
     mm_add_mapping(0xffffe000, PAGE_SIZE, VMAP_WRITABLE | VMAP_STACK,
                    0, 0, NULL);
+    if (!vdso_map())
+        printk("execve: pid %d: could not map vdso\n", curproc->pid);
 
-    proc->exe = exe;
-    proc->rtime = 0;
-    proc->ktime = 0;
-    proc->utime = 0;
-    thread->tid = 1;
-    proc->next_tid = 2;
+    curproc->exe = exe;
+    curthread->tid = 1;
+    fpu_reset();
+    curproc->next_tid = 2;
 
     for (i = 0; i < 32; i++) {
-        if (proc->sigdisp[i] > SIG_IGN)
-            proc->sigdisp[i] = SIG_DFL;
+        if (curproc->sigdisp[i] > SIG_IGN)
+            curproc->sigdisp[i] = SIG_DFL;
     }
     for (i = 0; i < OPEN_MAX; i++) {
-        if (proc->files[i] && (proc->files[i]->flags & O_CLOEXEC))
+        if (curproc->files[i] && (curproc->files[i]->flags & O_CLOEXEC))
             close(i);
     }
 
@@ -6,6 +6,7 @@
 
 #include <kernel.h>
 #include <fs.h>
+#include <buffer.h>
 #include <sched.h>
 #include <x86.h>
 #include <chrdev.h>
@@ -32,14 +33,14 @@ int open(char *path, unsigned int flags, unsigned int creat_mode)
     if (f == files + NUM_FILES)
         return -ENFILE;
 
-    spin_lock(&proc->files_lock);
+    spin_lock(&curproc->files_lock);
     for (fd = 0; fd < OPEN_MAX; fd++) {
-        if (proc->files[fd] == 0) {
-            proc->files[fd] = f;
+        if (curproc->files[fd] == 0) {
+            curproc->files[fd] = f;
             break;
         }
     }
-    spin_unlock(&proc->files_lock);
+    spin_unlock(&curproc->files_lock);
     if (fd == OPEN_MAX) {
         f->count = 0;
         return EMFILE;
@@ -48,13 +49,14 @@ int open(char *path, unsigned int flags, unsigned int creat_mode)
     /* TODO: create file if path not found and O_CREAT specified */
     ret = ilookup(&f->inode, path);
     if (ret) {
-        proc->files[fd] = NULL;
+        curproc->files[fd] = NULL;
         f->count = 0;
         return ret;
     }
 
     f->flags = flags;
     f->pos = 0;
+    memset(&f->ra, 0, sizeof(f->ra));
 
     /* TODO: char dev driver open */
 
@@ -65,10 +67,10 @@ int close(int fd)
 {
     struct file *f;
 
-    if (fd < 0 || fd >= OPEN_MAX || proc->files[fd] == NULL)
+    if (fd < 0 || fd >= OPEN_MAX || curproc->files[fd] == NULL)
         return -EBADF;
-    f = proc->files[fd];
-    proc->files[fd] = NULL;
+    f = curproc->files[fd];
+    curproc->files[fd] = NULL;
 
     /* TODO: char dev driver close */
 
@@ -82,32 +84,59 @@ int dup(int fd)
     struct file *f;
     int i;
 
-    if (fd < 0 || fd >= OPEN_MAX || proc->files[fd] == NULL)
+    if (fd < 0 || fd >= OPEN_MAX || curproc->files[fd] == NULL)
         return -EBADF;
-    f = proc->files[fd];
+    f = curproc->files[fd];
 
-    spin_lock(&proc->files_lock);
+    spin_lock(&curproc->files_lock);
     for (i = 0; i < OPEN_MAX; i++) {
-        if (proc->files[i] == NULL) {
-            proc->files[i] = f;
+        if (curproc->files[i] == NULL) {
+            curproc->files[i] = f;
             inc_dword(&f->count);
             break;
         }
     }
-    spin_unlock(&proc->files_lock);
+    spin_unlock(&curproc->files_lock);
 
     return i == OPEN_MAX ? -EMFILE : i;
 }
 
+/**
+ * Write back the data of an open file and wait for it.
+ */
+int fsync(int fd)
+{
+    if (fd < 0 || fd >= OPEN_MAX || curproc->files[fd] == NULL)
+        return -EBADF;
+    return ifsync(curproc->files[fd]->inode);
+}
+
+/**
+ * Like fsync(), but may skip metadata not needed to read the data back. Since
+ * inodes aren't written yet, this is the same.
+ */
+int fdatasync(int fd)
+{
+    return fsync(fd);
+}
+
+/**
+ * Write back every dirty buffer and wait for it.
+ */
+int sync()
+{
+    return sync_buffers(0);
+}
+
 int read(int fd, char *buf, unsigned int length)
 {
     struct file *f;
     bool setpos;
     int ret;
 
-    if (fd < 0 || fd >= OPEN_MAX || proc->files[fd] == NULL)
+    if (fd < 0 || fd >= OPEN_MAX || curproc->files[fd] == NULL)
         return -EBADF;
-    f = proc->files[fd];
+    f = curproc->files[fd];
 
     if ((f->flags & O_ACCMODE) == O_WRONLY)
         return -EBADF;
@@ -131,7 +160,7 @@ int read(int fd, char *buf, unsigned int length)
         break;
     case IFREG:
     case IFBLK:
-        ret = iread(f->inode, buf, f->pos, length);
+        ret = iread_ra(f->inode, &f->ra, buf, f->pos, length);
         break;
     default:
         ret = -ENOSYS;
@@ -153,9 +182,9 @@ int write(int fd, char *buf, unsigned int length)
     bool setpos;
     int ret;
 
-    if (fd < 0 || fd >= OPEN_MAX || proc->files[fd] == NULL)
+    if (fd < 0 || fd >= OPEN_MAX || curproc->files[fd] == NULL)
         return -EBADF;
-    f = proc->files[fd];
+    f = curproc->files[fd];
 
     if ((f->flags & O_ACCMODE) == O_RDONLY)
         return -EBADF;
@@ -189,6 +218,12 @@ int write(int fd, char *buf, unsigned int length)
         goto done;
     }
 
+    /* Sync before moving the position, so a failed write leaves it alone. */
+    if (ret > 0 && (f->flags & (O_SYNC | O_DSYNC))
+        && MODE_TYPE(f->inode->mode) != IFCHR) {
+        if (ifsync(f->inode) < 0)
+            ret = -EIO;
+    }
     if (setpos && ret >= 0)
         f->pos += ret;
 
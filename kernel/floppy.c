@@ -5,12 +5,10 @@
  */
 
 /*
- * NOTE: At the moment this driver is terrible, as it only supports one floppy
- * drive and, even worse, there is no queueing, so if multiple threads are
- * trying to submit a command at once, they will happen essentially randomly
- * depending on which one happens to lock the mutex first. This also means the
- * head will move a lot more than necessary due to the randomness of the LBA of
- * each command, which hurts performance and wears out the drive faster.
+ * NOTE: This driver only supports one floppy drive. Requests reach it from the
+ * block layer's request queue thread (see blkdev.c), which merges adjacent
+ * blocks and orders requests by block, so the head sweeps across the disk
+ * rather than moving at random between concurrent users.
  */
 
 #include <kernel.h>
@@ -21,6 +19,7 @@
 #include <mm.h>
 #include <x86.h>
 #include <floppy.h>
+#include <workqueue.h>
 
 static struct geom floppy_geom = {
     .cyls = 80,
@@ -29,23 +28,71 @@ static struct geom floppy_geom = {
 };
 
 static bool got_irq;
+static struct wait_queue irq_wait;
 static int cur_cyl;
-static int motor_timer;
+static unsigned int motor_timer; /* Jiffies at which to turn off the motor */
 static spinlock_t floppy_lock;
 
+static void motor_off(void *data);
+static struct work motor_work = WORK_INIT(motor_off, NULL);
+
 static uint8_t *dma_buffer = (uint8_t*) 0x1000;
 
+#define CYL_SECTS (2 * 18)
+#define TRACK_PAGES ((CYL_SECTS * SECTOR_SIZE + PAGE_SIZE - 1) / PAGE_SIZE)
+
+/* Bounce windows alternated between commands, so one can be copied to or from
+ * while the controller transfers through the other. The first is dma_buffer,
+ * and both are big enough for a cylinder. */
+static uint8_t *dma_windows[2];
+static uint32_t dma_windows_phys[2];
+
+/* Position within the segments of a bio */
+struct bio_pos {
+    int vec;
+    unsigned int off;
+};
+
+/* Read or write command, prepared or in flight */
+struct fd_cmd {
+    struct chs chs;        /* Where the command starts */
+    int nsect;             /* Sectors transferred by the command */
+    bool write;
+    uint32_t paddr;        /* Physical address of the transfer */
+    uint8_t *window;       /* Bounce window, or NULL if transferring in place */
+    int first;             /* Offset in the cylinder of the bio's sectors */
+    int count;             /* Number of the bio's sectors */
+    struct bio_pos pos;    /* Bio position of the first of them */
+};
+
+/* Cylinder held in the track cache */
+struct track {
+    uint8_t drive;
+    int cyl;                       /* Cached cylinder, or -1 */
+    unsigned int stamp;            /* track_clock when last used */
+    uint8_t *pages[TRACK_PAGES];   /* Data, allocated on first use */
+};
+
+static struct track tracks[FLOPPY_CACHE_CYLS];
+static unsigned int track_clock;
+
 void handle_floppy_irq()
 {
     got_irq = true;
+    wait_queue_wake(&irq_wait);
 }
 
-/* TODO: replace with scheduler function to block on an IRQ */
+/* Sleep until the controller interrupts. Yielding instead would keep the big
+ * kernel lock from the interrupt handler if nothing else could run here. */
 static void wait_irq()
 {
+    uint32_t flags;
+
+    SAVE_INTERRUPTS(flags);
     while (!got_irq)
-        yield_thread();
+        wait_queue_sleep(&irq_wait);
     got_irq = false;
+    RESTORE_INTERRUPTS(flags);
 }
 
 /* TODO: limited number of retries */
@@ -79,13 +126,28 @@ static void set_motor(int drive, bool setting)
 
     /* Let motor spin up. */
     if (setting && (dor & (DOR_MOTOR0 << drive)) == 0)
-        sleep_thread(15);
+        sleep_thread(150 * NSEC_PER_MSEC);
 }
 
-void floppy_update_timer()
+/* Turn the motor off from a worker thread, unless another operation started
+ * since the timer ran out. */
+static void motor_off(void *data)
 {
-    if (motor_timer > 0 && --motor_timer == 0)
+    spin_lock(&floppy_lock);
+    if (motor_timer == 0)
         set_motor(0, false);
+    spin_unlock(&floppy_lock);
+}
+
+/**
+ * Called from the timer softirq to check the motor shutoff timer.
+ */
+void floppy_update_timer()
+{
+    if (motor_timer > 0 && motor_timer <= jiffies()) {
+        motor_timer = 0;
+        schedule_work(&motor_work);
+    }
 }
 
 static void sense_interrupt(uint8_t *st0, uint8_t *cyl)
@@ -142,14 +204,14 @@ static bool calibrate(uint8_t drive)
 
 /* DMA is handled here currently since this is the only driver that uses it for
    now, but there may be a general-purpose DMA driver in the future. */
-static void start_dma(void *buf, int length, bool write)
+static void start_dma(uint32_t paddr, int length, bool write)
 {
     length--;
     out_byte_wait(DMA_MASK, 0x6);
     out_byte_wait(DMA_FLIPFLOP, 0xff);
-    out_byte_wait(DMA2_ADDR, (uint32_t)buf & 0xff);
-    out_byte_wait(DMA2_ADDR, ((uint32_t)buf >> 8) & 0xff);
-    out_byte_wait(DMA2_PAGE, 0);
+    out_byte_wait(DMA2_ADDR, paddr & 0xff);
+    out_byte_wait(DMA2_ADDR, (paddr >> 8) & 0xff);
+    out_byte_wait(DMA2_PAGE, (paddr >> 16) & 0xff);
     out_byte_wait(DMA_FLIPFLOP, 0xff);
     out_byte_wait(DMA2_COUNT, length & 0xff);
     out_byte_wait(DMA2_COUNT, (length >> 8) & 0xff);
@@ -161,26 +223,35 @@ static void start_dma(void *buf, int length, bool write)
     out_byte_wait(DMA_MASK, 0x2);
 }
 
-static bool rw_cmd(uint8_t drive, struct chs *chs, int nblk, bool write)
+/* Program the DMA controller and send a read or write command, without
+ * waiting for it to finish. */
+static void start_cmd(uint8_t drive, struct fd_cmd *cmd)
 {
-    uint8_t st0, st1, st2;
+    start_dma(cmd->paddr, cmd->nsect * SECTOR_SIZE, cmd->write);
 
-    for (int i = 0; i < 3; i++) {
-        start_dma(dma_buffer, nblk * 512, write);
+    if (cmd->write)
+        fifo_write(FDC_WRITE | FDC_MF | FDC_MT);
+    else
+        fifo_write(FDC_READ | FDC_MF | FDC_MT);
+    fifo_write((cmd->chs.head << 2) | drive);
+    fifo_write(cmd->chs.cyl);
+    fifo_write(cmd->chs.head);
+    fifo_write(cmd->chs.sect);
+    fifo_write(2);
+    fifo_write(floppy_geom.sects);
+    fifo_write(0x1b);
+    fifo_write(0xff);
+}
 
-        if (write)
-            fifo_write(FDC_WRITE | FDC_MF | FDC_MT);
-        else
-            fifo_write(FDC_READ | FDC_MF | FDC_MT);
-        fifo_write((chs->head << 2) | drive);
-        fifo_write(chs->cyl);
-        fifo_write(chs->head);
-        fifo_write(chs->sect);
-        fifo_write(2);
-        fifo_write(floppy_geom.sects);
-        fifo_write(0x1b);
-        fifo_write(0xff);
+/* Wait for a command to finish and read its result phase, issuing it again up
+ * to twice if it fails. */
+static bool finish_cmd(uint8_t drive, struct fd_cmd *cmd)
+{
+    uint8_t st0, st1, st2;
 
+    for (int i = 0; i < 3; i++) {
+        if (i > 0)
+            start_cmd(drive, cmd);
         wait_irq();
 
         st0 = fifo_read();
@@ -199,19 +270,179 @@ static bool rw_cmd(uint8_t drive, struct chs *chs, int nblk, bool write)
     return false;
 }
 
-static bool floppy_io(void *buffer, uint8_t drive, struct chs *chs, int nblk,
-                      bool write)
+static struct track *find_track(uint8_t drive, int cyl)
 {
-    int rem_sect, cmd_nblk;
-    bool ret = true;
+    for (int i = 0; i < FLOPPY_CACHE_CYLS; i++) {
+        if (tracks[i].cyl == cyl && tracks[i].drive == drive) {
+            tracks[i].stamp = ++track_clock;
+            return &tracks[i];
+        }
+    }
+    return NULL;
+}
 
-    spin_lock(&floppy_lock);
+static uint8_t *track_sector(struct track *t, int sect)
+{
+    return t->pages[sect * SECTOR_SIZE / PAGE_SIZE]
+           + sect * SECTOR_SIZE % PAGE_SIZE;
+}
+
+/* Copy sectors between a cached cylinder, from sector offset sect, and a
+ * contiguous buffer. */
+static void track_copy(struct track *t, int sect, uint8_t *buf, int nsect,
+                       bool to_track)
+{
+    for (; nsect > 0; nsect--, sect++, buf += SECTOR_SIZE) {
+        if (to_track)
+            memcpy(track_sector(t, sect), buf, SECTOR_SIZE);
+        else
+            memcpy(buf, track_sector(t, sect), SECTOR_SIZE);
+    }
+}
+
+/* Take the least recently used cache slot for a cylinder about to be filled.
+ * Returns NULL if there's no memory for it. */
+static struct track *take_track(uint8_t drive, int cyl)
+{
+    struct track *t = &tracks[0];
+
+    for (int i = 1; i < FLOPPY_CACHE_CYLS; i++) {
+        if (tracks[i].stamp < t->stamp)
+            t = &tracks[i];
+    }
+    for (int i = 0; i < TRACK_PAGES; i++) {
+        if (!t->pages[i]
+            && !(t->pages[i] = (uint8_t *)alloc_kernel_page(PAGE_WRITABLE)))
+            return NULL;
+    }
+
+    t->drive = drive;
+    t->cyl = cyl;
+    t->stamp = ++track_clock;
+    return t;
+}
+
+/* Set up a command reading both tracks of a cylinder. */
+static void read_cyl_cmd(struct fd_cmd *cmd, int cyl, uint8_t *window,
+                         uint32_t paddr)
+{
+    cmd->chs.cyl = cyl;
+    cmd->chs.head = 0;
+    cmd->chs.sect = 1;
+    cmd->nsect = CYL_SECTS;
+    cmd->write = false;
+    cmd->window = window;
+    cmd->paddr = paddr;
+}
+
+/* Get the sector at a bio position, and move past it. */
+static uint8_t *bio_next(struct bio *bio, struct bio_pos *pos)
+{
+    uint8_t *p = (uint8_t *)bio->vecs[pos->vec].data + pos->off;
+
+    pos->off += SECTOR_SIZE;
+    if (pos->off == bio->vecs[pos->vec].len) {
+        pos->vec++;
+        pos->off = 0;
+    }
+    return p;
+}
+
+/* Copy sectors of a bio from pos to or from a contiguous buffer. */
+static void bio_copy(struct bio *bio, struct bio_pos pos, uint8_t *buf,
+                     int nsect, bool to_buf)
+{
+    for (; nsect > 0; nsect--, buf += SECTOR_SIZE) {
+        if (to_buf)
+            memcpy(buf, bio_next(bio, &pos), SECTOR_SIZE);
+        else
+            memcpy(bio_next(bio, &pos), buf, SECTOR_SIZE);
+    }
+}
+
+/* Copy sectors of a bio from pos to or from a cached cylinder, from sector
+ * offset sect. */
+static void bio_copy_track(struct bio *bio, struct bio_pos pos,
+                           struct track *t, int sect, int nsect, bool to_track)
+{
+    for (; nsect > 0; nsect--, sect++) {
+        if (to_track)
+            memcpy(track_sector(t, sect), bio_next(bio, &pos), SECTOR_SIZE);
+        else
+            memcpy(bio_next(bio, &pos), track_sector(t, sect), SECTOR_SIZE);
+    }
+}
+
+/* Get the physical address of sectors of a bio from pos, if the DMA controller
+ * can transfer them in place. They must be aligned, physically contiguous,
+ * below DMA_LIMIT and within one 64 KiB page of the controller. Returns 0 if
+ * not, and they have to go through the bounce buffer. */
+static uint32_t bio_dma_addr(struct bio *bio, struct bio_pos pos, int nsect)
+{
+    uint32_t start = 0, end = 0;
+    uint8_t *p;
+
+    for (; nsect > 0; nsect--) {
+        p = bio_next(bio, &pos);
+        if ((uint32_t)p % SECTOR_SIZE != 0)
+            return 0;
+        if (!start)
+            start = end = vtophys((uint32_t)p);
+        else if (vtophys((uint32_t)p) != end)
+            return 0;
+        end += SECTOR_SIZE;
+    }
+    if (end > DMA_LIMIT || start >> 16 != (end - 1) >> 16)
+        return 0;
+    return start;
+}
+
+/* Turn the motor on for a command, if it isn't yet during this operation. */
+static void start_motor(uint8_t drive, bool *on)
+{
+    if (*on)
+        return;
     motor_timer = 0; /* Ensure motor isn't turned off during operation */
     set_motor(drive, true);
+    *on = true;
+}
+
+/* Finish with a command's data once it's done. Written sectors update the
+ * cached cylinder, and a cylinder read is cached and its bio sectors copied out
+ * of the bounce window if it went through one. */
+static void complete_cmd(uint8_t drive, struct bio *bio, struct fd_cmd *cmd)
+{
+    struct track *t;
+
+    if (cmd->write) {
+        if ((t = find_track(drive, cmd->chs.cyl)))
+            bio_copy_track(bio, cmd->pos, t, cmd->first, cmd->count, true);
+    } else if (!cmd->window) {
+        if ((t = take_track(drive, cmd->chs.cyl)))
+            bio_copy_track(bio, cmd->pos, t, 0, CYL_SECTS, true);
+    } else {
+        if ((t = take_track(drive, cmd->chs.cyl)))
+            track_copy(t, 0, cmd->window, CYL_SECTS, true);
+        bio_copy(bio, cmd->pos, cmd->window + cmd->first * SECTOR_SIZE,
+                 cmd->count, false);
+    }
+}
+
+static bool floppy_io(uint8_t drive, struct chs *chs, struct bio *bio)
+{
+    bool write = bio->rw == WRITE;
+    int nblk = bio->nsectors;
+    int rem_sect, cmd_nblk, first, n = 0;
+    struct bio_pos pos = { 0, 0 };
+    struct fd_cmd cmds[2], *cmd, *prev = NULL;
+    struct track *t;
+    uint32_t paddr;
+    bool motor = false;
+    bool ret = true;
+
+    spin_lock(&floppy_lock);
 
     while (nblk > 0) {
-        cur_cyl = chs->cyl;
- 
         /* Thanks to multi-track mode, if we start on head 0, we can read/write
          * up to two whole tracks with a single command. Otherwise if starting
          * on head 1 we can read/write up to the end of the current track. */
@@ -219,54 +450,166 @@ static bool floppy_io(void *buffer, uint8_t drive, struct chs *chs, int nblk,
                    ? (floppy_geom.sects + 1 - chs->sect)
                    : (2 * floppy_geom.sects + 1 - chs->sect);
         cmd_nblk = MIN(rem_sect, nblk);
+        first = chs->head * floppy_geom.sects + chs->sect - 1;
+        t = find_track(drive, chs->cyl);
 
-        printk("fd%d: %s block at CHS:%d-%d-%d\n", drive,
-               write ? "write" : "read", chs->cyl, chs->head, chs->sect);
-
-        if (write)
-            memcpy(dma_buffer, buffer, cmd_nblk * 512);
-        if (!rw_cmd(drive, chs, cmd_nblk, write)) {
-            ret = false;
-            goto end;
+        /* Reads of a cached cylinder don't need the drive at all. */
+        if (!write && t) {
+            bio_copy_track(bio, pos, t, first, cmd_nblk, false);
+            goto next;
         }
-        if (!write)
-            memcpy(buffer, dma_buffer, cmd_nblk * 512);
 
-        nblk -= cmd_nblk;
-        buffer += cmd_nblk * 512;
-        if (chs->head == 1) {
-            chs->cyl++;
-            chs->head = 0;
+        /* The DMA controller works on the bio's pages directly where it can
+         * reach them, and otherwise on a bounce window. Reads fetch the whole
+         * cylinder, to be cached. */
+        cmd = &cmds[n % 2];
+        cmd->pos = pos;
+        cmd->first = first;
+        cmd->count = cmd_nblk;
+        if (write) {
+            cmd->chs = *chs;
+            cmd->nsect = cmd_nblk;
+            cmd->write = true;
+            cmd->window = NULL;
+            cmd->paddr = bio_dma_addr(bio, pos, cmd_nblk);
+            if (!cmd->paddr) {
+                cmd->window = dma_windows[n % 2];
+                cmd->paddr = dma_windows_phys[n % 2];
+                bio_copy(bio, pos, cmd->window, cmd_nblk, true);
+            }
+        } else if (cmd_nblk == CYL_SECTS
+                   && (paddr = bio_dma_addr(bio, pos, cmd_nblk))) {
+            read_cyl_cmd(cmd, chs->cyl, NULL, paddr);
+        } else {
+            read_cyl_cmd(cmd, chs->cyl, dma_windows[n % 2],
+                         dma_windows_phys[n % 2]);
         }
-        else
-            chs->head = 1;
-        chs->sect = 0;
+        n++;
+
+        /* Issue the command as soon as the previous one is done, then deal
+         * with the previous one's data while the drive is busy. */
+        start_motor(drive, &motor);
+        if (prev && !finish_cmd(drive, prev))
+            goto fail;
+        cur_cyl = cmd->chs.cyl;
+        printk("fd%d: %s %d blocks at CHS:%d-%d-%d\n", drive,
+               write ? "write" : "read", cmd->nsect,
+               cmd->chs.cyl, cmd->chs.head, cmd->chs.sect);
+        start_cmd(drive, cmd);
+        if (prev)
+            complete_cmd(drive, bio, prev);
+        prev = cmd;
+
+next:
+        /* Commands end at the end of a cylinder, so the next one starts at
+         * the beginning of the following cylinder. */
+        for (int i = 0; i < cmd_nblk; i++)
+            bio_next(bio, &pos);
+        nblk -= cmd_nblk;
+        chs->cyl++;
+        chs->head = 0;
+        chs->sect = 1;
     }
 
+    if (prev && !finish_cmd(drive, prev))
+        goto fail;
+    if (prev)
+        complete_cmd(drive, bio, prev);
+    goto end;
+
+fail:
+    if (prev->write && (t = find_track(drive, prev->chs.cyl)))
+        t->cyl = -1; /* Contents on disk now unknown */
+    ret = false;
 end:
-    motor_timer = 200; /* Start countdown to shutoff. */
+    if (motor)
+        motor_timer = jiffies() + 200; /* Start countdown to shutoff. */
     spin_unlock(&floppy_lock);
     return ret;
 }
 
 /**
- * Submit an I/O request to the floppy drive controller. Blocks the calling
- * task until the request is serviced, and returns whether the operation
+ * Carry out a bio on a floppy drive, with one controller command per cylinder
+ * it touches. Blocks the calling task until it's done, and returns whether it
  * completed successfully.
  */
-bool floppy_rw(void *buf, uint8_t minor, int lba, int nblk, bool write)
+bool floppy_submit_bio(struct bio *bio)
 {
     struct chs chs;
+    uint8_t minor = MINOR(bio->dev);
+    unsigned int nsects = floppy_geom.cyls * floppy_geom.heads
+                          * floppy_geom.sects;
 
     if (minor >= 4)
         return false;
-    if (lba + nblk >= floppy_geom.cyls * floppy_geom.heads * floppy_geom.sects)
+    if (bio->sector + bio->nsectors > nsects)
         return false;
 
-    lba_to_chs(&floppy_geom, lba, &chs);
-    return floppy_io(buf, minor, &chs, nblk, write);
+    lba_to_chs(&floppy_geom, bio->sector, &chs);
+    return floppy_io(minor, &chs, bio);
 }
 
+/**
+ * Submit an I/O request to the floppy drive controller. Blocks the calling
+ * task until the request is serviced, and returns whether the operation
+ * completed successfully.
+ */
+bool floppy_rw(void *buf, uint8_t minor, int lba, int nblk, bool write)
+{
+    struct bio bio;
+
+    if (lba < 0 || nblk <= 0)
+        return false;
+
+    bio.rw = write ? WRITE : READ;
+    bio.dev = (2 << 8) | minor;
+    bio.sector = lba;
+    bio.nsectors = nblk;
+    bio.nvecs = 1;
+    bio.vecs[0].data = buf;
+    bio.vecs[0].len = nblk * SECTOR_SIZE;
+    return floppy_submit_bio(&bio);
+}
+
+#ifdef FLOPPY_PRELOAD
+/* Read the whole disk into the track cache, a cylinder per command, caching
+ * each one while the next is read. */
+static void preload(uint8_t drive)
+{
+    struct fd_cmd cmds[2], *cmd, *prev = NULL;
+    int cyl, loaded = 0;
+
+    spin_lock(&floppy_lock);
+    motor_timer = 0;
+    set_motor(drive, true);
+    for (cyl = 0; cyl < floppy_geom.cyls; cyl++) {
+        cmd = &cmds[cyl % 2];
+        read_cyl_cmd(cmd, cyl, dma_windows[cyl % 2], dma_windows_phys[cyl % 2]);
+        cmd->count = 0;
+        if (prev && !finish_cmd(drive, prev)) {
+            prev = NULL;
+            break;
+        }
+        start_cmd(drive, cmd);
+        if (prev)
+            complete_cmd(drive, NULL, prev);
+        prev = cmd;
+    }
+    if (prev && finish_cmd(drive, prev))
+        complete_cmd(drive, NULL, prev);
+    motor_timer = jiffies() + 200;
+
+    for (int i = 0; i < FLOPPY_CACHE_CYLS; i++) {
+        if (tracks[i].cyl >= 0)
+            loaded++;
+    }
+    spin_unlock(&floppy_lock);
+
+    printk("floppy: preloaded %d of %d cylinders\n", loaded,
+           floppy_geom.cyls);
+}
+#endif
+
 void floppy_init()
 {
     uint32_t addr;
@@ -283,6 +626,19 @@ void floppy_init()
             panic("failed to map DMA buffer");
     }
 
+    /* The second bounce window comes from anywhere the DMA controller can
+     * reach. */
+    dma_windows[0] = dma_buffer;
+    dma_windows_phys[0] = (uint32_t)dma_buffer;
+    dma_windows[1] = (uint8_t *)alloc_kernel_dma_pages(TRACK_PAGES,
+                                                       PAGE_WRITABLE);
+    if (!dma_windows[1])
+        panic("failed to allocate DMA buffer");
+    dma_windows_phys[1] = vtophys((uint32_t)dma_windows[1]);
+
+    for (int i = 0; i < FLOPPY_CACHE_CYLS; i++)
+        tracks[i].cyl = -1;
+
     out_byte_wait(FDC_DOR, 0);
     out_byte_wait(FDC_DOR, DOR_ENABLE | DOR_DMA);
     wait_irq();
@@ -302,8 +658,12 @@ void floppy_init()
     out_byte_wait(FDC_CCR, 0); /* 500 kb/s transfer speed for 1.44m disks */
     configure();
     specify(8, 5, 0);
-    if (calibrate(0))
+    if (calibrate(0)) {
         printk("floppy: init successful\n");
-    else
+#ifdef FLOPPY_PRELOAD
+        preload(0);
+#endif
+    } else {
         printk("floppy: init failed\n");
+    }
 }
@@ -0,0 +1,183 @@
+/**
+ * The SakuraOS Kernel
+ * Copyright 2025 Adam Judge
+ * File: fpu.c
+ */
+
+/*
+ * Lazy FPU context switching. The x87/SSE registers are not switched with the
+ * rest of a thread's context. Instead CR0.TS is set on a context switch, and
+ * the first FPU instruction a thread runs afterwards traps to fpu_handle_trap(),
+ * which loads its saved state and makes it the CPU's FPU owner. Threads that
+ * never touch the FPU never pay for it.
+ *
+ * A thread's state is saved when it's switched out after using the FPU, so it
+ * can be loaded on any CPU. The registers are left as they are though, and if
+ * it comes back to the same CPU before anyone else uses the FPU there, TS is
+ * simply cleared again.
+ */
+
+#include <kernel.h>
+#include <x86.h>
+#include <exception.h>
+#include <sched.h>
+#include <smp.h>
+#include <signal.h>
+#include <fpu.h>
+
+static bool has_fpu, has_fxsr, has_sse;
+
+static void fpu_save(struct thread *t)
+{
+    if (has_fxsr) {
+        __asm__ __volatile__("fxsave %0" : "=m"(t->fpu));
+    } else {
+        /* FSAVE also reinitializes the FPU, so nothing stays loaded. */
+        __asm__ __volatile__("fnsave %0; fwait" : "=m"(t->fpu));
+        this_cpu()->fpu_owner = NULL;
+    }
+}
+
+static void fpu_restore(struct thread *t)
+{
+    if (has_fxsr)
+        __asm__ __volatile__("fxrstor %0" : : "m"(t->fpu));
+    else
+        __asm__ __volatile__("frstor %0" : : "m"(t->fpu));
+}
+
+static void fpu_load_initial()
+{
+    uint32_t mxcsr = MXCSR_DEFAULT;
+
+    __asm__ __volatile__("fninit");
+    if (has_sse)
+        __asm__ __volatile__("ldmxcsr %0" : : "m"(mxcsr));
+}
+
+/**
+ * Enable the FPU on this CPU, with FXSAVE and SSE if supported, and set TS so
+ * the first use traps. Called by each CPU as it starts.
+ */
+void fpu_init()
+{
+    uint32_t regs[4], cr0;
+
+    read_cpuid(1, regs);
+    has_fpu = (regs[3] & CPUID_FPU) != 0;
+    has_fxsr = (regs[3] & CPUID_FXSR) != 0;
+    has_sse = has_fxsr && (regs[3] & CPUID_SSE) != 0;
+
+    cr0 = read_cr0() | CR0_TS;
+    if (has_fpu)
+        cr0 = (cr0 & ~CR0_EM) | CR0_MP | CR0_NE;
+    else
+        cr0 |= CR0_EM;
+    write_cr0(cr0);
+
+    if (has_fxsr)
+        write_cr4(read_cr4() | CR4_OSFXSR | (has_sse ? CR4_OSXMMEXCPT : 0));
+
+    if (this_cpu()->id == 0)
+        printk("fpu: %s%s\n", has_fpu ? "x87" : "none",
+               has_sse ? ", SSE with FXSAVE" : has_fxsr ? ", FXSAVE" : "");
+}
+
+/**
+ * Called by the scheduler with interrupts disabled just before switching from
+ * prev to next.
+ */
+void fpu_switch(struct thread *prev, struct thread *next)
+{
+    struct cpu *cpu = this_cpu();
+    uint32_t cr0 = read_cr0(), new_cr0;
+
+    /* TS is only ever clear while the FPU owner is running. */
+    if (!(cr0 & CR0_TS))
+        fpu_save(prev);
+
+    if (cpu->fpu_owner == next && next->fpu_cpu == cpu)
+        new_cr0 = cr0 & ~CR0_TS;
+    else
+        new_cr0 = cr0 | CR0_TS;
+    if (new_cr0 != cr0)
+        write_cr0(new_cr0);
+}
+
+/**
+ * Device-not-available exception handler, for the first FPU instruction after
+ * a context switch.
+ */
+void fpu_handle_trap(struct exception *e)
+{
+    struct cpu *cpu;
+    struct thread *t;
+    uint32_t flags;
+
+    if (KERNEL_EXCEPTION((*e))) {
+        dump_exception(e);
+        panic("FPU used in kernel");
+    }
+    if (!has_fpu) {
+        curthread->signal |= (1 << SIGILL);
+        return;
+    }
+
+    SAVE_INTERRUPTS(flags);
+    cpu = this_cpu();
+    t = cpu->thread;
+    write_cr0(read_cr0() & ~CR0_TS);
+
+    if (cpu->fpu_owner != t || t->fpu_cpu != cpu) {
+        if (t->fpu_used) {
+            fpu_restore(t);
+        } else {
+            fpu_load_initial();
+            t->fpu_used = true;
+        }
+        cpu->fpu_owner = t;
+        t->fpu_cpu = cpu;
+    }
+    RESTORE_INTERRUPTS(flags);
+}
+
+/**
+ * Give a new thread a copy of the current thread's FPU state, for fork.
+ */
+void fpu_copy(struct thread *to)
+{
+    struct thread *t;
+    uint32_t flags;
+
+    SAVE_INTERRUPTS(flags);
+    t = curthread;
+    if (!(read_cr0() & CR0_TS)) {
+        fpu_save(t);
+        /* FSAVE left the FPU reset and unowned, so trap on the next use to
+         * load the saved state back. */
+        if (!has_fxsr)
+            write_cr0(read_cr0() | CR0_TS);
+    }
+    to->fpu = t->fpu;
+    to->fpu_used = t->fpu_used;
+    RESTORE_INTERRUPTS(flags);
+}
+
+/**
+ * Discard the current thread's FPU state, so its next use starts from the
+ * initial state. Used by exec.
+ */
+void fpu_reset()
+{
+    struct cpu *cpu;
+    uint32_t flags;
+
+    SAVE_INTERRUPTS(flags);
+    cpu = this_cpu();
+    curthread->fpu_used = false;
+    if (cpu->fpu_owner == curthread) {
+        cpu->fpu_owner = NULL;
+        write_cr0(read_cr0() | CR0_TS);
+    }
+    RESTORE_INTERRUPTS(flags);
+}
@@ -0,0 +1,132 @@
+/**
+ * The SakuraOS Kernel
+ * Copyright 2025 Adam Judge
+ * File: futex.c
+ */
+
+/*
+ * Fast user-space mutexes. User code does its locking with atomic operations
+ * on a word of memory, and only calls into the kernel to sleep when the lock is
+ * contended, or to wake sleepers. Waiting threads are kept in hashed queues
+ * keyed by the physical address of the word, so processes sharing memory can
+ * wait on each other too.
+ *
+ * Checking the word and queueing the waiter happen atomically with respect to
+ * futex_wake(), so a wakeup can't be lost between the two.
+ */
+
+#include <kernel.h>
+#include <x86.h>
+#include <mm.h>
+#include <sched.h>
+#include <signal.h>
+#include <futex.h>
+
+static struct thread *futex_queues[FUTEX_HASH_SIZE];
+
+static struct thread **futex_queue(uint32_t key)
+{
+    return &futex_queues[(key >> 2) & (FUTEX_HASH_SIZE - 1)];
+}
+
+/* Remove a thread from its wait queue, if it's still on it. */
+static void futex_unqueue(struct thread *t)
+{
+    struct thread **link;
+
+    for (link = futex_queue(t->futex_key); *link; link = &(*link)->futex_next) {
+        if (*link == t) {
+            *link = t->futex_next;
+            break;
+        }
+    }
+    t->futex_next = NULL;
+    t->futex_key = 0;
+}
+
+static bool user_word(uint32_t addr)
+{
+    return (addr & 3) == 0 && DIRENT(addr) >= 256;
+}
+
+/**
+ * Sleep until woken by futex_wake() on the same word, provided it still holds
+ * the expected value. Returns -EAGAIN if it doesn't, or -EINTR if a signal
+ * arrives first.
+ */
+int futex_wait(uint32_t addr, int val)
+{
+    volatile int *word = (volatile int *)addr;
+    struct thread **link;
+    int ret = 0;
+
+    if (!user_word(addr))
+        return -EINVAL;
+
+    /* Fault the page in first, since that may sleep. */
+    if (*word != val)
+        return -EAGAIN;
+
+    DISABLE_INTERRUPTS;
+    if (!(check_page(addr) & PAGE_PRESENT) || *word != val) {
+        ENABLE_INTERRUPTS;
+        return -EAGAIN;
+    }
+
+    curthread->futex_key = vtophys(addr);
+    curthread->futex_next = NULL;
+    for (link = futex_queue(curthread->futex_key); *link;
+         link = &(*link)->futex_next)
+        ;
+    *link = curthread;
+
+    curthread->state = TS_INTERRUPTIBLE;
+    schedule();
+
+    /* Still queued means something else woke us. */
+    if (curthread->futex_key) {
+        futex_unqueue(curthread);
+        if (signal_pending())
+            ret = -EINTR;
+    }
+    ENABLE_INTERRUPTS;
+    return ret;
+}
+
+/**
+ * Wake up to count threads waiting on a word, in the order they started
+ * waiting. Returns the number woken.
+ */
+int futex_wake(uint32_t addr, int count)
+{
+    struct thread **link, *t;
+    uint32_t key, flags;
+    int woken = 0;
+
+    if (!user_word(addr))
+        return -EINVAL;
+
+    SAVE_INTERRUPTS(flags);
+    if (!(check_page(addr) & PAGE_PRESENT)) {
+        RESTORE_INTERRUPTS(flags);
+        return 0;
+    }
+
+    key = vtophys(addr);
+    link = futex_queue(key);
+    while (*link && woken < count) {
+        t = *link;
+        if (t->futex_key != key) {
+            link = &t->futex_next;
+            continue;
+        }
+        *link = t->futex_next;
+        t->futex_next = NULL;
+        t->futex_key = 0;
+        wake_thread(t);
+        woken++;
+    }
+    RESTORE_INTERRUPTS(flags);
+
+    return woken;
+}
@@ -12,6 +12,51 @@ enum {
     WRITE
 };
 
+/**
+ * Request queue tunables. Adjacent buffers are merged into requests of up to
+ * BLK_MAX_REQUEST blocks. Requests are serviced in block order, except that
+ * one waiting longer than its expiry time in timer ticks goes first.
+ */
+#define BLK_MAX_REQUEST 36
+#define BLK_READ_EXPIRE 50
+#define BLK_WRITE_EXPIRE 500
+
+/**
+ * Block I/O statistics, reported by the block_stats system call.
+ */
+struct block_stats {
+    uint32_t submitted;  /* Buffers submitted for I/O */
+    uint32_t merged;     /* Buffers merged into an existing request */
+    uint32_t dispatched; /* Requests handed to drivers */
+    uint32_t commands;   /* Bios, so controller commands, issued */
+    uint32_t seeks;      /* Requests starting on another cylinder */
+    uint32_t seek_cyls;  /* Total cylinders moved by those seeks */
+};
+
+/**
+ * Most segments in a bio. Requests never hold more buffers than this.
+ */
+#define BIO_MAX_VECS BLK_MAX_REQUEST
+
+/* Segment of a bio, a multiple of 512 bytes */
+struct bio_vec {
+    void *data;
+    unsigned int len;
+};
+
+/**
+ * Scatter-gather transfer of consecutive sectors of a device, which a driver
+ * issues as a single command where the hardware allows.
+ */
+struct bio {
+    int rw;
+    dev_t dev;
+    unsigned int sector;    /* First 512-byte sector */
+    unsigned int nsectors;
+    int nvecs;
+    struct bio_vec vecs[BIO_MAX_VECS];
+};
+
 /* Block device geometry */
 struct geom {
     int cyls;
@@ -36,7 +81,16 @@ static inline void lba_to_chs(struct geom *geom, int lba, struct chs *chs)
     chs->sect = (lba % (geom->heads * geom->sects)) % geom->sects + 1;
 }
 
+struct buffer;
+
+void block_init();
+bool submit_buffer(int rw, struct buffer *b,
+                   void (*end_io)(struct buffer *b, bool ok));
 struct buffer *readblk(dev_t dev, unsigned int blk);
 bool block_rw(int rw, struct buffer *b);
+void block_get_stats(struct block_stats *stats);
+unsigned int block_dev_size(dev_t dev);
+unsigned int block_track_size(dev_t dev);
+int block_readahead(dev_t dev, unsigned int *blocks, int n);
 
 #endif
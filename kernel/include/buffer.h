@@ -8,21 +8,102 @@
 #define BUFFER_H
 
 #define BUF_BLOCKSIZE 1024
+#define BUFS_PER_PAGE (PAGE_SIZE / BUF_BLOCKSIZE)
+
+/**
+ * The buffer cache starts out with, and never shrinks below, NUM_BUFFERS
+ * buffers. It grows a page of buffers at a time on misses while more than
+ * BUF_GROW_MIN_FREE pages of memory are free, as long as at least 1 in
+ * BUF_GROW_MISS_RATIO lookups of the last BUF_WINDOW missed.
+ */
 #define NUM_BUFFERS 64
+#define BUF_GROW_MIN_FREE 256
+#define BUF_GROW_MISS_RATIO 8
+#define BUF_WINDOW 64
+
+/**
+ * Replacement follows 2Q. Blocks read for the first time go to a FIFO, A1in,
+ * which is evicted from first while it holds over BUF_A1IN_SHARE percent of
+ * the cache, so a long sequential read only recycles those. Blocks evicted
+ * from A1in are remembered in a ghost list, A1out, of up to half the cache
+ * size or BUF_GHOSTS entries. If one is read again, it goes to Am, which is
+ * managed as LRU. With BUF_PROTECT_META defined, filesystem metadata is kept
+ * in its own LRU segment, evicted from only while it holds over
+ * BUF_META_SHARE percent of the cache.
+ */
+#define BUF_A1IN_SHARE 25
+#define BUF_GHOSTS 1024
+#define BUF_PROTECT_META
+#define BUF_META_SHARE 50
+
+/**
+ * Dirty buffers are written back in the background by a flusher thread, which
+ * wakes every BUF_FLUSH_INTERVAL timer ticks to write those dirty for longer
+ * than BUF_DIRTY_EXPIRE, in batches of up to BUF_FLUSH_BATCH sorted by block.
+ * Once over BUF_DIRTY_BG_RATIO percent of the cache is dirty, it writes the
+ * oldest regardless of age, and past BUF_DIRTY_RATIO percent, processes
+ * dirtying buffers write a batch back themselves and wait for it. Dirty
+ * buffers are never evicted, so readers don't wait for writes.
+ */
+#define BUF_FLUSH_INTERVAL 500
+#define BUF_DIRTY_EXPIRE 3000
+#define BUF_FLUSH_BATCH 64
+#define BUF_DIRTY_BG_RATIO 10
+#define BUF_DIRTY_RATIO 40
+
+/**
+ * Number of buffer hash chains, which must be a power of two.
+ */
+#define BUF_HASH_SIZE 64
 
 #define BUF_LOCK 0x01
 #define BUF_UPTODATE 0x02
 #define BUF_DIRTY 0x04
+#define BUF_IO 0x08      /* Queued for I/O */
+#define BUF_ERROR 0x10   /* Last I/O failed */
 
+/**
+ * Cached disk block. The data lives in a separate block of a page, so that
+ * blocks are aligned and pack whole pages.
+ */
 struct buffer {
     int flags;
     dev_t dev;
     int block;
-    unsigned int time;
-    char data[BUF_BLOCKSIZE];
+    char *data;                /* BUF_BLOCKSIZE bytes of block data */
+    struct buffer *hash_next;  /* Hash chain for (dev, block) */
+    struct buffer *lru_next;   /* Replacement queue list */
+    struct buffer *lru_prev;
+    struct buf_page *page;     /* Page holding the data */
+    int queue;                 /* Replacement queue */
+    void (*end_io)(struct buffer *b, bool ok); /* I/O completion */
+    struct buffer *io_next;    /* Next buffer of an I/O request */
+    unsigned int dirtied;      /* Jiffies when it became dirty */
+    struct buffer *dirty_next; /* Dirty buffers, oldest first */
+    struct buffer *dirty_prev;
+};
+
+/**
+ * Buffer cache statistics, reported by the buffer_stats system call.
+ */
+struct buffer_stats {
+    uint32_t hits;      /* Lookups that found the block cached */
+    uint32_t misses;    /* Lookups that had to take over a buffer */
+    uint32_t nbuffers;  /* Buffers in the cache now */
+    uint32_t reclaimed; /* Pages given back under memory pressure */
+    uint32_t dirty;     /* Dirty buffers now */
+    uint32_t written;   /* Dirty buffers written back */
 };
 
+void buffer_init();
+void buffer_get_stats(struct buffer_stats *stats);
 struct buffer *getbuf(dev_t dev, int block);
+struct buffer *trygetbuf(dev_t dev, int block, bool *locked);
+void buf_mark_meta(struct buffer *b);
+void buf_mark_dirty(struct buffer *b);
 void relbuf(struct buffer *b);
+void balance_dirty();
+int sync_buffers(dev_t dev);
+int sync_blocks(dev_t dev, unsigned int *blocks, int n);
 
 #endif
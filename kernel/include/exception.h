@@ -46,6 +46,9 @@ enum {
     ENO_IRQ14 = 46,
     ENO_IRQ15 = 47,
 
+    ENO_IPI_RESCHEDULE = 240,
+    ENO_IPI_TLB_FLUSH = 241,
+
     ENO_SYSCALL = 255
 };
 
@@ -88,11 +88,25 @@ enum {
 
 #define SECTOR_SIZE 512
 
+/**
+ * A read that misses fetches its whole cylinder, both tracks, in one command,
+ * and the driver keeps the FLOPPY_CACHE_CYLS most recently used cylinders,
+ * updating them on writes. Define FLOPPY_PRELOAD to instead read the entire
+ * disk into memory at boot, after which reads never touch the drive.
+ */
+/* #define FLOPPY_PRELOAD */
+#ifdef FLOPPY_PRELOAD
+#define FLOPPY_CACHE_CYLS 80
+#else
+#define FLOPPY_CACHE_CYLS 8
+#endif
+
 /**
  * Submit an I/O request to the floppy drive controller. Blocks the calling
  * task until the request is serviced, and returns whether the operation
  * completed successfully.
  */
 bool floppy_rw(void *buf, uint8_t minor, int lba, int nblk, bool write);
+bool floppy_submit_bio(struct bio *bio);
 
 #endif
@@ -0,0 +1,32 @@
+/**
+ * The SakuraOS Kernel
+ * Copyright 2025 Adam Judge
+ * File: fpu.h
+ */
+
+#ifndef FPU_H
+#define FPU_H
+
+#include <kernel.h>
+
+/**
+ * Saved x87/SSE register state of a thread, in FXSAVE format, or FSAVE format
+ * on processors without FXSR.
+ */
+struct fpu_state {
+    uint8_t data[512];
+} __attribute__((aligned(16)));
+
+/* MXCSR value at reset, with all SIMD exceptions masked */
+#define MXCSR_DEFAULT 0x1f80
+
+struct thread;
+struct exception;
+
+void fpu_init();
+void fpu_switch(struct thread *prev, struct thread *next);
+void fpu_handle_trap(struct exception *e);
+void fpu_copy(struct thread *to);
+void fpu_reset();
+
+#endif
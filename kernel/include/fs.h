@@ -34,6 +34,20 @@ struct superblock {
 #define SB_SIZE 20
 #define NUM_SUPERS 8
 
+/**
+ * Sequential read-ahead state of an open file, or of an inode read other than
+ * through a file. Reads continuing where the last one ended double the window,
+ * up to RA_MAX_BLOCKS, while a seek closes it.
+ */
+struct readahead {
+    unsigned int next;    /* File block after the last one read */
+    unsigned int ahead;   /* File block after the last one read ahead */
+    unsigned int size;    /* Window size in blocks, or 0 if closed */
+};
+
+#define RA_MIN_BLOCKS 4
+#define RA_MAX_BLOCKS 36
+
 struct inode {
     unsigned short mode;
     unsigned short uid;
@@ -50,6 +64,7 @@ struct inode {
     unsigned int count;
     struct superblock *super;
     struct inode *mount;
+    struct readahead ra;
 };
 
 #define INODE_SIZE 32
@@ -97,6 +112,7 @@ struct file {
     unsigned int count;
     struct inode *inode;
     spinlock_t lock;
+    struct readahead ra;
 };
 
 #define NUM_FILES 64
@@ -127,7 +143,10 @@ int iget(struct inode **ip, struct superblock *s, unsigned int inum);
 struct inode *idup(struct inode *i);
 void iput(struct inode *i);
 int iread(struct inode *i, void *buf, unsigned int offset, unsigned int length);
+int iread_ra(struct inode *i, struct readahead *ra, void *buf,
+             unsigned int offset, unsigned int length);
 int iwrite(struct inode *i, void *buf, unsigned int offset, unsigned int length);
+int ifsync(struct inode *i);
 int ilookup(struct inode **ip, char *path);
 
 int open(char *path, unsigned int flags, unsigned int creat_mode);
@@ -135,5 +154,8 @@ int close(int fd);
 int read(int fd, char *buf, unsigned int length);
 int write(int fd, char *buf, unsigned int length);
 int dup(int fd);
+int fsync(int fd);
+int fdatasync(int fd);
+int sync();
 
 #endif
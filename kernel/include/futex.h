@@ -0,0 +1,24 @@
+/**
+ * The SakuraOS Kernel
+ * Copyright 2025 Adam Judge
+ * File: futex.h
+ */
+
+#ifndef FUTEX_H
+#define FUTEX_H
+
+/**
+ * Futex operations.
+ */
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+
+/**
+ * Number of futex wait queues. Must be a power of 2.
+ */
+#define FUTEX_HASH_SIZE 64
+
+int futex_wait(uint32_t addr, int val);
+int futex_wake(uint32_t addr, int count);
+
+#endif
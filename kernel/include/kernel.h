@@ -15,6 +15,10 @@
 #define MIN(a, b) (a < b ? a : b)
 #define MAX(a, b) (a > b ? a : b)
 
+#define offsetof(type, member) __builtin_offsetof(type, member)
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
 void vsprintf(char *buf, const char *fmt, void *argp);
 void printk(const char *fmt, ...);
 
@@ -24,6 +28,7 @@ void memcpy(void *dest, void *src, unsigned int n);
 typedef int spinlock_t;
 
 void spin_lock(spinlock_t *spinlock);
+bool spin_trylock(spinlock_t *spinlock);
 #define spin_unlock(spinlock) (*spinlock = 0)
 
 void panic(const char *msg);
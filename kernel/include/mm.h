@@ -19,7 +19,15 @@
 #define PAGE_PRESENT      (1<<0)
 #define PAGE_WRITABLE     (1<<1)
 #define PAGE_USER         (1<<2)
+#define PAGE_NOCACHE      (1<<4)
 #define PAGE_COPYONWRITE  (1<<9)
+#define PAGE_DMA          (1<<10) /* Take the page from below DMA_LIMIT */
+
+/**
+ * Pages below this address can be reached by the ISA DMA controller. They're
+ * kept apart, and only used for other allocations once all others run out.
+ */
+#define DMA_LIMIT 0x1000000
 
 /**
  * Round a size up to the nearest page size.
@@ -65,15 +73,68 @@ struct vmap {
 /**
  * Number of memory mappings per process.
  */
-#define NVMAPS 8
+#define NVMAPS 16
+
+/**
+ * Address range holding the stacks of threads other than the initial one, and
+ * the size of each thread's stack slot.
+ */
+#define THREAD_STACK_TOP    0xf0000000
+#define THREAD_STACK_BOTTOM 0xc0000000
+#define THREAD_STACK_SIZE   0x100000
+
+/**
+ * End of the kernel's part of every address space, where user space begins.
+ */
+#define KERNEL_SPACE_END 0x40000000
+#define KERNEL_PDES DIRENT(KERNEL_SPACE_END)
+
+/**
+ * Cache of fixed size kernel objects, carved out of kernel pages on demand.
+ * Freed objects are kept on a free list for reuse, linked through a pointer
+ * member given by link, and pages are never given back. The big kernel lock
+ * must be held.
+ */
+struct kcache {
+    unsigned int size;   /* Object size, at most a page */
+    unsigned int link;   /* Offset of the free list link in an object */
+    void *free;          /* Free objects */
+};
+
+#define KCACHE_INIT(type, member) \
+    { sizeof(type), offsetof(type, member), NULL }
+
+/**
+ * Free page count below which the page allocator asks caches to give memory
+ * back.
+ */
+#define PAGES_LOW 64
+
+/**
+ * Cache that can give pages back under memory pressure. shrink() is called
+ * from the page allocator, must not sleep or allocate pages, and returns how
+ * many of the nr pages asked for it freed.
+ */
+struct shrinker {
+    unsigned int (*shrink)(unsigned int nr);
+    struct shrinker *next;
+};
 
 void mm_init();
 extern void flush_tlb();
 unsigned int mem_used();
+unsigned int mem_free();
+void register_shrinker(struct shrinker *s);
 bool map_page(uint32_t vaddr, uint32_t paddr, int flags);
 bool alloc_page(uint32_t vaddr, int flags);
 uint32_t alloc_kernel_page(int flags);
+uint32_t map_kernel_page(uint32_t paddr, int flags);
+uint32_t alloc_kernel_dma_pages(unsigned int n, int flags);
 void bump_kvaddr();
+void release_kernel_page(uint32_t vaddr);
+bool refill_kernel_page(uint32_t vaddr, int flags);
+void *kcache_alloc(struct kcache *cache);
+void kcache_free(struct kcache *cache, void *obj);
 void free_page(uint32_t vaddr);
 uint32_t vtophys(uint32_t vaddr);
 uint32_t check_page(uint32_t vaddr);
@@ -81,7 +142,10 @@ void set_page_writable(uint32_t vaddr, bool writable);
 bool mm_add_mapping(uint32_t base, uint32_t size, uint32_t flags,
                     uint32_t file_offset, uint32_t file_size,
                     struct inode *inode);
+bool mm_share_kernel_page(uint32_t base, uint32_t kpage);
 void mm_free_proc_memory();
+uint32_t mm_alloc_stack();
+void mm_free_stack(uint32_t top);
 bool mm_fork_memory(uint32_t *new_pdir);
 
 #endif
@@ -0,0 +1,50 @@
+/**
+ * The SakuraOS Kernel
+ * Copyright 2025 Adam Judge
+ * File: rbtree.h
+ */
+
+#ifndef RBTREE_H
+#define RBTREE_H
+
+/**
+ * Red-black tree node, embedded in the struct being indexed. Insertion is done
+ * by the caller walking down the tree with its own ordering, then linking the
+ * new node in with rb_link_node() and rebalancing with rb_insert_color().
+ */
+struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    int color;
+};
+
+struct rb_root {
+    struct rb_node *node;
+};
+
+#define RB_RED 0
+#define RB_BLACK 1
+
+/**
+ * Get the struct containing a tree node.
+ */
+#define rb_entry(ptr, type, member) container_of(ptr, type, member)
+
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+                                struct rb_node **link)
+{
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->color = RB_RED;
+    *link = node;
+}
+
+void rb_insert_color(struct rb_root *root, struct rb_node *node);
+void rb_erase(struct rb_root *root, struct rb_node *node);
+struct rb_node *rb_first(struct rb_root *root);
+struct rb_node *rb_last(struct rb_root *root);
+struct rb_node *rb_next(struct rb_node *node);
+struct rb_node *rb_prev(struct rb_node *node);
+
+#endif
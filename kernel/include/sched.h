@@ -8,6 +8,9 @@
 
 #include <mm.h>
 #include <fs.h>
+#include <smp.h>
+#include <time.h>
+#include <fpu.h>
 
 /**
  * Divider frequency for the PIT chip, which should cause an IRQ 0 interrupt
@@ -16,19 +19,66 @@
 #define TIMER_DIVIDER 11932
 
 /**
- * Number of timer interrupts for thread scheduling quantum.
+ * Length of a timer tick in microseconds.
  */
-#define SCHED_FREQ 10
+#define TICK_USEC 10000
+#define TICK_NSEC (TICK_USEC * NSEC_PER_USEC)
 
 /**
- * Maximum number of processes that can exist at once.
+ * Fair scheduler tunables, in timer ticks. Every runnable thread on a CPU
+ * should get to run once per SCHED_LATENCY, split in proportion to thread
+ * weights, unless there are so many threads that each slice would be shorter
+ * than SCHED_MIN_GRANULARITY. A waking thread only preempts the running one if
+ * it's behind by more than SCHED_WAKEUP_GRANULARITY.
  */
-#define NPROCS 64
+#define SCHED_LATENCY 6
+#define SCHED_MIN_GRANULARITY 1
+#define SCHED_WAKEUP_GRANULARITY 1
 
 /**
- * Maximum number of threads that can exist at once (including the idle thread).
+ * Real-time scheduler tunables, in timer ticks. Round-robin threads of equal
+ * priority take turns every SCHED_RR_TIMESLICE. Real-time threads may use at
+ * most SCHED_RT_RUNTIME of every SCHED_RT_PERIOD on each CPU while normal
+ * threads are waiting to run there.
  */
-#define NTHREADS 128
+#define SCHED_RR_TIMESLICE 10
+#define SCHED_RT_PERIOD 100
+#define SCHED_RT_RUNTIME 95
+
+/**
+ * Nice value range, and the load weight of a nice 0 thread.
+ */
+#define NICE_MIN -20
+#define NICE_MAX 19
+#define NICE_0_WEIGHT 1024
+
+/**
+ * Process IDs range from 1 to PID_MAX - 1, and are looked up through a hash
+ * table of PID_HASH_SIZE chains.
+ */
+#define PID_MAX 32768
+#define PID_HASH_SIZE 64
+
+/**
+ * Freed threads and processes keep their kernel stack and page directory for
+ * the next one created, but only this many of each. Beyond that, the pages are
+ * given back and allocated again on reuse.
+ */
+#define KSTACK_POOL_SIZE 8
+#define PDIR_POOL_SIZE 4
+
+/**
+ * Options for waitpid().
+ */
+#define WNOHANG 1
+#define WUNTRACED 2
+
+/**
+ * Threads sleeping until some event, such as a child process changing state.
+ */
+struct wait_queue {
+    struct thread *head;
+};
 
 struct exe_header {
     unsigned int magic;
@@ -66,14 +116,23 @@ struct proc {
     unsigned int gid;             /* Group ID */  
     unsigned int euid;            /* Effective user ID */  
     unsigned int egid;            /* Effective group ID */  
-    unsigned int alarm;           /* Alarm clock set by task */
-    unsigned int rtime;           /* Real time elapsed in millis */
-    unsigned int ktime;           /* Kernel time elapsed in millis */
-    unsigned int utime;           /* User time elapsed in millis */
+    unsigned int alarm;           /* Jiffies at which SIGALRM is due, or 0 */
+    int nice;                     /* Scheduling nice value */
+    int policy;                   /* Scheduling policy */
+    int rt_priority;              /* Real-time priority */
+    unsigned int start_time;      /* Jiffies when created */
+    uint64_t utime;               /* User time of exited threads in ns */
+    uint64_t stime;               /* System time of exited threads in ns */
+    uint64_t cutime;              /* User time of waited-for children */
+    uint64_t cstime;              /* System time of waited-for children */
     unsigned int next_tid;        /* Next thread ID */  
     unsigned int nthreads;        /* Number of threads */  
     unsigned int signal;          /* Signal bit field */  
     int exit_status;              /* Exit status for waitpid */
+    int stop_signal;              /* Signal that last stopped the process */
+    bool stop_reported;           /* Set once waitpid has reported the stop */
+    struct wait_queue child_wait; /* Threads waiting for a child to change state */
+    struct wait_queue exit_wait;  /* Thread waiting for the others to exit */
 
     struct inode *exe;            /* Executable file */
     struct inode *cwd;            /* Current working directory */
@@ -81,8 +140,63 @@ struct proc {
     uint32_t sigdisp[32];         /* Signal dispositions */
     struct file *files[OPEN_MAX]; /* File descriptors */
     spinlock_t files_lock;           /* Lock for file descriptors list */
+
+    struct proc *parent;          /* Parent process, or NULL for init */
+    struct proc *children;        /* Child processes, including zombies */
+    struct proc *sibling;         /* Next child of the parent */
+    struct thread *threads;       /* Threads, including zombies */
+    struct proc *hash_next;       /* PID hash chain */
+    struct proc *next;            /* List of all processes */
+    struct proc *prev;
+};
+
+/**
+ * Targets of getpriority() and setpriority().
+ */
+enum {
+    PRIO_PROCESS,
+    PRIO_PGRP,
+    PRIO_USER
+};
+
+/**
+ * Scheduling policies.
+ */
+enum {
+    SCHED_OTHER,
+    SCHED_FIFO,
+    SCHED_RR
 };
 
+/**
+ * Parameters of sched_setscheduler() and sched_getparam().
+ */
+struct sched_param {
+    int sched_priority;
+};
+
+/**
+ * Process times reported by times(), in clock ticks.
+ */
+struct tms {
+    unsigned int tms_utime;
+    unsigned int tms_stime;
+    unsigned int tms_cutime;
+    unsigned int tms_cstime;
+};
+
+/**
+ * Resource usage reported by getrusage(), and its targets.
+ */
+struct rusage {
+    struct timeval ru_utime;
+    struct timeval ru_stime;
+};
+
+#define RUSAGE_SELF 0
+#define RUSAGE_CHILDREN -1
+#define RUSAGE_THREAD 1
+
 /**
  * Thread state values.
  */
@@ -90,7 +204,8 @@ enum {
     TS_NONE,
     TS_RUNNING,
     TS_INTERRUPTIBLE,
-    TS_UNINTERRUPTIBLE
+    TS_UNINTERRUPTIBLE,
+    TS_ZOMBIE
 };
 
 /**
@@ -100,22 +215,46 @@ struct thread {
     /* Used for context switching */
     uint32_t esp;         /* Saved kernel ESP */
     uint32_t tss_esp0;    /* Kernel ESP switched to by exception */
-
     struct proc *proc;    /* Owning process */
+    int lock_depth;       /* Saved big kernel lock nesting depth */
+
     void *kstack;         /* Kernel stack page */
     unsigned int tid;     /* Process thread ID */
     int state;            /* Thread state */
-    int counter;          /* schedule() calls since last run */
-    unsigned int sleep;   /* Remaining sleep time */
+    uint64_t sleep;       /* sched_clock() time to wake at, or 0 */
     unsigned int signal;  /* Signal bit field */
     unsigned int sigmask; /* Signal mask */
-};
+    uint32_t ustack;      /* Top of user stack allocated for the thread */
+    int exit_value;       /* Value passed to thread_exit for thread_join */
+    struct thread *joiner; /* Thread waiting in thread_join */
+    uint32_t futex_key;   /* Physical address waited on in futex_wait */
+    struct thread *futex_next; /* Futex wait queue link */
+    struct thread *wait_next; /* Wait queue link */
 
-/**
- * The currently running process and thread.
- */
-extern struct proc *proc;
-extern struct thread *thread;
+    struct cpu *cpu;      /* CPU whose run queue this thread belongs to */
+    int policy;           /* Scheduling policy */
+    int rt_priority;      /* Real-time priority, or 0 for SCHED_OTHER */
+    bool on_rq;           /* Set while in a run queue */
+    struct rb_node rq_node; /* Fair run queue tree node */
+    struct thread *rt_next; /* Real-time run queue links */
+    struct thread *rt_prev;
+    unsigned int weight;  /* Load weight derived from the nice value */
+    uint64_t vruntime;    /* Weighted run time in microseconds */
+    unsigned int slice;   /* Ticks run in the current slice */
+
+    uint64_t utime;       /* User time in ns */
+    uint64_t stime;       /* System time in ns */
+    uint64_t stamp;       /* sched_clock() when utime or stime was last charged */
+
+    bool fpu_used;        /* Set once fpu holds the thread's FPU state */
+    struct cpu *fpu_cpu;  /* CPU that last loaded the FPU state */
+
+    struct thread *proc_next; /* Next thread of the process */
+    struct thread *next;  /* List of all threads, or of dead threads */
+    struct thread *prev;
+
+    struct fpu_state fpu; /* Saved FPU state */
+};
 
 void sched_init();
 void schedule();
@@ -123,14 +262,60 @@ struct proc *get_process(int pid);
 void yield_thread();
 void block_thread_interruptible();
 void block_thread_uninterruptible();
-void sleep_thread(unsigned int time);
+void sleep_thread(uint64_t ns);
+void sleep_until(uint64_t deadline);
+void wake_thread(struct thread *t);
+void wait_queue_sleep(struct wait_queue *wq);
+void wait_queue_wake(struct wait_queue *wq);
 unsigned int jiffies();
-struct proc *create_proc();
+struct proc *create_proc(struct proc *parent);
+void release_proc(struct proc *p);
 struct thread *create_thread(struct proc *proc);
+void release_thread(struct thread *t);
+struct thread *kthread_create(void (*fn)(void *), void *arg);
+void sched_run_timers();
 void sched_stop_thread();
+void sched_exit_thread(int value);
+int sched_join_thread(unsigned int tid, int *value);
 void sched_stop_other_threads();
 void sched_terminate(int exit_status);
 int sched_waitpid(int pid, int *wstatus, int options);
+void sched_stop_proc(int signum);
+void sched_continue_proc(struct proc *p);
 void sched_interrupt_proc(struct proc *proc);
+int sched_setpgid(int pid, int pgid);
+int sched_getpgid(int pid);
+int sched_getpriority(int which, int who);
+int sched_setpriority(int which, int who, int nice);
+int sched_setscheduler(int pid, int policy, int priority);
+int sched_getscheduler(int pid);
+int sched_getparam(int pid);
+void account_time(struct thread *t, bool user);
+void sched_proc_times(struct proc *p, uint64_t *utime, uint64_t *stime);
+
+/**
+ * Check that a thread isn't part of a stopped process.
+ */
+static inline bool thread_can_run(struct thread *t)
+{
+    return !t->proc || t->proc->state == PS_RUNNING;
+}
+
+/* Scheduling classes, in sched_fair.c and sched_rt.c. Called with interrupts
+ * disabled and the big kernel lock held. */
+unsigned int nice_to_weight(int nice);
+void fair_enqueue(struct cpu *cpu, struct thread *t, bool wakeup);
+void fair_dequeue(struct cpu *cpu, struct thread *t);
+struct thread *fair_pick(struct cpu *cpu, struct thread *skip);
+struct thread *fair_steal(struct cpu *thief, struct cpu *victim);
+bool fair_tick(struct cpu *cpu);
+bool fair_wakeup_preempt(struct cpu *cpu, struct thread *t);
+void fair_reweight(struct thread *t, unsigned int weight);
+void rt_enqueue(struct cpu *cpu, struct thread *t, bool head);
+void rt_dequeue(struct cpu *cpu, struct thread *t);
+struct thread *rt_first(struct cpu *cpu, struct thread *skip);
+struct thread *rt_pick(struct cpu *cpu, struct thread *skip);
+bool rt_tick(struct cpu *cpu);
+void rt_new_period(struct cpu *cpu);
 
 #endif
@@ -62,6 +62,11 @@ enum {
  */
 #define TERM_SIGNALED 0x100
 
+/**
+ * Wait status flag indicating a stopped child, reported with WUNTRACED.
+ */
+#define TERM_STOPPED 0x200
+
 /**
  * Signal handler stack frame.
  */
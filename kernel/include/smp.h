@@ -0,0 +1,175 @@
+/**
+ * The SakuraOS Kernel
+ * Copyright 2025 Adam Judge
+ * File: smp.h
+ */
+
+#ifndef SMP_H
+#define SMP_H
+
+#include <rbtree.h>
+
+/**
+ * Maximum number of processors brought online. This must match the value used
+ * by the AP startup code in x86/smpboot.s.
+ */
+#define NCPUS 8
+
+/**
+ * GDT selectors, which are identical in every processor's private GDT.
+ */
+#define KERNEL_CS     0x08
+#define KERNEL_DS     0x10
+#define USER_CS       0x1b
+#define USER_DS       0x23
+#define KERNEL_TS     0x28
+#define KERNEL_PERCPU 0x30
+
+#define NGDT 7
+
+/**
+ * Local APIC spurious interrupt vector. Its low 4 bits must be set for older
+ * local APICs.
+ */
+#define APIC_SPURIOUS 0xef
+
+/**
+ * Local APIC register offsets.
+ */
+enum {
+    LAPIC_ID = 0x20,
+    LAPIC_TPR = 0x80,
+    LAPIC_EOI = 0xb0,
+    LAPIC_SVR = 0xf0,
+    LAPIC_ESR = 0x280,
+    LAPIC_ICR_LO = 0x300,
+    LAPIC_ICR_HI = 0x310,
+    LAPIC_LVT_TIMER = 0x320,
+    LAPIC_LVT_LINT0 = 0x350,
+    LAPIC_LVT_LINT1 = 0x360,
+    LAPIC_LVT_ERROR = 0x370,
+};
+
+/**
+ * Local APIC register fields.
+ */
+#define LAPIC_SVR_ENABLE    0x100
+#define LAPIC_LVT_MASKED    0x10000
+#define LAPIC_LVT_EXTINT    0x700
+#define LAPIC_LVT_NMI       0x400
+#define LAPIC_ICR_INIT      0x500
+#define LAPIC_ICR_STARTUP   0x600
+#define LAPIC_ICR_PENDING   0x1000
+#define LAPIC_ICR_ASSERT    0x4000
+#define LAPIC_ICR_ALLBUTME  0xc0000
+
+/**
+ * Physical address the AP startup trampoline is copied to. Must be page-aligned
+ * and below 1 MiB, since the startup IPI vector is its page number.
+ */
+#define AP_TRAMPOLINE 0x7000
+
+/**
+ * Hardware task state segment. Only the ring 0 stack fields are used.
+ */
+struct tss {
+    uint32_t link;
+    uint32_t esp0;
+    uint32_t ss0;
+    uint32_t unused[22];
+    uint16_t trap;
+    uint16_t iomap_base;
+};
+
+/**
+ * Runnable threads owned by a processor, not counting the one it's running,
+ * ordered by virtual run time. Protected by the big kernel lock.
+ */
+struct runqueue {
+    struct rb_root tree;
+    uint64_t min_vruntime;   /* Monotonic lower bound of queued vruntimes */
+    unsigned int load;       /* Sum of queued thread weights */
+    unsigned int nr_running;
+};
+
+/**
+ * Highest real-time priority. Priorities run from 1 to RT_PRIO_MAX, and higher
+ * values run first.
+ */
+#define RT_PRIO_MAX 99
+#define RT_BITMAP_WORDS ((RT_PRIO_MAX + 32) / 32)
+
+/**
+ * Runnable real-time threads owned by a processor, in a FIFO list for each
+ * priority, with a bitmap of non-empty lists. Protected by the big kernel lock.
+ */
+struct rt_runqueue {
+    struct thread *head[RT_PRIO_MAX + 1];
+    struct thread *tail[RT_PRIO_MAX + 1];
+    uint32_t bitmap[RT_BITMAP_WORDS];
+    unsigned int nr_running;
+    unsigned int time;       /* Ticks used in the current throttling period */
+    bool throttled;          /* Set when time has run out */
+};
+
+/**
+ * Per-CPU data, addressed through the %fs segment. The fields up to and
+ * including the TSS are accessed by assembly code and must not be reordered.
+ */
+struct cpu {
+    struct cpu *self;            /* Linear address of this struct */
+    struct thread *thread;       /* Currently running thread */
+    struct proc *proc;           /* Currently running process */
+    struct thread *next_thread;  /* Thread being switched to */
+    int lock_depth;              /* Big kernel lock nesting depth */
+    unsigned int id;             /* Logical CPU number */
+    unsigned int apic_id;        /* Local APIC ID */
+    volatile int tlb_flush;      /* Set when a TLB shootdown is pending */
+    struct tss tss;              /* Task state segment */
+    uint64_t gdt[NGDT];          /* Private global descriptor table */
+
+    struct thread *idle;         /* Idle thread */
+    struct runqueue rq;          /* Runnable normal threads */
+    struct rt_runqueue rt;       /* Runnable real-time threads */
+    bool need_resched;           /* Call schedule() before leaving kernel */
+    bool online;                 /* Set once the CPU can run threads */
+
+    unsigned int softirq_pending; /* Bitmap of raised softirqs */
+    bool in_softirq;             /* Set while running softirqs */
+    struct tasklet *tasklet_head; /* Scheduled tasklets */
+    struct tasklet *tasklet_tail;
+    struct thread *fpu_owner;    /* Thread whose state the FPU last loaded */
+    uint32_t cr3;                /* Page directory loaded, kept while idle */
+};
+
+extern struct cpu cpus[NCPUS];
+extern unsigned int ncpus;
+
+/**
+ * Get the per-CPU data of the processor executing this code. Must not be
+ * cached across anything that may reschedule, since threads can migrate.
+ */
+static inline struct cpu *this_cpu()
+{
+    struct cpu *cpu;
+
+    __asm__ __volatile__("mov %%fs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+/**
+ * The currently running thread and process on this CPU.
+ */
+#define curthread (this_cpu()->thread)
+#define curproc (this_cpu()->proc)
+
+void smp_early_init();
+void smp_init();
+void lapic_eoi();
+void smp_send_ipi(struct cpu *cpu, uint8_t vector);
+void smp_reschedule(struct cpu *cpu);
+void tlb_shootdown();
+void tlb_shootdown_all();
+void cpu_idle();
+
+#endif
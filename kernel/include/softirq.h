@@ -0,0 +1,44 @@
+/**
+ * The SakuraOS Kernel
+ * Copyright 2025 Adam Judge
+ * File: softirq.h
+ */
+
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include <kernel.h>
+
+/**
+ * Softirq numbers, run in this order when pending.
+ */
+enum {
+    SOFTIRQ_TIMER,
+    SOFTIRQ_TASKLET,
+    NR_SOFTIRQS
+};
+
+/**
+ * Times pending softirqs are rerun before the rest are left for the next
+ * interrupt.
+ */
+#define SOFTIRQ_RESTART 10
+
+/**
+ * Deferred function run once in softirq context after being scheduled, however
+ * many times it was scheduled before then.
+ */
+struct tasklet {
+    struct tasklet *next;
+    void (*func)(void *data);
+    void *data;
+    bool scheduled;
+};
+
+#define TASKLET_INIT(func, data) { NULL, func, data, false }
+
+void raise_softirq(int nr);
+void do_softirq();
+void tasklet_schedule(struct tasklet *t);
+
+#endif
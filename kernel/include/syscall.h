@@ -0,0 +1,38 @@
+/**
+ * The SakuraOS Kernel
+ * Copyright 2025 Adam Judge
+ * File: syscall.h
+ */
+
+#ifndef SYSCALL_H
+#define SYSCALL_H
+
+#include <kernel.h>
+
+/**
+ * System call numbers, from the list in syscalls.h shared with the library.
+ * Each line there gives the number, the kernel handler name without its sys_
+ * prefix, the library function name and the argument count.
+ */
+enum {
+#define SYSCALL(nr, kname, uname, nargs) SYS_##kname = nr,
+#include <syscalls.h>
+#undef SYSCALL
+    NR_SYSCALLS
+};
+
+#define SYS_SIGRETURN 0xffffffff
+
+/**
+ * Log2 latency histogram buckets. Bucket n counts calls that took from 2^n to
+ * 2^(n+1)-1 TSC cycles.
+ */
+#define SYSCALL_HIST_BUCKETS 32
+
+struct syscall_stats {
+    uint64_t count;   /* Number of calls */
+    uint64_t cycles;  /* Total TSC cycles spent in calls that returned */
+    uint32_t hist[SYSCALL_HIST_BUCKETS];
+};
+
+#endif
@@ -0,0 +1,35 @@
+SYSCALL(0, exit, _exit, 1)
+SYSCALL(1, fork, fork, 0)
+SYSCALL(2, execve, execve, 3)
+SYSCALL(3, waitpid, waitpid, 3)
+SYSCALL(4, signal, signal, 2)
+SYSCALL(5, alarm, alarm, 1)
+SYSCALL(6, kill, kill, 2)
+SYSCALL(7, open, open, 3)
+SYSCALL(8, close, close, 1)
+SYSCALL(9, read, read, 3)
+SYSCALL(10, write, write, 3)
+SYSCALL(11, dup, dup, 1)
+SYSCALL(12, nice, _nice, 1)
+SYSCALL(13, getpriority, _getpriority, 2)
+SYSCALL(14, setpriority, setpriority, 3)
+SYSCALL(15, sched_setscheduler, sched_setscheduler, 3)
+SYSCALL(16, sched_getscheduler, sched_getscheduler, 1)
+SYSCALL(17, sched_getparam, sched_getparam, 2)
+SYSCALL(18, sched_yield, sched_yield, 0)
+SYSCALL(19, times, times, 1)
+SYSCALL(20, getrusage, getrusage, 2)
+SYSCALL(21, thread_create, _thread_create, 4)
+SYSCALL(22, thread_exit, thread_exit, 1)
+SYSCALL(23, thread_join, thread_join, 2)
+SYSCALL(24, futex, futex, 3)
+SYSCALL(25, syscall_stats, syscall_stats, 2)
+SYSCALL(26, nanosleep, nanosleep, 2)
+SYSCALL(27, clock_nanosleep, clock_nanosleep, 4)
+SYSCALL(28, setpgid, setpgid, 2)
+SYSCALL(29, getpgid, getpgid, 1)
+SYSCALL(30, buffer_stats, buffer_stats, 1)
+SYSCALL(31, block_stats, block_stats, 1)
+SYSCALL(32, sync, sync, 0)
+SYSCALL(33, fsync, fsync, 1)
+SYSCALL(34, fdatasync, fdatasync, 1)
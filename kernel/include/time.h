@@ -0,0 +1,44 @@
+/**
+ * The SakuraOS Kernel
+ * Copyright 2025 Adam Judge
+ * File: time.h
+ */
+
+#ifndef TIME_H
+#define TIME_H
+
+#define NSEC_PER_USEC 1000
+#define NSEC_PER_MSEC 1000000
+#define NSEC_PER_SEC 1000000000
+#define USEC_PER_SEC 1000000
+
+/* Clocks for clock_nanosleep */
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+
+/* Flag for clock_nanosleep to sleep until an absolute time */
+#define TIMER_ABSTIME 1
+
+struct timeval {
+    int tv_sec;
+    int tv_usec;
+};
+
+struct timespec {
+    int tv_sec;
+    int tv_nsec;
+};
+
+extern unsigned int tsc_khz;
+
+void timer_init();
+void tsc_init();
+unsigned int timer_interrupt();
+void timer_arm(uint64_t deadline);
+uint64_t sched_clock();
+uint64_t clock_read(int clock);
+void ns_to_timeval(uint64_t ns, struct timeval *tv);
+void ns_to_timespec(uint64_t ns, struct timespec *ts);
+uint64_t timespec_to_ns(const struct timespec *ts);
+
+#endif
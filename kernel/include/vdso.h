@@ -0,0 +1,39 @@
+/**
+ * The SakuraOS Kernel
+ * Copyright 2025 Adam Judge
+ * File: vdso.h
+ */
+
+#ifndef VDSO_H
+#define VDSO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Address of the shared time page in every process, between the thread stacks
+ * and the main stack.
+ */
+#define VDSO_BASE 0xf0000000
+
+/**
+ * Time data shared read-only with user space, so clocks can be read without a
+ * system call. Readers retry while seq is odd or changes under them. The
+ * library includes this header too, so it only depends on standard headers.
+ */
+struct vdso_data {
+    uint32_t seq;
+    uint32_t jiffies;
+    uint32_t tick_nsec;
+    uint32_t boot_time;
+    uint32_t tsc_mult;
+    uint32_t tsc_shift;
+    uint64_t tsc_base;
+    uint64_t clock_base;
+};
+
+void vdso_init();
+void vdso_update(unsigned int jiffies);
+bool vdso_map();
+
+#endif
@@ -0,0 +1,39 @@
+/**
+ * The SakuraOS Kernel
+ * Copyright 2025 Adam Judge
+ * File: workqueue.h
+ */
+
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <kernel.h>
+
+/**
+ * Deferred function run once in a worker thread after being queued, however
+ * many times it was queued before then. Unlike tasklets, work may sleep.
+ */
+struct work {
+    struct work *next;
+    void (*func)(void *data);
+    void *data;
+    bool pending;
+};
+
+#define WORK_INIT(func, data) { NULL, func, data, false }
+
+/**
+ * Queue of work serviced by its own kernel thread, in FIFO order.
+ */
+struct workqueue {
+    struct work *head;
+    struct work *tail;
+    struct thread *worker;
+};
+
+void workqueue_init(struct workqueue *wq);
+bool queue_work(struct workqueue *wq, struct work *w);
+bool schedule_work(struct work *w);
+void workqueues_init();
+
+#endif
@@ -9,6 +9,57 @@
 #define DISABLE_INTERRUPTS __asm__("cli")
 #define ENABLE_INTERRUPTS __asm__("sti")
 #define BREAKPOINT __asm__("int3")
+#define HALT __asm__("hlt")
+#define CPU_RELAX __asm__ __volatile__("pause")
+#define BARRIER __asm__ __volatile__("" : : : "memory")
+
+/**
+ * Disable interrupts, saving the previous EFLAGS so the interrupt state can be
+ * restored afterwards. For code that may run with interrupts on or off.
+ */
+#define SAVE_INTERRUPTS(flags) \
+    __asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) : : "memory")
+#define RESTORE_INTERRUPTS(flags) \
+    __asm__ __volatile__("push %0; popf" : : "r"(flags) : "memory", "cc")
+
+#define EFLAGS_IF (1<<9)
+
+/* CPUID leaf 1 EDX feature bits */
+#define CPUID_FPU (1<<0)
+#define CPUID_TSC (1<<4)
+#define CPUID_APIC (1<<9)
+#define CPUID_SEP (1<<11)
+#define CPUID_FXSR (1<<24)
+#define CPUID_SSE (1<<25)
+
+/* Control register bits */
+#define CR0_MP (1<<1)
+#define CR0_EM (1<<2)
+#define CR0_TS (1<<3)
+#define CR0_NE (1<<5)
+#define CR4_OSFXSR (1<<9)
+#define CR4_OSXMMEXCPT (1<<10)
+
+/* Model-specific registers */
+#define MSR_APIC_BASE 0x1b
+#define MSR_SYSENTER_CS 0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+/**
+ * Divide a 64-bit value in place by a 32-bit one, returning the remainder. The
+ * kernel isn't linked with libgcc, so 64-bit division must go through this.
+ */
+static inline uint32_t div64_32(uint64_t *n, uint32_t d)
+{
+    uint32_t high = *n >> 32, low = *n, qhigh, qlow, rem;
+
+    qhigh = high / d;
+    rem = high % d;
+    __asm__("divl %4" : "=a"(qlow), "=d"(rem) : "0"(low), "1"(rem), "rm"(d));
+    *n = ((uint64_t)qhigh << 32) | qlow;
+    return rem;
+}
 
 #define MEMTYPE_FREE 1
 
@@ -38,4 +89,13 @@ extern void out_byte_wait(uint16_t port, uint8_t data);
 extern uint8_t in_byte(uint16_t port);
 extern uint8_t in_byte_wait(uint16_t port);
 
+extern void read_cpuid(uint32_t leaf, uint32_t *regs);
+extern uint64_t read_tsc();
+extern uint64_t read_msr(uint32_t msr);
+extern void write_msr(uint32_t msr, uint64_t value);
+extern uint32_t read_cr0();
+extern void write_cr0(uint32_t value);
+extern uint32_t read_cr4();
+extern void write_cr4(uint32_t value);
+
 #endif
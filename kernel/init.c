@@ -23,7 +23,7 @@ static void do_init()
     floppy_init();
 
     mount(0x200, &g_root_dir);
-    proc->cwd = g_root_dir;
+    curproc->cwd = g_root_dir;
 
     execve("/bin/init", NULL, NULL);
     execve("/init", NULL, NULL);
@@ -36,11 +36,10 @@ void create_init()
     struct thread *init_thread;
     struct init_kstack *kstack;
 
-    init_proc = create_proc();
+    init_proc = create_proc(NULL);
     if (!init_proc)
         panic("failed to create init process");
 
-    init_proc->ppid = 0;
     init_proc->pgid = 0;
     init_proc->sid = 0;
     init_proc->uid = 0;
@@ -56,5 +55,5 @@ void create_init()
     kstack = (struct init_kstack *)init_thread->esp;
     kstack->ret_addr = (uint32_t)do_init;
 
-    init_thread->state = TS_RUNNING;
+    wake_thread(init_thread);
 }
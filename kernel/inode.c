@@ -63,6 +63,8 @@ int iget(struct inode **ip, struct superblock *s, unsigned int inum)
     }
     memcpy(i, b->data + ((inum - 1) % INODES_PER_BLOCK) * INODE_SIZE,
            INODE_SIZE);
+    memset(&i->ra, 0, sizeof(i->ra));
+    buf_mark_meta(b);
     relbuf(b);
 
     spin_unlock(&i->lock);
@@ -91,31 +93,120 @@ static unsigned int lookup_inode_block(struct inode *i, unsigned int blk)
     return i->zones[blk];
 }
 
+/* Get the size in bytes of a file, or of the device of a block device inode,
+ * which has no size of its own. */
+static unsigned int inode_size(struct inode *i)
+{
+    if (MODE_TYPE(i->mode) == IFBLK)
+        return block_dev_size(i->zones[0]) * BLOCKSIZE;
+    return i->size;
+}
+
+/* Find the device and block holding a block of a file, directory or block
+ * device inode. Returns false for other inode types. */
+static bool map_block(struct inode *i, unsigned int blk, dev_t *dev,
+                      unsigned int *devblk)
+{
+    if (MODE_TYPE(i->mode) == IFREG || MODE_TYPE(i->mode) == IFDIR) {
+        *dev = i->dev;
+        *devblk = lookup_inode_block(i, blk);
+    } else if (MODE_TYPE(i->mode) == IFBLK) {
+        *dev = i->zones[0];
+        *devblk = blk;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* Update the read-ahead state after reading file blocks first to last, and
+ * read the next window in the background once the reader is halfway through
+ * what was read ahead before. The window is stretched to end on a track
+ * boundary of the device. Called with the inode locked. */
+static void readahead(struct inode *i, struct readahead *ra,
+                      unsigned int first, unsigned int last)
+{
+    unsigned int blocks[RA_MAX_BLOCKS], fileblks[RA_MAX_BLOCKS];
+    unsigned int nblocks, start, end, devblk, track;
+    dev_t dev;
+    int n = 0, done;
+
+    if (first == ra->next && ra->size == 0) {
+        ra->size = RA_MIN_BLOCKS;
+    } else if (first == ra->next) {
+        ra->size = MIN(ra->size * 2, RA_MAX_BLOCKS);
+    } else if (!(ra->next > 0 && first == ra->next - 1)) {
+        /* Seek, so stop reading ahead until reads are sequential again. */
+        ra->size = 0;
+        ra->ahead = 0;
+    }
+    ra->next = last + 1;
+    if (ra->size == 0 || ra->ahead > last + ra->size / 2)
+        return;
+
+    /* Only the direct zones of files can be looked up so far. */
+    nblocks = (inode_size(i) + BLOCKSIZE - 1) / BLOCKSIZE;
+    if (MODE_TYPE(i->mode) != IFBLK)
+        nblocks = MIN(nblocks, 7);
+
+    start = MAX(ra->ahead, last + 1);
+    end = MIN(last + ra->size, nblocks - 1);
+    if (start >= nblocks || start > end)
+        return;
+    if (!map_block(i, end, &dev, &devblk))
+        return;
+
+    track = block_track_size(dev);
+    while (end + 1 < nblocks && end + 1 - start < RA_MAX_BLOCKS
+           && (devblk + 1) % track != 0)
+    {
+        end++;
+        map_block(i, end, &dev, &devblk);
+    }
+    end = MIN(end, start + RA_MAX_BLOCKS - 1);
+
+    for (; start <= end; start++) {
+        map_block(i, start, &dev, &devblk);
+        if (devblk) {
+            fileblks[n] = start;
+            blocks[n++] = devblk;
+        }
+    }
+
+    /* Blocks not started for lack of buffers are tried again next time. */
+    done = block_readahead(dev, blocks, n);
+    ra->ahead = done < n ? fileblks[done] : end + 1;
+}
+
 int iread(struct inode *i, void *buf, unsigned int offset, unsigned int length)
+{
+    return iread_ra(i, &i->ra, buf, offset, length);
+}
+
+/**
+ * Read from an inode, reading ahead with the given state of the open file.
+ */
+int iread_ra(struct inode *i, struct readahead *ra, void *buf,
+             unsigned int offset, unsigned int length)
 {
     struct buffer *b;
-    unsigned int blk, blk_off, devblk, copylen, total = 0;
+    unsigned int blk, blk_off, devblk, copylen, size, total = 0;
     dev_t dev;
 
     spin_lock(&i->lock);
-    if (offset >= i->size) {
+    size = inode_size(i);
+    if (offset >= size) {
         spin_unlock(&i->lock);
         return 0;
-    } else if (offset + length >= i->size) {
-        length = i->size - offset;
+    } else if (offset + length >= size) {
+        length = size - offset;
     }
 
     while (total < length) {
         blk = (offset + total) / BLOCKSIZE;
         blk_off = (offset + total) % BLOCKSIZE;
 
-        if (MODE_TYPE(i->mode) == IFREG || MODE_TYPE(i->mode) == IFDIR) {
-            dev = i->dev;
-            devblk = lookup_inode_block(i, blk);
-        } else if (MODE_TYPE(i->mode) == IFBLK) {
-            dev = i->zones[0];
-            devblk = blk;
-        } else {
+        if (!map_block(i, blk, &dev, &devblk)) {
             spin_unlock(&i->lock);
             return -ENOSYS;
         }
@@ -128,29 +219,101 @@ int iread(struct inode *i, void *buf, unsigned int offset, unsigned int length)
         copylen = MIN(BLOCKSIZE - blk_off, MIN(length - total, BLOCKSIZE));
         memcpy(buf + total, b->data + blk_off, copylen);
 
+        if (MODE_TYPE(i->mode) == IFDIR)
+            buf_mark_meta(b);
         relbuf(b);
         total += copylen;
     }
 
+    if (length > 0)
+        readahead(i, ra, offset / BLOCKSIZE, (offset + length - 1) / BLOCKSIZE);
+
     spin_unlock(&i->lock);
     return total;
 }
 
+/**
+ * Write to an inode through the buffer cache, leaving the blocks to be written
+ * back later. Only blocks the inode already has can be written, since there's
+ * no block allocation yet, so files can't grow.
+ */
 int iwrite(struct inode *i, void *buf, unsigned int offset, unsigned int length)
 {
+    struct buffer *b;
+    unsigned int blk, blk_off, devblk, copylen, size, total = 0;
+    dev_t dev;
+
     spin_lock(&i->lock);
-    if (MODE_TYPE(i->mode) == IFBLK) {
-        if (offset >= i->size) {
-            spin_unlock(&i->lock);
-            return 0;
-        } else if (offset + length >= i->size) {
-            length = i->size - offset;
-        }
+    if (MODE_TYPE(i->mode) != IFREG && MODE_TYPE(i->mode) != IFBLK) {
+        spin_unlock(&i->lock);
+        return -ENOSYS;
+    }
+    size = inode_size(i);
+    if (offset >= size) {
+        spin_unlock(&i->lock);
+        return length > 0 ? -ENOSPC : 0;
+    } else if (offset + length >= size) {
+        length = size - offset;
+    }
+
+    while (total < length) {
+        blk = (offset + total) / BLOCKSIZE;
+        blk_off = (offset + total) % BLOCKSIZE;
+
+        /* Only the direct zones of files can be looked up so far. */
+        if (MODE_TYPE(i->mode) == IFREG && blk > 6)
+            break;
+        map_block(i, blk, &dev, &devblk);
+        if (devblk == 0)
+            break;
+
+        /* A whole block is overwritten without reading it first. */
+        copylen = MIN(BLOCKSIZE - blk_off, MIN(length - total, BLOCKSIZE));
+        if (copylen == BLOCKSIZE)
+            b = getbuf(dev, devblk);
+        else
+            b = readblk(dev, devblk);
+        if (!b)
+            break;
+        memcpy(b->data + blk_off, buf + total, copylen);
+        b->flags |= BUF_UPTODATE;
+        buf_mark_dirty(b);
+        relbuf(b);
+        total += copylen;
     }
 
-    /* TODO: write to other things */
     spin_unlock(&i->lock);
-    return -ENOSYS;
+    balance_dirty();
+    if (total == 0 && length > 0)
+        return -EIO;
+    return total;
+}
+
+/**
+ * Write back an inode's dirty blocks and wait for them. Inodes themselves are
+ * never modified yet, so there's no metadata to write.
+ */
+int ifsync(struct inode *i)
+{
+    unsigned int blocks[7], nblocks, blk, devblk;
+    dev_t dev = 0;
+    int n = 0;
+
+    if (MODE_TYPE(i->mode) == IFBLK)
+        return sync_buffers(i->zones[0]);
+    if (MODE_TYPE(i->mode) != IFREG && MODE_TYPE(i->mode) != IFDIR)
+        return -EINVAL;
+
+    spin_lock(&i->lock);
+    nblocks = MIN((i->size + BLOCKSIZE - 1) / BLOCKSIZE, 7);
+    for (blk = 0; blk < nblocks; blk++) {
+        map_block(i, blk, &dev, &devblk);
+        if (devblk)
+            blocks[n++] = devblk;
+    }
+    spin_unlock(&i->lock);
+
+    return sync_blocks(dev, blocks, n);
 }
 
 static int scandir(struct inode **ip, struct inode *dir, char *name, int len)
@@ -198,7 +361,7 @@ int ilookup(struct inode **ip, char *path)
     else if (*path == '/')
         i = g_root_dir;
     else
-        i = proc->cwd;
+        i = curproc->cwd;
 
     idup(i);
     for (;;) {
@@ -8,6 +8,14 @@
 #include <x86.h>
 #include <sched.h>
 #include <mm.h>
+#include <smp.h>
+#include <time.h>
+#include <vdso.h>
+#include <workqueue.h>
+#include <fpu.h>
+#include <fs.h>
+#include <buffer.h>
+#include <blkdev.h>
 
 #include <serial.h>
 
@@ -16,6 +24,7 @@ extern void ps2_init();
 
 void kmain()
 {
+    smp_early_init();
     serial_init();
     console_init();
     printk("Starting SakuraOS...\n");
@@ -28,8 +37,15 @@ void kmain()
                mr->type == 1 ? "free" : "resv", mr->base,
                mr->base + mr->size - 1, mr->size / 1024);
     
+    fpu_init();
     mm_init();
     sched_init();
+    workqueues_init();
+    buffer_init();
+    block_init();
+    tsc_init();
+    vdso_init();
+    smp_init();
     create_init();
     printk("Memory used: %d kb\n", mem_used() / 1024);
 }
@@ -27,12 +27,17 @@ uint32_t __attribute__((aligned(4096))) pagestack_ptab[1024];
 static uint32_t *ptabs = (uint32_t *)0x400000;
 static uint32_t *pdir = (uint32_t *)0x401000;
 
-/* Stack of free physical pages */
+/* Stack of free physical pages. Pages below DMA_LIMIT have a stack of their own
+ * at the other end of the array, growing down from the top, and the two never
+ * meet since the array has room for every page. */
 static uint32_t *pagestack = (uint32_t *)0x800000;
 static unsigned int ps_size = 0;
 static unsigned int stackp = 0;
+static unsigned int dma_stackp = 0;
 static spinlock_t ps_lock;
 
+#define DMA_STACK(i) pagestack[ps_size / sizeof(uint32_t) - 1 - (i)]
+
 /* Page reference counts for copy-on-write */
 static uint16_t *pagecount;
 static unsigned int pc_size;
@@ -40,15 +45,45 @@ static spinlock_t pc_lock;
 
 static unsigned int npages;
 static uint32_t kvaddr = 0xc00000;
+static uint32_t kvaddr_end;
+
+static struct shrinker *shrinkers;
+static bool shrinking;
 
 extern void enable_paging();
 
-static uint32_t pop_page()
+/* Ask the registered caches to give back up to nr pages. */
+static void shrink_caches(unsigned int nr)
 {
-    uint32_t page;
+    struct shrinker *s;
+    unsigned int freed;
+
+    if (shrinking)
+        return;
+    shrinking = true;
+    for (s = shrinkers; s && nr > 0; s = s->next) {
+        freed = s->shrink(nr);
+        nr -= MIN(freed, nr);
+    }
+    shrinking = false;
+}
+
+/* Take a free page, preferring one below DMA_LIMIT if dma is set and any other
+ * page otherwise. */
+static uint32_t pop_page(bool dma)
+{
+    uint32_t page = 0;
+
+    if (stackp + dma_stackp < PAGES_LOW && shrinkers)
+        shrink_caches(PAGES_LOW - stackp - dma_stackp);
 
     spin_lock(&ps_lock);
-    page = stackp > 0 ? pagestack[--stackp] : 0;
+    if (dma && dma_stackp > 0)
+        page = DMA_STACK(--dma_stackp);
+    else if (stackp > 0)
+        page = pagestack[--stackp];
+    else if (dma_stackp > 0)
+        page = DMA_STACK(--dma_stackp);
     if (page)
         npages++;
     spin_unlock(&ps_lock);
@@ -58,8 +93,11 @@ static uint32_t pop_page()
 static void push_page(uint32_t addr)
 {
     spin_lock(&ps_lock);
-    if (stackp < ps_size / sizeof(uint32_t)) {
-        pagestack[stackp++] = addr;
+    if (stackp + dma_stackp < ps_size / sizeof(uint32_t)) {
+        if (addr < DMA_LIMIT)
+            DMA_STACK(dma_stackp++) = addr;
+        else
+            pagestack[stackp++] = addr;
         npages--;
     }
     spin_unlock(&ps_lock);
@@ -67,7 +105,7 @@ static void push_page(uint32_t addr)
 
 void mm_init()
 {
-    uint32_t addr, himem, i, ps_top;
+    uint32_t addr, himem, i, ps_top, ptab;
     struct memrange *mr;
 
     printk("Initializing virtual memory manager\n");
@@ -121,11 +159,30 @@ void mm_init()
         if (mr->base < HIMEM_BASE || mr->type != MEMTYPE_FREE)
             continue;
         for (addr = mr->base; addr < mr->base + mr->size; addr += PAGE_SIZE) {
-            if (addr >= ps_top)
+            if (addr >= ps_top && addr < DMA_LIMIT)
+                DMA_STACK(dma_stackp++) = addr;
+            else if (addr >= ps_top)
                 pagestack[stackp++] = addr;
         }
     }
 
+    /* Create all page tables of the kernel's dynamic address space up front.
+     * Every page directory copies its kernel entries from init_pdir, so kernel
+     * pages allocated at any time are then visible in every process. Twice the
+     * memory size leaves room for the gaps between kernel stacks. */
+    kvaddr_end = KERNEL_SPACE_END;
+    if (himem < (KERNEL_SPACE_END - kvaddr) / 2)
+        kvaddr_end = (kvaddr + himem * 2 + PAGE_SIZE * 1024 - 1)
+                     & ~(PAGE_SIZE * 1024 - 1);
+    for (addr = kvaddr; addr < kvaddr_end; addr += PAGE_SIZE * 1024) {
+        ptab = pop_page(false);
+        if (!ptab)
+            panic("mm_init: out of memory for kernel page tables");
+        pdir[DIRENT(addr)] = ptab | PAGE_PRESENT | PAGE_WRITABLE;
+        flush_tlb();
+        memset(&ptabs[DIRENT(addr)*1024], 0, PAGE_SIZE);
+    }
+
     /* Allocate reference counts for copy-on-write pages. */
     pagecount = (uint16_t *)alloc_kernel_page(PAGE_WRITABLE);
     for (i = 0; i < himem / (PAGE_SIZE * 2048); i++)
@@ -139,12 +196,26 @@ unsigned int mem_used()
     return npages * PAGE_SIZE;
 }
 
+unsigned int mem_free()
+{
+    return (stackp + dma_stackp) * PAGE_SIZE;
+}
+
+/**
+ * Add a cache to those asked to shrink when free pages run low.
+ */
+void register_shrinker(struct shrinker *s)
+{
+    s->next = shrinkers;
+    shrinkers = s;
+}
+
 bool map_page(uint32_t vaddr, uint32_t paddr, int flags)
 {
     uint32_t pagetab;
 
     if ((pdir[DIRENT(vaddr)] & PAGE_PRESENT) == 0) {
-        pagetab = pop_page();
+        pagetab = pop_page(false);
         if (!pagetab)
             return false;
         pdir[DIRENT(vaddr)] = pagetab | PAGE_PRESENT | PAGE_WRITABLE | flags;
@@ -160,7 +231,7 @@ bool alloc_page(uint32_t vaddr, int flags)
 {
     uint32_t paddr;
 
-    if ((paddr = pop_page()) == 0)
+    if ((paddr = pop_page(flags & PAGE_DMA)) == 0)
         return false;
 
     return map_page(vaddr, paddr, flags);
@@ -168,12 +239,11 @@ bool alloc_page(uint32_t vaddr, int flags)
 
 uint32_t alloc_kernel_page(int flags)
 {
-    // TODO: use an actual map of free page slots within the kernel's address
-    // space so this never overflows into user address space
-    
     uint32_t paddr;
 
-    if ((paddr = pop_page()) == 0)
+    if (kvaddr >= kvaddr_end)
+        return 0;
+    if ((paddr = pop_page(flags & PAGE_DMA)) == 0)
         return 0;
     
     if (map_page(kvaddr, paddr, flags)) {
@@ -183,11 +253,132 @@ uint32_t alloc_kernel_page(int flags)
     return 0;
 }
 
+uint32_t map_kernel_page(uint32_t paddr, int flags)
+{
+    if (kvaddr >= kvaddr_end)
+        return 0;
+    if (map_page(kvaddr, paddr, flags)) {
+        kvaddr += PAGE_SIZE;
+        return kvaddr - PAGE_SIZE;
+    }
+    return 0;
+}
+
+/**
+ * Allocate n physically contiguous pages below DMA_LIMIT that don't cross a
+ * 64 KiB boundary, as a buffer for the ISA DMA controller, and map them at
+ * consecutive kernel addresses. This searches the whole stack of DMA pages, so
+ * it's meant for drivers setting up at boot, while it's still mostly in order.
+ */
+uint32_t alloc_kernel_dma_pages(unsigned int n, int flags)
+{
+    uint32_t base = 0, vaddr;
+    unsigned int i, k;
+
+    if (n == 0 || kvaddr + n * PAGE_SIZE > kvaddr_end)
+        return 0;
+
+    spin_lock(&ps_lock);
+    for (i = 0; i + n <= dma_stackp; i++) {
+        base = DMA_STACK(i);
+        if (base >> 16 != (base + n * PAGE_SIZE - 1) >> 16)
+            continue;
+        for (k = 1; k < n && DMA_STACK(i + k) == base + k * PAGE_SIZE; k++)
+            ;
+        if (k == n)
+            break;
+    }
+    if (i + n > dma_stackp) {
+        spin_unlock(&ps_lock);
+        return 0;
+    }
+    for (k = i; k + n < dma_stackp; k++)
+        DMA_STACK(k) = DMA_STACK(k + n);
+    dma_stackp -= n;
+    npages += n;
+    spin_unlock(&ps_lock);
+
+    /* The kernel page tables all exist already, so mapping can't fail. */
+    vaddr = kvaddr;
+    for (k = 0; k < n; k++)
+        map_page(vaddr + k * PAGE_SIZE, base + k * PAGE_SIZE, flags);
+    kvaddr += n * PAGE_SIZE;
+    return vaddr;
+}
+
 void bump_kvaddr()
 {
     kvaddr += PAGE_SIZE;
 }
 
+/**
+ * Give back the physical page behind a kernel page, keeping its virtual address
+ * reserved so that refill_kernel_page() can back it again later.
+ */
+void release_kernel_page(uint32_t vaddr)
+{
+    free_page(vaddr);
+    tlb_shootdown_all();
+}
+
+/**
+ * Back a kernel page given up by release_kernel_page() with a new physical
+ * page, whose contents are undefined.
+ */
+bool refill_kernel_page(uint32_t vaddr, int flags)
+{
+    return alloc_page(vaddr, flags);
+}
+
+/* Link pointer of a free cache object */
+#define KCACHE_LINK(cache, obj) (*(void **)((char *)(obj) + (cache)->link))
+
+/**
+ * Allocate an object from a cache, carving up a new kernel page if none are
+ * free. Objects from a new page are zeroed, while reused ones keep whatever
+ * was in them when freed, except for the link member.
+ */
+void *kcache_alloc(struct kcache *cache)
+{
+    uint32_t page, obj, flags;
+    void *p;
+
+    SAVE_INTERRUPTS(flags);
+    if (!cache->free) {
+        RESTORE_INTERRUPTS(flags);
+        page = alloc_kernel_page(PAGE_WRITABLE);
+        if (!page)
+            return NULL;
+        memset((void *)page, 0, PAGE_SIZE);
+
+        SAVE_INTERRUPTS(flags);
+        for (obj = page; obj + cache->size <= page + PAGE_SIZE;
+             obj += cache->size)
+        {
+            KCACHE_LINK(cache, obj) = cache->free;
+            cache->free = (void *)obj;
+        }
+    }
+
+    p = cache->free;
+    cache->free = KCACHE_LINK(cache, p);
+    RESTORE_INTERRUPTS(flags);
+    return p;
+}
+
+/**
+ * Return an object to its cache for reuse.
+ */
+void kcache_free(struct kcache *cache, void *obj)
+{
+    uint32_t flags;
+
+    SAVE_INTERRUPTS(flags);
+    KCACHE_LINK(cache, obj) = cache->free;
+    cache->free = obj;
+    RESTORE_INTERRUPTS(flags);
+}
+
 void free_page(uint32_t vaddr)
 {
     uint32_t paddr = ptabs[TABENT(vaddr)] & ~PAGE_MASK;
@@ -225,9 +416,9 @@ bool mm_add_mapping(uint32_t base, uint32_t size, uint32_t flags,
 {
     struct vmap *vm;
 
-    spin_lock(&proc->mm_lock);
+    spin_lock(&curproc->mm_lock);
 
-    for (vm = proc->vmaps; vm < proc->vmaps + NVMAPS; vm++) {
+    for (vm = curproc->vmaps; vm < curproc->vmaps + NVMAPS; vm++) {
         if (vm->size == 0) {
             vm->base = base;
             vm->size = size;
@@ -236,7 +427,7 @@ bool mm_add_mapping(uint32_t base, uint32_t size, uint32_t flags,
             vm->file_size = file_size;
             vm->inode = inode;
 
-            printk("mm: pid %d: vmap 0x%x-0x%x %s %s%s\n", proc->pid, base,
+            printk("mm: pid %d: vmap 0x%x-0x%x %s %s%s\n", curproc->pid, base,
                    base + size - 1,
                    (flags & VMAP_WRITABLE) ? "writable" : "readonly",
                    (flags & VMAP_STACK) ? "stack " : "",
@@ -245,34 +436,72 @@ bool mm_add_mapping(uint32_t base, uint32_t size, uint32_t flags,
         }
     }
 
-    spin_unlock(&proc->mm_lock);
-    return vm != proc->vmaps + NVMAPS;
+    spin_unlock(&curproc->mm_lock);
+    return vm != curproc->vmaps + NVMAPS;
 }
 
-void mm_free_proc_memory()
+/**
+ * Map a kernel page read-only into the current process at a user address. The
+ * page gets an extra reference for the mapping, so the process never frees it.
+ */
+bool mm_share_kernel_page(uint32_t base, uint32_t kpage)
 {
-    struct vmap *vm;
-    uint32_t addr, i;
+    if (!mm_add_mapping(base, PAGE_SIZE, VMAP_READONLY, 0, 0, NULL))
+        return false;
+    if (!map_page(base, vtophys(kpage), PAGE_USER))
+        return false;
 
-    for (vm = proc->vmaps; vm < proc->vmaps + NVMAPS; vm++) {
-        for (addr = vm->base; addr < vm->base + vm->size; addr += PAGE_SIZE) {
-            if (!check_page(addr))
-                continue;
-
-            spin_lock(&pc_lock);
-            if (PAGECOUNT(addr) == 0) {
-                spin_unlock(&pc_lock);
-                free_page(addr);
-            } else {
-                PAGECOUNT(addr)--;
-                spin_unlock(&pc_lock);
-            }
+    spin_lock(&pc_lock);
+    PAGECOUNT(kpage)++;
+    spin_unlock(&pc_lock);
+    return true;
+}
+
+/* Release the pages of a mapping, which must be in the current process. */
+static void free_vmap(struct vmap *vm)
+{
+    uint32_t addr;
+
+    for (addr = vm->base; addr < vm->base + vm->size; addr += PAGE_SIZE) {
+        if (!check_page(addr))
+            continue;
+
+        spin_lock(&pc_lock);
+        if (PAGECOUNT(addr) == 0) {
+            spin_unlock(&pc_lock);
+            free_page(addr);
+        } else {
+            PAGECOUNT(addr)--;
+            spin_unlock(&pc_lock);
+            ptabs[TABENT(addr)] = 0;
         }
+    }
 
-        vm->size = 0;
+    vm->size = 0;
+}
+
+/* Find the mapping of the current process containing an address. Must be
+ * called with mm_lock held. */
+static struct vmap *find_vmap(uint32_t addr)
+{
+    struct vmap *vm;
+
+    for (vm = curproc->vmaps; vm < curproc->vmaps + NVMAPS; vm++) {
+        if (addr >= vm->base && addr < vm->base + vm->size)
+            return vm;
     }
+    return NULL;
+}
+
+void mm_free_proc_memory()
+{
+    struct vmap *vm;
+    uint32_t i;
+
+    for (vm = curproc->vmaps; vm < curproc->vmaps + NVMAPS; vm++)
+        free_vmap(vm);
 
-    for (i = 256; i < 1024; i++) {
+    for (i = KERNEL_PDES; i < 1024; i++) {
         if (pdir[i] & PAGE_PRESENT) {
             push_page(pdir[i] & ~PAGE_MASK);
             pdir[i] = 0;
@@ -282,16 +511,72 @@ void mm_free_proc_memory()
     flush_tlb();
 }
 
+/**
+ * Create a stack mapping for a new thread in the highest free slot below the
+ * main stack. Returns the top of the stack, or 0 if there's no room.
+ */
+uint32_t mm_alloc_stack()
+{
+    struct vmap *vm;
+    uint32_t top;
+
+    spin_lock(&curproc->mm_lock);
+
+    for (vm = curproc->vmaps; vm < curproc->vmaps + NVMAPS; vm++) {
+        if (vm->size == 0)
+            break;
+    }
+    if (vm == curproc->vmaps + NVMAPS) {
+        spin_unlock(&curproc->mm_lock);
+        return 0;
+    }
+
+    /* Stacks grow down from the top of their slot, so a slot is free if its
+     * top page is. */
+    for (top = THREAD_STACK_TOP; top > THREAD_STACK_BOTTOM;
+         top -= THREAD_STACK_SIZE)
+    {
+        if (!find_vmap(top - PAGE_SIZE)) {
+            vm->base = top - PAGE_SIZE;
+            vm->size = PAGE_SIZE;
+            vm->flags = VMAP_WRITABLE | VMAP_STACK;
+            vm->file_offset = vm->file_size = 0;
+            vm->inode = NULL;
+            spin_unlock(&curproc->mm_lock);
+            return top;
+        }
+    }
+
+    spin_unlock(&curproc->mm_lock);
+    return 0;
+}
+
+/**
+ * Unmap a thread stack created by mm_alloc_stack().
+ */
+void mm_free_stack(uint32_t top)
+{
+    struct vmap *vm;
+
+    spin_lock(&curproc->mm_lock);
+    vm = find_vmap(top - PAGE_SIZE);
+    if (vm && (vm->flags & VMAP_STACK)) {
+        free_vmap(vm);
+        tlb_shootdown();
+    }
+    spin_unlock(&curproc->mm_lock);
+}
+
 bool mm_fork_memory(uint32_t *new_pdir)
 {
     struct vmap *vm;
     uint32_t addr, i, flags;
 
-    spin_lock(&proc->mm_lock);
+    spin_lock(&curproc->mm_lock);
 
     /* Set each private writable page to copy-on-write and increment the
      * physical page reference count of all present pages. */
-    for (vm = proc->vmaps; vm < proc->vmaps + NVMAPS; vm++) {
+    for (vm = curproc->vmaps; vm < curproc->vmaps + NVMAPS; vm++) {
         for (addr = vm->base; addr < vm->base + vm->size; addr += PAGE_SIZE) {
             flags = check_page(addr);
             if (!(vm->flags & VMAP_SHARED) && (flags & PAGE_WRITABLE)) {
@@ -306,10 +591,10 @@ bool mm_fork_memory(uint32_t *new_pdir)
     /* Copy all user page tables into the new process. Each physical page used
      * must be temporarily mapped into our own address space at the top page so
      * it can be written to, then it's added to the new page directory. */
-    for (i = 256; i < 1024; i++) {
+    for (i = KERNEL_PDES; i < 1024; i++) {
         if (pdir[i] & PAGE_PRESENT) {
             if (!alloc_page(0xfffff000, PAGE_WRITABLE)) {
-                spin_unlock(&proc->mm_lock);
+                spin_unlock(&curproc->mm_lock);
                 panic("mm_fork_memory: out of memory"); // FIXME: un-cow pages
                 return false;
             }
@@ -320,8 +605,10 @@ bool mm_fork_memory(uint32_t *new_pdir)
         }
     }
 
-    flush_tlb();
-    spin_unlock(&proc->mm_lock);
+    /* Other threads of this process must stop writing to the now copy-on-write
+     * pages before the child can see them. */
+    tlb_shootdown();
+    spin_unlock(&curproc->mm_lock);
     return true;
 }
 
@@ -329,8 +616,9 @@ static void pf_error(struct exception *e)
 {
     if (e->err & PF_USER) {
         printk("warning: pid %d segmentation fault [%s 0x%x at 0x%x]\n",
-               proc->pid, e->err & PF_WRITE ? "write" : "read", e->cr2, e->eip);
-        thread->signal |= (1 << SIGSEGV);
+               curproc->pid, e->err & PF_WRITE ? "write" : "read", e->cr2,
+               e->eip);
+        curthread->signal |= (1 << SIGSEGV);
     } else {
         dump_exception(e);
         panic("unexpected kmode page fault");
@@ -359,7 +647,7 @@ static void pf_copy_on_write(uint32_t page)
                               | PAGE_PRESENT | PAGE_USER | PAGE_WRITABLE;
     }
 
-    flush_tlb();
+    tlb_shootdown();
 }
 
 static void pf_load_page(uint32_t page, struct vmap *vm)
@@ -388,8 +676,7 @@ static void pf_load_page(uint32_t page, struct vmap *vm)
         set_page_writable(page, false);
         flush_tlb();
     }
-    if (vm->flags & VMAP_STACK) {
-        // TODO: check for collision with other mapping first
+    if ((vm->flags & VMAP_STACK) && !find_vmap(vm->base - PAGE_SIZE)) {
         vm->base -= PAGE_SIZE;
         vm->size += PAGE_SIZE;
     }
@@ -400,24 +687,21 @@ void handle_page_fault(struct exception *e)
     uint32_t page;
     struct vmap *vm;
 
-    if (!proc) {
+    if (!curproc) {
         dump_exception(e);
         panic("page fault during memory initialization");
     }
     ENABLE_INTERRUPTS;
 
-    printk("page fault: pid %d: %s 0x%x\n", proc->pid,
+    printk("page fault: pid %d: %s 0x%x\n", curproc->pid,
            e->err & PF_WRITE ? "write" : "read", e->cr2);
 
-    spin_lock(&proc->mm_lock);
+    spin_lock(&curproc->mm_lock);
     page = PAGE_BASE(e->cr2);
-    for (vm = proc->vmaps; vm < proc->vmaps + NVMAPS; vm++) {
-        if (page >= vm->base && page < vm->base + vm->size)
-            break;
-    }
-    if (vm == proc->vmaps + NVMAPS) {
+    vm = find_vmap(page);
+    if (!vm) {
         pf_error(e);
-        spin_unlock(&proc->mm_lock);
+        spin_unlock(&curproc->mm_lock);
         return;
     }
 
@@ -430,5 +714,5 @@ void handle_page_fault(struct exception *e)
     else
         pf_error(e);
 
-    spin_unlock(&proc->mm_lock);
+    spin_unlock(&curproc->mm_lock);
 }
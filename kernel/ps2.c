@@ -6,6 +6,7 @@
 #include <kernel.h>
 #include <ps2.h>
 #include <x86.h>
+#include <softirq.h>
 
 extern void tty_handle_input(uint8_t minor, char c);
 
@@ -83,6 +84,13 @@ static bool shift = false;
 static bool ctrl = false;
 static bool alt = false;
 
+/* Scancodes received by the interrupt handler, waiting for the tasklet */
+static uint8_t scancodes[16];
+static unsigned int scan_head, scan_tail;
+
+static void decode_scancodes(void *data);
+static struct tasklet keyboard_tasklet = TASKLET_INIT(decode_scancodes, NULL);
+
 static uint8_t read_data()
 {
     while ((in_byte(PS2_CMD) & PS2_STATUS_OUT) == 0) {}
@@ -141,20 +149,43 @@ void ps2_init()
     read_data(); // Acknowledge
 }
 
+/* Translate the scancodes received so far and pass them to the terminal. */
+static void decode_scancodes(void *data)
+{
+    uint8_t scancode;
+    bool release;
+
+    while (scan_tail != scan_head) {
+        scancode = scancodes[scan_tail];
+        scan_tail = (scan_tail + 1) % sizeof(scancodes);
+        release = (scancode & KEY_RELEASE) != 0;
+        scancode &= ~KEY_RELEASE;
+
+        if (scancode == KEY_LSHIFT || scancode == KEY_RSHIFT)
+            shift = !release;
+        else if (scancode == KEY_CTRL)
+            ctrl = !release;
+        else if (scancode == KEY_ALT)
+            alt = !release;
+        else if (!release)
+            tty_handle_input(0, shift ? shift_keymap[scancode]
+                                      : keymap[scancode]);
+    }
+}
+
+/**
+ * Keyboard interrupt handler. Only reads the scancode, which is dropped if the
+ * tasklet has fallen too far behind.
+ */
 void handle_keyboard_irq()
 {
     uint8_t scancode = read_data();
-    bool release = (scancode & KEY_RELEASE) != 0;
-    scancode &= ~KEY_RELEASE;
-
-    if (scancode == KEY_LSHIFT || scancode == KEY_RSHIFT)
-        shift = !release;
-    else if (scancode == KEY_CTRL)
-        ctrl = !release;
-    else if (scancode == KEY_ALT)
-        alt = !release;
-    else if (!release)
-        tty_handle_input(0, shift ? shift_keymap[scancode] : keymap[scancode]);
+
+    if ((scan_head + 1) % sizeof(scancodes) != scan_tail) {
+        scancodes[scan_head] = scancode;
+        scan_head = (scan_head + 1) % sizeof(scancodes);
+    }
+    tasklet_schedule(&keyboard_tasklet);
 }
 
 /*
@@ -0,0 +1,257 @@
+/**
+ * The SakuraOS Kernel
+ * Copyright 2025 Adam Judge
+ * File: rbtree.c
+ */
+
+#include <kernel.h>
+#include <rbtree.h>
+
+static void rotate_left(struct rb_root *root, struct rb_node *x)
+{
+    struct rb_node *y = x->right;
+
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+    y->parent = x->parent;
+    if (!x->parent)
+        root->node = y;
+    else if (x == x->parent->left)
+        x->parent->left = y;
+    else
+        x->parent->right = y;
+    y->left = x;
+    x->parent = y;
+}
+
+static void rotate_right(struct rb_root *root, struct rb_node *x)
+{
+    struct rb_node *y = x->left;
+
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+    y->parent = x->parent;
+    if (!x->parent)
+        root->node = y;
+    else if (x == x->parent->right)
+        x->parent->right = y;
+    else
+        x->parent->left = y;
+    y->right = x;
+    x->parent = y;
+}
+
+void rb_insert_color(struct rb_root *root, struct rb_node *node)
+{
+    struct rb_node *parent, *gparent, *uncle;
+
+    while ((parent = node->parent) && parent->color == RB_RED) {
+        /* A red node is never the root, so the grandparent exists. */
+        gparent = parent->parent;
+
+        if (parent == gparent->left) {
+            uncle = gparent->right;
+            if (uncle && uncle->color == RB_RED) {
+                parent->color = uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rotate_left(root, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rotate_right(root, gparent);
+        } else {
+            uncle = gparent->left;
+            if (uncle && uncle->color == RB_RED) {
+                parent->color = uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rotate_right(root, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rotate_left(root, gparent);
+        }
+    }
+
+    root->node->color = RB_BLACK;
+}
+
+/* Replace the subtree rooted at old with the one rooted at new. */
+static void transplant(struct rb_root *root, struct rb_node *old,
+                       struct rb_node *new)
+{
+    if (!old->parent)
+        root->node = new;
+    else if (old == old->parent->left)
+        old->parent->left = new;
+    else
+        old->parent->right = new;
+    if (new)
+        new->parent = old->parent;
+}
+
+#define IS_BLACK(n) (!(n) || (n)->color == RB_BLACK)
+
+/* Restore the black height after removing a black node. Since node may be
+ * null, its parent is tracked separately. */
+static void erase_fixup(struct rb_root *root, struct rb_node *node,
+                        struct rb_node *parent)
+{
+    struct rb_node *sibling;
+
+    while (node != root->node && IS_BLACK(node)) {
+        if (node == parent->left) {
+            sibling = parent->right;
+            if (sibling->color == RB_RED) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_left(root, parent);
+                sibling = parent->right;
+            }
+            if (IS_BLACK(sibling->left) && IS_BLACK(sibling->right)) {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (IS_BLACK(sibling->right)) {
+                sibling->left->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rotate_right(root, sibling);
+                sibling = parent->right;
+            }
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->right->color = RB_BLACK;
+            rotate_left(root, parent);
+        } else {
+            sibling = parent->left;
+            if (sibling->color == RB_RED) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_right(root, parent);
+                sibling = parent->left;
+            }
+            if (IS_BLACK(sibling->left) && IS_BLACK(sibling->right)) {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (IS_BLACK(sibling->left)) {
+                sibling->right->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rotate_left(root, sibling);
+                sibling = parent->left;
+            }
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->left->color = RB_BLACK;
+            rotate_right(root, parent);
+        }
+        node = root->node;
+    }
+
+    if (node)
+        node->color = RB_BLACK;
+}
+
+void rb_erase(struct rb_root *root, struct rb_node *node)
+{
+    struct rb_node *child, *parent, *next;
+    int color = node->color;
+
+    if (!node->left) {
+        child = node->right;
+        parent = node->parent;
+        transplant(root, node, child);
+    } else if (!node->right) {
+        child = node->left;
+        parent = node->parent;
+        transplant(root, node, child);
+    } else {
+        /* Move the in-order successor into the removed node's place. */
+        next = node->right;
+        while (next->left)
+            next = next->left;
+        color = next->color;
+        child = next->right;
+
+        if (next->parent == node) {
+            parent = next;
+        } else {
+            parent = next->parent;
+            transplant(root, next, child);
+            next->right = node->right;
+            next->right->parent = next;
+        }
+        transplant(root, node, next);
+        next->left = node->left;
+        next->left->parent = next;
+        next->color = node->color;
+    }
+
+    if (color == RB_BLACK)
+        erase_fixup(root, child, parent);
+}
+
+struct rb_node *rb_first(struct rb_root *root)
+{
+    struct rb_node *n = root->node;
+
+    if (!n)
+        return NULL;
+    while (n->left)
+        n = n->left;
+    return n;
+}
+
+struct rb_node *rb_last(struct rb_root *root)
+{
+    struct rb_node *n = root->node;
+
+    if (!n)
+        return NULL;
+    while (n->right)
+        n = n->right;
+    return n;
+}
+
+struct rb_node *rb_next(struct rb_node *node)
+{
+    if (node->right) {
+        node = node->right;
+        while (node->left)
+            node = node->left;
+        return node;
+    }
+    while (node->parent && node == node->parent->right)
+        node = node->parent;
+    return node->parent;
+}
+
+struct rb_node *rb_prev(struct rb_node *node)
+{
+    if (node->left) {
+        node = node->left;
+        while (node->right)
+            node = node->right;
+        return node;
+    }
+    while (node->parent && node == node->parent->left)
+        node = node->parent;
+    return node->parent;
+}
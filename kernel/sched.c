@@ -10,10 +10,8 @@
 #include <mm.h>
 #include <sched.h>
 #include <signal.h>
-
-/* Programmable Interrupt Timer Registers */
-#define PIT_CMD  0x43
-#define PIT_DATA 0x40
+#include <softirq.h>
+#include <vdso.h>
 
 /* Assembly routines */
 extern void switch_context();
@@ -21,118 +19,374 @@ extern void iret_from_exception();
 
 extern uint32_t init_pdir[];
 
-static struct proc procs[NPROCS];
-struct proc *proc;
-
-static struct thread threads[NTHREADS];
-static struct thread *idle;
-struct thread *thread;
-struct thread *next_thread;
+/* Processes and threads are allocated on demand. Freed ones keep the address
+ * of their page directory or kernel stack for the next one, and the page too
+ * while the pool counts are below PDIR_POOL_SIZE and KSTACK_POOL_SIZE. */
+static struct kcache proc_cache = KCACHE_INIT(struct proc, hash_next);
+static struct kcache thread_cache = KCACHE_INIT(struct thread, next);
+static unsigned int pdir_pool;
+static unsigned int kstack_pool;
+
+/* All processes are in proc_list and the PID hash, and all threads are in
+ * thread_list. Released threads wait in dead_threads until their CPU has
+ * switched away from them. Only changed with interrupts disabled and the big
+ * kernel lock held. */
+static struct proc *proc_list;
+static struct proc *pid_hash[PID_HASH_SIZE];
+static struct thread *thread_list;
+static struct thread *dead_threads;
+
+/* PIDs in use, handed out in increasing order from last_pid and wrapping, so
+ * that a PID isn't reused soon after it's freed. */
+static uint32_t pid_map[PID_MAX / 32];
+static unsigned int last_pid;
 
-static unsigned int next_pid;
-static unsigned int schedule_timer;
 static unsigned int njiffies;
-static spinlock_t sched_lock;
+
+#define PID_HASH(pid) ((pid) % PID_HASH_SIZE)
 
 void sched_init()
 {
-    struct proc *p;
-    struct thread *t;
+    struct cpu *cpu = this_cpu();
 
     printk("Starting scheduler\n");
 
-    thread = idle = threads;
-    next_pid = 1;
-    schedule_timer = SCHED_FREQ;
-    idle->state = TS_RUNNING;
-    idle->counter = -1;
+    /* The boot context becomes the idle thread of the bootstrap processor. */
+    cpu->idle = create_thread(NULL);
+    if (!cpu->idle)
+        panic("failed to create idle thread");
+    cpu->thread = cpu->idle;
+    cpu->idle->state = TS_RUNNING;
+    cpu->online = true;
 
-    for (p = procs; p < procs + NPROCS; p++) {
-        p->pdir = (uint32_t *)alloc_kernel_page(PAGE_WRITABLE);
-        if (!p->pdir)
-            panic("failed to allocate process page directory");
-        p->cr3 = vtophys((uint32_t)p->pdir);
+    timer_init();
+    ENABLE_INTERRUPTS;
+}
+
+/* Run queue operations, dispatched to the thread's scheduling class. All of
+ * these must be called with interrupts disabled and the big kernel lock held. */
+
+static void enqueue_thread(struct cpu *cpu, struct thread *t, bool wakeup)
+{
+    if (t->policy == SCHED_OTHER)
+        fair_enqueue(cpu, t, wakeup);
+    else
+        rt_enqueue(cpu, t, false);
+}
+
+static void dequeue_thread(struct thread *t)
+{
+    if (t->policy == SCHED_OTHER)
+        fair_dequeue(t->cpu, t);
+    else
+        rt_dequeue(t->cpu, t);
+}
+
+/* Priority of what a CPU is running, for deciding where real-time threads
+ * should go: -1 when idle, 0 for normal threads, or the real-time priority. */
+static int cpu_prio(struct cpu *cpu)
+{
+    if (cpu->thread == cpu->idle)
+        return -1;
+    return cpu->thread->rt_priority;
+}
+
+static bool should_preempt(struct cpu *cpu, struct thread *t)
+{
+    struct thread *curr = cpu->thread;
+
+    if (curr == cpu->idle)
+        return true;
+    else if (curr->policy != SCHED_OTHER && cpu->rt.throttled)
+        return t->policy == SCHED_OTHER;
+    else if (t->policy != SCHED_OTHER || curr->policy != SCHED_OTHER)
+        return t->rt_priority > curr->rt_priority;
+    else
+        return fair_wakeup_preempt(cpu, t);
+}
+
+/* Find the CPU running the lowest priority that a real-time thread could
+ * preempt, preferring the one it last ran on, or NULL if there is none. */
+static struct cpu *find_lowest_cpu(struct thread *t, struct cpu *exclude)
+{
+    struct cpu *cpu, *best = NULL;
+
+    if (t->cpu != exclude && cpu_prio(t->cpu) < t->rt_priority)
+        best = t->cpu;
+
+    for (cpu = cpus; cpu < cpus + NCPUS; cpu++) {
+        if (!cpu->online || cpu == exclude || cpu->rt.throttled)
+            continue;
+        if (cpu_prio(cpu) >= t->rt_priority)
+            continue;
+        if (!best || cpu_prio(cpu) < cpu_prio(best))
+            best = cpu;
     }
+    return best;
+}
 
-    for (t = threads; t < threads + NTHREADS; t++) {
-        bump_kvaddr(); /* Create gap to catch overflow */
-        t->kstack = (void *)alloc_kernel_page(PAGE_WRITABLE);
-        if (!t->kstack)
-            panic("failed to allocate thread kernel stack");
-        t->tss_esp0 = (uint32_t)t->kstack + PAGE_SIZE;
+/* Called by a CPU with nothing to run. Takes the highest priority real-time
+ * thread waiting on another CPU, or else a thread from the busiest other CPU. */
+static struct thread *steal_thread(struct cpu *thief)
+{
+    struct cpu *cpu, *victim = NULL;
+    struct thread *t, *best = NULL;
+
+    for (cpu = cpus; cpu < cpus + NCPUS; cpu++) {
+        if (cpu == thief || !cpu->online || cpu->rt.nr_running == 0)
+            continue;
+        t = rt_first(cpu, NULL);
+        if (t && (!best || t->rt_priority > best->rt_priority))
+            best = t;
+    }
+    if (best) {
+        rt_dequeue(best->cpu, best);
+        best->cpu = thief;
+        return best;
     }
 
-    /* Program the timer. */
-    out_byte_wait(PIT_CMD, 0x36);
-    out_byte_wait(PIT_DATA, TIMER_DIVIDER & 0xff);
-    out_byte_wait(PIT_DATA, (TIMER_DIVIDER >> 8) & 0xff);
+    for (cpu = cpus; cpu < cpus + NCPUS; cpu++) {
+        if (cpu == thief || !cpu->online || cpu->rq.nr_running == 0)
+            continue;
+        if (!victim || cpu->rq.nr_running > victim->rq.nr_running)
+            victim = cpu;
+    }
+    if (!victim)
+        return NULL;
 
-    ENABLE_INTERRUPTS;
+    return fair_steal(thief, victim);
 }
 
-void handle_timer_irq()
+/* Charge a tick to whatever a CPU is running, and check whether it should
+ * reschedule. */
+static bool sched_tick(struct cpu *cpu, bool queued)
 {
-    struct proc *p;
-    struct thread *t;
+    struct thread *curr = cpu->thread;
+
+    if (curr == cpu->idle)
+        return queued;
+    else if (curr->policy == SCHED_OTHER)
+        return fair_tick(cpu);
+    else
+        return rt_tick(cpu);
+}
 
-    njiffies++;
+/* Count a timer tick and do the scheduler tick on every CPU. */
+static void do_tick()
+{
+    struct cpu *cpu;
+    bool queued = false;
 
-    for (p = procs; p < procs + NPROCS; p++) {
-        p->rtime += 10;
-        if (p->alarm && --p->alarm == 0)
-            p->signal |= (1 << SIGALRM);
+    njiffies++;
+    vdso_update(njiffies);
+
+    /* Only the bootstrap processor receives the timer interrupt, so it keeps
+     * time for all the others and kicks them when their slice runs out. Idle
+     * CPUs are also kicked while any CPU has threads to steal. */
+    for (cpu = cpus; cpu < cpus + NCPUS; cpu++) {
+        if (cpu->online && cpu->rq.nr_running + cpu->rt.nr_running > 0)
+            queued = true;
+    }
+    for (cpu = cpus; cpu < cpus + NCPUS; cpu++) {
+        if (!cpu->online)
+            continue;
+        if (njiffies % SCHED_RT_PERIOD == 0)
+            rt_new_period(cpu);
+        if (sched_tick(cpu, queued))
+            smp_reschedule(cpu);
     }
+}
 
-    for (t = threads; t < threads + NTHREADS; t++) {
-        if (t->state == TS_INTERRUPTIBLE) {
-            if (t->sleep != 0 && t->sleep <= njiffies) {
-                t->sleep = 0;
-                t->state = TS_RUNNING;
-                t->counter = 0x7fffffff;
-                schedule();
-                return;
-            }
-        }
+/**
+ * Timer interrupt handler. Only the scheduler tick is done here, and expired
+ * alarms and sleeps are left to the timer softirq. In one-shot mode, the
+ * interrupt may be for a sleep deadline between ticks.
+ */
+void handle_timer_irq()
+{
+    unsigned int ticks = timer_interrupt();
+
+    raise_softirq(SOFTIRQ_TIMER);
+    while (ticks--)
+        do_tick();
+}
+
+/* Keep the page of a freed process or thread for reuse if the pool isn't
+ * full, or if it must be kept anyway, otherwise give it back. */
+static void pool_page(uint32_t page, unsigned int *pool, unsigned int size,
+                      bool keep)
+{
+    uint32_t flags;
+
+    SAVE_INTERRUPTS(flags);
+    if (*pool < size || keep)
+        (*pool)++;
+    else
+        release_kernel_page(page);
+    RESTORE_INTERRUPTS(flags);
+}
+
+/* Take the page of a reused process or thread out of its pool. Returns false
+ * if it was given back, and must be refilled. */
+static bool unpool_page(uint32_t page, unsigned int *pool)
+{
+    uint32_t flags;
+    bool pooled;
+
+    SAVE_INTERRUPTS(flags);
+    pooled = check_page(page) & PAGE_PRESENT;
+    if (pooled)
+        (*pool)--;
+    RESTORE_INTERRUPTS(flags);
+    return pooled;
+}
+
+/* Check whether a page directory may still be loaded on some CPU, which keeps
+ * it after switching to a kernel thread. */
+static bool pdir_loaded(uint32_t cr3)
+{
+    struct cpu *cpu;
+
+    for (cpu = cpus; cpu < cpus + NCPUS; cpu++) {
+        if (cpu->cr3 == cr3)
+            return true;
     }
+    return false;
+}
 
-    if (--schedule_timer == 0) {
-        schedule();
+/* Free released threads that are no longer running on their CPU. */
+static void reap_dead_threads()
+{
+    struct thread **tp = &dead_threads, *t;
+    uint32_t flags;
+
+    SAVE_INTERRUPTS(flags);
+    while ((t = *tp)) {
+        if (t->cpu->thread == t) {
+            tp = &t->next;
+        } else {
+            *tp = t->next;
+            pool_page((uint32_t)t->kstack, &kstack_pool, KSTACK_POOL_SIZE,
+                      false);
+            kcache_free(&thread_cache, t);
+        }
     }
+    RESTORE_INTERRUPTS(flags);
 }
 
-void schedule()
+/**
+ * Deliver expired alarms and wake threads whose sleep is over, then arm the
+ * timer for the next sleep deadline. Run from the timer softirq, which may be
+ * behind by a few ticks.
+ */
+void sched_run_timers()
 {
+    struct proc *p;
     struct thread *t;
+    unsigned int now = njiffies;
+    uint64_t clock = sched_clock(), next = 0;
 
-    schedule_timer = SCHED_FREQ;
+    for (p = proc_list; p; p = p->next) {
+        if (p->alarm && p->alarm <= now) {
+            p->alarm = 0;
+            p->signal |= (1 << SIGALRM);
+        }
+    }
 
-    next_thread = idle;
-    for (t = threads; t < threads + NTHREADS; t++) {
-        if (t->proc && t->proc->state != PS_RUNNING)
+    for (t = thread_list; t; t = t->next) {
+        if (t->state != TS_INTERRUPTIBLE || t->sleep == 0)
             continue;
-        if (t->state == TS_RUNNING && t->counter > next_thread->counter)
-            next_thread = t;
+        if (t->sleep <= clock) {
+            t->sleep = 0;
+            wake_thread(t);
+        } else if (next == 0 || t->sleep < next) {
+            next = t->sleep;
+        }
     }
+    if (next)
+        timer_arm(next);
 
-    for (t = threads; t < threads + NTHREADS; t++) {
-        if (t != idle) {
-            t->counter++;
+    reap_dead_threads();
+}
+
+/* Requeue the previous thread if it's still runnable and pick the next one.
+ * A yielding thread is only picked again if nothing else can run here. */
+static void do_schedule(bool yield)
+{
+    struct cpu *cpu = this_cpu();
+    struct thread *prev = cpu->thread, *next = NULL, *skip = NULL;
+    struct cpu *target;
+    bool head;
+
+    cpu->need_resched = false;
+
+    if (prev != cpu->idle && prev->state == TS_RUNNING) {
+        if (prev->policy == SCHED_OTHER) {
+            fair_enqueue(cpu, prev, false);
+        } else {
+            /* A preempted real-time thread keeps its place at the head of
+             * its priority, unless its round-robin slice is up. */
+            head = !yield && !(prev->policy == SCHED_RR
+                               && prev->slice >= SCHED_RR_TIMESLICE);
+            rt_enqueue(cpu, prev, head);
         }
+        if (yield)
+            skip = prev;
     }
 
-    if (next_thread != idle) {
-        next_thread->counter = 0;
+    if (!cpu->rt.throttled)
+        next = rt_pick(cpu, skip);
+    if (!next)
+        next = fair_pick(cpu, skip);
+    if (!next && cpu->rt.throttled)
+        next = rt_pick(cpu, skip);
+    if (!next && skip && thread_can_run(skip)) {
+        dequeue_thread(skip);
+        next = skip;
+    }
+    if (!next)
+        next = steal_thread(cpu);
+    if (!next)
+        next = cpu->idle;
+
+    /* Push a preempted real-time thread to a CPU where it can run now. The
+     * big kernel lock keeps that CPU from switching to it until we've
+     * switched away. */
+    if (prev != next && prev->on_rq && prev->policy != SCHED_OTHER) {
+        target = find_lowest_cpu(prev, cpu);
+        if (target) {
+            rt_dequeue(cpu, prev);
+            prev->cpu = target;
+            rt_enqueue(target, prev, true);
+            smp_reschedule(target);
+        }
     }
 
-    switch_context();
+    if (next != prev) {
+        fpu_switch(prev, next);
+        account_time(prev, false);
+        next->stamp = prev->stamp;
+        if (next->proc)
+            cpu->cr3 = next->proc->cr3;
+        cpu->next_thread = next;
+        switch_context();
+    }
+}
+
+void schedule()
+{
+    do_schedule(false);
 }
 
 struct proc *get_process(int pid)
 {
     struct proc *p;
 
-    for (p = procs; p < procs + NPROCS; p++) {
-        if (p->state != PS_NONE && p->pid == pid)
+    if (pid <= 0)
+        return NULL;
+
+    for (p = pid_hash[PID_HASH(pid)]; p; p = p->hash_next) {
+        if (p->pid == pid)
             return p;
     }
 
@@ -142,14 +396,14 @@ struct proc *get_process(int pid)
 void yield_thread()
 {
     DISABLE_INTERRUPTS;
-    schedule();
+    do_schedule(true);
     ENABLE_INTERRUPTS;
 }
 
 void block_thread_interruptible()
 {
     DISABLE_INTERRUPTS;
-    thread->state = TS_INTERRUPTIBLE;
+    curthread->state = TS_INTERRUPTIBLE;
     schedule();
     ENABLE_INTERRUPTS;
 }
@@ -157,227 +411,943 @@ void block_thread_interruptible()
 void block_thread_uninterruptible()
 {
     DISABLE_INTERRUPTS;
-    thread->state = TS_UNINTERRUPTIBLE;
+    curthread->state = TS_UNINTERRUPTIBLE;
     schedule();
     ENABLE_INTERRUPTS;
 }
 
 
-void sleep_thread(unsigned int time)
+/**
+ * Sleep until sched_clock() reaches a deadline, or until woken early by a
+ * signal.
+ */
+void sleep_until(uint64_t deadline)
 {
     DISABLE_INTERRUPTS;
-    thread->sleep = njiffies + time;
-    thread->state = TS_INTERRUPTIBLE;
+    curthread->sleep = deadline;
+    curthread->state = TS_INTERRUPTIBLE;
+    timer_arm(deadline);
     schedule();
+    curthread->sleep = 0;
     ENABLE_INTERRUPTS;
 }
 
+/**
+ * Sleep for a number of nanoseconds, or until woken early by a signal.
+ */
+void sleep_thread(uint64_t ns)
+{
+    sleep_until(sched_clock() + ns);
+}
+
+/**
+ * Make a blocked thread runnable on the CPU it last ran on, or for real-time
+ * threads, on the CPU running the lowest priority. That CPU is kicked if the
+ * thread should preempt what it's running, otherwise an idle CPU is kicked to
+ * steal it.
+ */
+void wake_thread(struct thread *t)
+{
+    struct cpu *cpu;
+    uint32_t flags;
+
+    SAVE_INTERRUPTS(flags);
+    if (t->state != TS_INTERRUPTIBLE && t->state != TS_UNINTERRUPTIBLE) {
+        RESTORE_INTERRUPTS(flags);
+        return;
+    }
+
+    if (t->policy != SCHED_OTHER) {
+        cpu = find_lowest_cpu(t, NULL);
+        if (cpu)
+            t->cpu = cpu;
+    }
+
+    t->state = TS_RUNNING;
+    enqueue_thread(t->cpu, t, true);
+
+    if (should_preempt(t->cpu, t)) {
+        smp_reschedule(t->cpu);
+    } else {
+        for (cpu = cpus; cpu < cpus + NCPUS; cpu++) {
+            if (cpu->online && cpu->thread == cpu->idle) {
+                smp_reschedule(cpu);
+                break;
+            }
+        }
+    }
+    RESTORE_INTERRUPTS(flags);
+}
+
+/**
+ * Sleep on a wait queue until woken by wait_queue_wake() or a signal. Must be
+ * called with interrupts disabled after checking for the event, so that a
+ * wakeup can't be missed in between.
+ */
+void wait_queue_sleep(struct wait_queue *wq)
+{
+    struct thread **tp;
+
+    curthread->wait_next = wq->head;
+    wq->head = curthread;
+    curthread->state = TS_INTERRUPTIBLE;
+    schedule();
+
+    /* Still queued if woken by a signal instead. */
+    for (tp = &wq->head; *tp; tp = &(*tp)->wait_next) {
+        if (*tp == curthread) {
+            *tp = curthread->wait_next;
+            break;
+        }
+    }
+}
+
+/**
+ * Wake every thread sleeping on a wait queue.
+ */
+void wait_queue_wake(struct wait_queue *wq)
+{
+    struct thread *t;
+    uint32_t flags;
+
+    SAVE_INTERRUPTS(flags);
+    while ((t = wq->head)) {
+        wq->head = t->wait_next;
+        wake_thread(t);
+    }
+    RESTORE_INTERRUPTS(flags);
+}
+
 unsigned int jiffies()
 {
     return njiffies;
 }
 
-struct proc *create_proc()
+static unsigned int alloc_pid()
+{
+    unsigned int pid = last_pid, i;
+
+    for (i = 1; i < PID_MAX; i++) {
+        pid = pid + 1 < PID_MAX ? pid + 1 : 1;
+        if (!(pid_map[pid / 32] & (1 << (pid % 32)))) {
+            pid_map[pid / 32] |= 1 << (pid % 32);
+            last_pid = pid;
+            return pid;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Create a process as a child of parent, or with no parent for init. It has no
+ * threads yet.
+ */
+struct proc *create_proc(struct proc *parent)
 {
     struct proc *p;
+    unsigned int pid;
+    uint32_t flags;
+    bool fresh = false;
 
-    spin_lock(&sched_lock);
+    p = kcache_alloc(&proc_cache);
+    if (!p)
+        return NULL;
 
-    for (p = procs; p < procs + NPROCS; p++) {
-        if (p->state == PS_NONE)
-            break;
+    if (!p->pdir) {
+        p->pdir = (uint32_t *)alloc_kernel_page(PAGE_WRITABLE);
+        if (!p->pdir) {
+            kcache_free(&proc_cache, p);
+            return NULL;
+        }
+        fresh = true;
+    } else if (!unpool_page((uint32_t)p->pdir, &pdir_pool)) {
+        if (!refill_kernel_page((uint32_t)p->pdir, PAGE_WRITABLE)) {
+            kcache_free(&proc_cache, p);
+            return NULL;
+        }
+        fresh = true;
+    }
+
+    /* A pooled page directory still holds the kernel entries, and its user
+     * entries were cleared when its last process freed its memory. */
+    if (fresh) {
+        p->cr3 = vtophys((uint32_t)p->pdir);
+        memcpy(p->pdir, init_pdir, KERNEL_PDES * sizeof(uint32_t));
+        memset(p->pdir + KERNEL_PDES, 0,
+               (1024 - KERNEL_PDES) * sizeof(uint32_t));
+        p->pdir[1] = p->cr3 | PAGE_PRESENT | PAGE_WRITABLE;
     }
-    if (p == procs + NPROCS) {
-        spin_unlock(&sched_lock);
+
+    SAVE_INTERRUPTS(flags);
+    pid = alloc_pid();
+    if (!pid) {
+        RESTORE_INTERRUPTS(flags);
+        kcache_free(&proc_cache, p);
         return NULL;
     }
+    RESTORE_INTERRUPTS(flags);
 
     p->state = PS_RUNNING;
-    spin_unlock(&sched_lock);
-
-    p->pid = next_pid++;
+    p->pid = pid;
+    p->ppid = parent ? parent->pid : 0;
     p->alarm = 0;
-    p->rtime = 0;
-    p->ktime = 0;
-    p->utime = 0;
+    p->nice = 0;
+    p->policy = SCHED_OTHER;
+    p->rt_priority = 0;
+    p->start_time = njiffies;
+    p->utime = p->stime = 0;
+    p->cutime = p->cstime = 0;
     p->next_tid = 1;
     p->nthreads = 0;
     p->exit_status = 0;
+    p->stop_signal = 0;
+    p->stop_reported = false;
+    p->child_wait.head = NULL;
+    p->exit_wait.head = NULL;
     p->signal = 0;
     p->mm_lock = 0;
-
-    memcpy(p->pdir, init_pdir, PAGE_SIZE);
-    p->pdir[1] = p->cr3 | PAGE_PRESENT | PAGE_WRITABLE;
+    p->parent = parent;
+    p->children = NULL;
+    p->threads = NULL;
+
+    SAVE_INTERRUPTS(flags);
+    p->hash_next = pid_hash[PID_HASH(pid)];
+    pid_hash[PID_HASH(pid)] = p;
+    p->prev = NULL;
+    p->next = proc_list;
+    if (proc_list)
+        proc_list->prev = p;
+    proc_list = p;
+    if (parent) {
+        p->sibling = parent->children;
+        parent->children = p;
+    }
+    RESTORE_INTERRUPTS(flags);
 
     return p;
 }
 
+/**
+ * Free a process that was reaped or never started, which must have no threads
+ * left.
+ */
+void release_proc(struct proc *p)
+{
+    struct proc **pp;
+    uint32_t flags;
+
+    SAVE_INTERRUPTS(flags);
+    for (pp = &pid_hash[PID_HASH(p->pid)]; *pp != p; pp = &(*pp)->hash_next)
+        ;
+    *pp = p->hash_next;
+    if (p->prev)
+        p->prev->next = p->next;
+    else
+        proc_list = p->next;
+    if (p->next)
+        p->next->prev = p->prev;
+    if (p->parent) {
+        for (pp = &p->parent->children; *pp != p; pp = &(*pp)->sibling)
+            ;
+        *pp = p->sibling;
+    }
+    pid_map[p->pid / 32] &= ~(1 << (p->pid % 32));
+    p->state = PS_NONE;
+    pool_page((uint32_t)p->pdir, &pdir_pool, PDIR_POOL_SIZE,
+              pdir_loaded(p->cr3));
+    kcache_free(&proc_cache, p);
+    RESTORE_INTERRUPTS(flags);
+}
+
 struct thread *create_thread(struct proc *proc)
 {
     struct thread *t;
+    uint32_t flags;
 
-    spin_lock(&sched_lock);
+    reap_dead_threads();
 
-    for (t = threads; t < threads + NTHREADS; t++) {
-        if (t->state == TS_NONE)
-            break;
-    }
-    if (t == threads + NTHREADS) {
-        spin_unlock(&sched_lock);
+    t = kcache_alloc(&thread_cache);
+    if (!t)
+        return NULL;
+
+    if (!t->kstack) {
+        bump_kvaddr(); /* Create gap to catch overflow */
+        t->kstack = (void *)alloc_kernel_page(PAGE_WRITABLE);
+        if (!t->kstack) {
+            kcache_free(&thread_cache, t);
+            return NULL;
+        }
+        t->tss_esp0 = (uint32_t)t->kstack + PAGE_SIZE;
+    } else if (!unpool_page((uint32_t)t->kstack, &kstack_pool)
+               && !refill_kernel_page((uint32_t)t->kstack, PAGE_WRITABLE))
+    {
+        kcache_free(&thread_cache, t);
         return NULL;
     }
 
     t->state = TS_INTERRUPTIBLE;
-    spin_unlock(&sched_lock);
-
-    t->counter = 0;
     t->sleep = 0;
     t->signal = 0;
     t->sigmask = 0;
+    t->ustack = 0;
+    t->joiner = NULL;
+    t->futex_key = 0;
+    t->futex_next = NULL;
+    t->lock_depth = 1;
+    t->cpu = this_cpu();
+    t->on_rq = false;
+    t->policy = proc ? proc->policy : SCHED_OTHER;
+    t->rt_priority = proc ? proc->rt_priority : 0;
+    t->rt_next = t->rt_prev = NULL;
+    t->weight = nice_to_weight(proc ? proc->nice : 0);
+    t->vruntime = t->cpu->rq.min_vruntime;
+    t->slice = 0;
+    t->utime = t->stime = 0;
+    t->fpu_used = false;
+    t->fpu_cpu = NULL;
     t->proc = proc;
     t->tid = proc ? proc->next_tid++ : 0;
-    if (proc)
-        inc_dword(&proc->nthreads);
 
     t->esp = (uint32_t)t->kstack + PAGE_SIZE;
     memset(t->kstack, 0, PAGE_SIZE);
 
+    SAVE_INTERRUPTS(flags);
+    t->prev = NULL;
+    t->next = thread_list;
+    if (thread_list)
+        thread_list->prev = t;
+    thread_list = t;
+    if (proc) {
+        t->proc_next = proc->threads;
+        proc->threads = t;
+        inc_dword(&proc->nthreads);
+    }
+    RESTORE_INTERRUPTS(flags);
+
     return t;
 }
 
+/**
+ * Release a thread that has exited or was never started. It's freed once its
+ * CPU has switched away from it, so a thread can release itself and then
+ * schedule.
+ */
+void release_thread(struct thread *t)
+{
+    struct thread **tp;
+    uint32_t flags;
+
+    SAVE_INTERRUPTS(flags);
+    t->state = TS_NONE;
+    if (t->proc) {
+        for (tp = &t->proc->threads; *tp != t; tp = &(*tp)->proc_next)
+            ;
+        *tp = t->proc_next;
+    }
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        thread_list = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+
+    t->next = dead_threads;
+    dead_threads = t;
+    RESTORE_INTERRUPTS(flags);
+}
+
+struct kthread_kstack {
+    uint32_t regs[8];
+    uint32_t ret_addr;
+    uint32_t unused; /* Return address of kthread_start */
+    void (*fn)(void *);
+    void *arg;
+};
+
+/* First code run by a kernel thread, returned to from switch_context() with
+ * interrupts disabled and the big kernel lock held. */
+static void kthread_start(void (*fn)(void *), void *arg)
+{
+    ENABLE_INTERRUPTS;
+    fn(arg);
+
+    DISABLE_INTERRUPTS;
+    release_thread(curthread);
+    schedule();
+}
+
+/**
+ * Create and start a kernel thread running fn(arg). It belongs to no process,
+ * runs with the big kernel lock held like any code in the kernel, and is
+ * released when fn returns.
+ */
+struct thread *kthread_create(void (*fn)(void *), void *arg)
+{
+    struct thread *t;
+    struct kthread_kstack *kstack;
+
+    t = create_thread(NULL);
+    if (!t)
+        return NULL;
+
+    t->esp -= sizeof(struct kthread_kstack);
+    kstack = (struct kthread_kstack *)t->esp;
+    kstack->ret_addr = (uint32_t)kthread_start;
+    kstack->fn = fn;
+    kstack->arg = arg;
+
+    wake_thread(t);
+    return t;
+}
+
+/* Add the CPU time of an exiting thread to its process. */
+static void account_exit(struct thread *t)
+{
+    account_time(t, false);
+    if (t->proc) {
+        t->proc->utime += t->utime;
+        t->proc->stime += t->stime;
+    }
+}
+
 void sched_stop_thread()
 {
-    if (thread->proc)
-        dec_dword(&proc->nthreads);
-    thread->state = TS_NONE;
+    account_exit(curthread);
+    if (curthread->proc) {
+        dec_dword(&curproc->nthreads);
+        wait_queue_wake(&curproc->exit_wait);
+    }
+    release_thread(curthread);
     yield_thread();
 }
 
 void sched_stop_other_threads()
 {
     static spinlock_t lock = 0;
-    struct thread *t;
+    struct thread *t, *next;
 
     spin_lock(&lock);
 
     /* In case another thread is terminating the process at the same time and
      * already stopped us while we were waiting on the lock. */
-    if (thread->signal & SIG_KILL_THREAD) {
+    if (curthread->signal & SIG_KILL_THREAD) {
         spin_unlock(&lock);
         sched_stop_thread();
     }
 
-    for (t = threads; t < threads + NTHREADS; t++) {
-        if (t->proc && t->proc == proc && t != thread) {
+    for (t = curproc->threads; t; t = t->proc_next) {
+        if (t != curthread) {
             t->signal |= 0x1;
             if (t->state == TS_INTERRUPTIBLE)
-                t->state = TS_RUNNING;
+                wake_thread(t);
         }
     }
 
     spin_unlock(&lock);
 
-    while (proc->nthreads > 1)
-        yield_thread();
+    /* Sleep rather than yield, since the others may need the big kernel lock
+     * to see that they've been stopped. */
+    DISABLE_INTERRUPTS;
+    while (curproc->nthreads > 1)
+        wait_queue_sleep(&curproc->exit_wait);
+    ENABLE_INTERRUPTS;
+
+    /* Nobody is left to join exited threads. */
+    for (t = curproc->threads; t; t = next) {
+        next = t->proc_next;
+        if (t->state == TS_ZOMBIE)
+            release_thread(t);
+    }
+}
+
+/**
+ * Exit the current thread, keeping it around for thread_join(). The process
+ * exits instead if this is its last thread.
+ */
+void sched_exit_thread(int value)
+{
+    struct thread *t = curthread;
+
+    if (t->ustack) {
+        mm_free_stack(t->ustack);
+        t->ustack = 0;
+    }
+
+    DISABLE_INTERRUPTS;
+    if (curproc->nthreads == 1) {
+        ENABLE_INTERRUPTS;
+        sched_terminate(0);
+    }
+
+    account_exit(t);
+    dec_dword(&curproc->nthreads);
+    wait_queue_wake(&curproc->exit_wait);
+    t->exit_value = value;
+    t->state = TS_ZOMBIE;
+    if (t->joiner)
+        wake_thread(t->joiner);
+    schedule();
+}
+
+/**
+ * Wait for a thread of the current process to exit and release it, returning
+ * its exit value. Only one thread may wait for a given thread.
+ */
+int sched_join_thread(unsigned int tid, int *value)
+{
+    struct thread *t;
+
+    for (t = curproc->threads; t; t = t->proc_next) {
+        if (t->tid == tid)
+            break;
+    }
+    if (!t)
+        return -ESRCH;
+    if (t == curthread || (t->joiner && t->joiner != curthread))
+        return -EINVAL;
+
+    t->joiner = curthread;
+    DISABLE_INTERRUPTS;
+    while (t->state != TS_ZOMBIE) {
+        curthread->state = TS_INTERRUPTIBLE;
+        schedule();
+        if (t->state != TS_ZOMBIE && signal_pending()) {
+            t->joiner = NULL;
+            ENABLE_INTERRUPTS;
+            return -EINTR;
+        }
+    }
+    ENABLE_INTERRUPTS;
+
+    if (value)
+        *value = t->exit_value;
+    release_thread(t);
+    return 0;
+}
+
+/**
+ * Tell the parent of a process that it exited or stopped.
+ */
+static void notify_parent(struct proc *p)
+{
+    if (!p->parent)
+        return;
+    send_proc_signal(p->parent, SIGCHLD);
+    wait_queue_wake(&p->parent->child_wait);
 }
 
 void sched_terminate(int exit_status)
 {
-    struct proc *p, *pp;
+    struct proc *p, *init;
+    uint64_t utime, stime;
+    uint32_t flags;
     int i;
 
-    printk("pid %d exiting with status 0x%x\n", proc->pid, exit_status);
-
-    if (proc->pid == 1)
+    if (curproc->pid == 1)
         panic("tried to kill init");
 
     sched_stop_other_threads();
 
-    for (p = procs; p < procs + NPROCS; p++) {
-        if (p->ppid == proc->pid && p->state != PS_NONE) {
-            p->ppid = 1;
-            if (p->state == PS_ZOMBIE)
-                send_proc_signal(get_process(1), SIGCHLD);
-        }
+    account_exit(curthread);
+    utime = curproc->utime;
+    stime = curproc->stime;
+    div64_32(&utime, 1000000);
+    div64_32(&stime, 1000000);
+    printk("pid %d exiting with status 0x%x (user %u ms, sys %u ms, "
+           "real %u ms)\n", curproc->pid, exit_status, (uint32_t)utime,
+           (uint32_t)stime, (njiffies - curproc->start_time) * 10);
+
+    /* Hand any children over to init. */
+    init = get_process(1);
+    SAVE_INTERRUPTS(flags);
+    while ((p = curproc->children)) {
+        curproc->children = p->sibling;
+        p->parent = init;
+        p->ppid = 1;
+        p->sibling = init->children;
+        init->children = p;
+        if (p->state == PS_ZOMBIE)
+            notify_parent(p);
     }
-
-    pp = get_process(p->ppid);
-    if (pp)
-        send_proc_signal(pp, SIGCHLD);
+    RESTORE_INTERRUPTS(flags);
 
     mm_free_proc_memory();
-    iput(proc->exe);
-    iput(proc->cwd);
+    iput(curproc->exe);
+    iput(curproc->cwd);
     for (i = 0; i < OPEN_MAX; i++) {
-        if (proc->files[i])
+        if (curproc->files[i])
             close(i);
     }
 
-    proc->exit_status = exit_status;
-    proc->state = PS_ZOMBIE;
-    thread->state = TS_NONE;
+    /* The parent must only be woken once there's a zombie to reap. */
+    curproc->exit_status = exit_status;
+    curproc->state = PS_ZOMBIE;
+    notify_parent(curproc);
+    release_thread(curthread);
     yield_thread();
 }
 
+static bool wait_match(struct proc *p, int pid)
+{
+    if (pid == -1)
+        return true;
+    else if (pid == 0)
+        return p->pgid == curproc->pgid;
+    else if (pid < -1)
+        return p->pgid == -pid;
+    else
+        return p->pid == pid;
+}
+
+/**
+ * Wait for a child process matching pid to exit, or to stop if WUNTRACED is
+ * given. Only the current process's own children are scanned, and the caller
+ * sleeps on its child_wait queue until one of them changes state.
+ */
 int sched_waitpid(int pid, int *wstatus, int options)
 {
     struct proc *p;
-    bool found = false;
+    bool found;
 
-    if (options & ~0x3)
+    if (options & ~(WNOHANG | WUNTRACED))
         return -EINVAL;
 
+    DISABLE_INTERRUPTS;
     for (;;) {
-        spin_lock(&sched_lock);
-        for (p = procs; p < procs + NPROCS; p++) {
-            if (p->state == PS_NONE || p->ppid != proc->pid)
+        found = false;
+        for (p = curproc->children; p; p = p->sibling) {
+            if (!wait_match(p, pid))
                 continue;
-            else if ((pid < -1 && p->pgid == -pid)
-                     || pid == -1
-                     || (pid == 0 && p->pgid == proc->pgid)
-                     || p->pid == pid)
-            {
-                found = true;
-                if (p->state == PS_ZOMBIE)
-                    goto done;
-            }
+            found = true;
+            if (p->state == PS_ZOMBIE)
+                goto reap;
+            if (p->state == PS_STOPPED && !p->stop_reported
+                    && (options & WUNTRACED))
+                goto stopped;
         }
-        spin_unlock(&sched_lock);
 
-        if (!found)
+        if (!found) {
+            ENABLE_INTERRUPTS;
             return -ECHILD;
-        else if (options & 0x1) /* WNOHANG */
+        } else if (options & WNOHANG) {
+            ENABLE_INTERRUPTS;
             return 0;
-
-        yield_thread();
-        if (signal_pending())
+        } else if (signal_pending()) {
+            ENABLE_INTERRUPTS;
             return -EINTR;
+        }
+
+        wait_queue_sleep(&curproc->child_wait);
     }
 
-done:
-    spin_unlock(&sched_lock);
+stopped:
+    p->stop_reported = true;
+    ENABLE_INTERRUPTS;
+    if (wstatus)
+        *wstatus = p->stop_signal | TERM_STOPPED;
+    return p->pid;
+
+reap:
+    ENABLE_INTERRUPTS;
     if (wstatus)
         *wstatus = p->exit_status;
+    curproc->cutime += p->utime + p->cutime;
+    curproc->cstime += p->stime + p->cstime;
     pid = p->pid;
-    p->state = PS_NONE;
+    release_proc(p);
     return pid;
 }
 
-void sched_interrupt_proc(struct proc *proc)
+/**
+ * Stop the current process as the default action of a stop signal, and sleep
+ * until it's continued. The parent is notified so waitpid() can report it.
+ */
+void sched_stop_proc(int signum)
+{
+    DISABLE_INTERRUPTS;
+    curproc->state = PS_STOPPED;
+    curproc->stop_signal = signum;
+    curproc->stop_reported = false;
+    notify_parent(curproc);
+
+    while (curproc->state == PS_STOPPED) {
+        curthread->state = TS_INTERRUPTIBLE;
+        schedule();
+    }
+    ENABLE_INTERRUPTS;
+}
+
+/**
+ * Resume a stopped process, waking any of its threads that are asleep so that
+ * the one that stopped it gets to return.
+ */
+void sched_continue_proc(struct proc *p)
+{
+    struct thread *t;
+    uint32_t flags;
+
+    SAVE_INTERRUPTS(flags);
+    p->state = PS_RUNNING;
+    for (t = p->threads; t; t = t->proc_next) {
+        if (t->state == TS_INTERRUPTIBLE)
+            wake_thread(t);
+    }
+    RESTORE_INTERRUPTS(flags);
+}
+
+void sched_interrupt_proc(struct proc *p)
 {
     /* TODO: be careful of uninterruptible threads */
     struct thread *t;
 
-    for (t = threads; t < threads + NTHREADS; t++) {
-        if (t->proc && t->proc->pid == proc->pid
-            && t->state != TS_NONE && t->state != TS_INTERRUPTIBLE)
-        {
+    for (t = p->threads; t; t = t->proc_next) {
+        if (t->state != TS_INTERRUPTIBLE && t->state != TS_ZOMBIE)
             return;
+    }
+
+    for (t = p->threads; t; t = t->proc_next) {
+        if (t->state == TS_INTERRUPTIBLE)
+            wake_thread(t);
+    }
+}
+
+/**
+ * Move a process, which must be the caller or one of its children in the same
+ * session, into a new or existing process group of that session.
+ */
+int sched_setpgid(int pid, int pgid)
+{
+    struct proc *p, *q;
+
+    if (pgid < 0)
+        return -EINVAL;
+
+    p = pid ? get_process(pid) : curproc;
+    if (!p || (p != curproc && p->parent != curproc) || p->state == PS_ZOMBIE)
+        return -ESRCH;
+    if (p->sid != curproc->sid || p->pid == p->sid)
+        return -EPERM;
+
+    if (!pgid)
+        pgid = p->pid;
+    if (pgid != p->pid) {
+        for (q = proc_list; q; q = q->next) {
+            if (q->pgid == pgid && q->sid == p->sid && q->state != PS_ZOMBIE)
+                break;
         }
+        if (!q)
+            return -EPERM;
+    }
+
+    p->pgid = pgid;
+    return 0;
+}
+
+int sched_getpgid(int pid)
+{
+    struct proc *p = pid ? get_process(pid) : curproc;
+
+    if (!p)
+        return -ESRCH;
+    return p->pgid;
+}
+
+static bool prio_match(struct proc *p, int which, int who)
+{
+    if (p->state == PS_ZOMBIE)
+        return false;
+    else if (which == PRIO_PROCESS)
+        return p->pid == who;
+    else if (which == PRIO_PGRP)
+        return p->pgid == who;
+    else
+        return p->uid == who;
+}
+
+static int prio_who(int which, int who)
+{
+    if (who != 0)
+        return who;
+    else if (which == PRIO_PROCESS)
+        return curproc->pid;
+    else if (which == PRIO_PGRP)
+        return curproc->pgid;
+    else
+        return curproc->uid;
+}
+
+/**
+ * Get the lowest nice value among the given processes. Returns 20 minus the
+ * nice value, so that it's never negative, or a negative errno.
+ */
+int sched_getpriority(int which, int who)
+{
+    struct proc *p;
+    int nice = NICE_MAX + 1;
+
+    if (which < PRIO_PROCESS || which > PRIO_USER)
+        return -EINVAL;
+    who = prio_who(which, who);
+
+    for (p = proc_list; p; p = p->next) {
+        if (prio_match(p, which, who) && p->nice < nice)
+            nice = p->nice;
     }
 
-    for (t = threads; t < threads + NTHREADS; t++) {
-        if (t->proc && t->proc->pid == proc->pid)
-            t->state = TS_RUNNING;
+    if (nice > NICE_MAX)
+        return -ESRCH;
+    return 20 - nice;
+}
+
+/**
+ * Set the nice value of the given processes, reweighting all their threads.
+ * Only root may lower a nice value or renice another user's process.
+ */
+int sched_setpriority(int which, int who, int nice)
+{
+    struct proc *p;
+    struct thread *t;
+    uint32_t flags;
+    int ret = -ESRCH;
+
+    if (which < PRIO_PROCESS || which > PRIO_USER)
+        return -EINVAL;
+    who = prio_who(which, who);
+    nice = MAX(nice, NICE_MIN);
+    nice = MIN(nice, NICE_MAX);
+
+    SAVE_INTERRUPTS(flags);
+    for (p = proc_list; p; p = p->next) {
+        if (!prio_match(p, which, who))
+            continue;
+        if (curproc->uid != 0 && curproc->uid != p->uid) {
+            ret = -EPERM;
+            continue;
+        }
+        if (curproc->uid != 0 && nice < p->nice) {
+            ret = -EACCESS;
+            continue;
+        }
+
+        p->nice = nice;
+        for (t = p->threads; t; t = t->proc_next)
+            fair_reweight(t, nice_to_weight(nice));
+        if (ret == -ESRCH)
+            ret = 0;
+    }
+    RESTORE_INTERRUPTS(flags);
+
+    return ret;
+}
+
+/**
+ * Set the scheduling policy and real-time priority of all threads in a
+ * process, moving them between run queues. Only root may choose a real-time
+ * policy.
+ */
+int sched_setscheduler(int pid, int policy, int priority)
+{
+    struct proc *p;
+    struct thread *t;
+    uint32_t flags;
+    bool queued;
+
+    if (policy == SCHED_OTHER && priority != 0)
+        return -EINVAL;
+    else if (policy == SCHED_FIFO || policy == SCHED_RR) {
+        if (priority < 1 || priority > RT_PRIO_MAX)
+            return -EINVAL;
+    } else if (policy != SCHED_OTHER)
+        return -EINVAL;
+
+    p = pid ? get_process(pid) : curproc;
+    if (!p || p->state == PS_ZOMBIE)
+        return -ESRCH;
+    if (curproc->uid != 0 && (curproc->uid != p->uid || policy != SCHED_OTHER))
+        return -EPERM;
+
+    SAVE_INTERRUPTS(flags);
+    p->policy = policy;
+    p->rt_priority = priority;
+
+    for (t = p->threads; t; t = t->proc_next) {
+        queued = t->on_rq;
+        if (queued)
+            dequeue_thread(t);
+        t->policy = policy;
+        t->rt_priority = priority;
+        if (queued) {
+            enqueue_thread(t->cpu, t, true);
+            if (should_preempt(t->cpu, t))
+                smp_reschedule(t->cpu);
+        } else if (t->cpu->thread == t) {
+            /* Let the CPU running it decide again what to run. */
+            smp_reschedule(t->cpu);
+        }
+    }
+    RESTORE_INTERRUPTS(flags);
+
+    return 0;
+}
+
+int sched_getscheduler(int pid)
+{
+    struct proc *p = pid ? get_process(pid) : curproc;
+
+    if (!p || p->state == PS_ZOMBIE)
+        return -ESRCH;
+    return p->policy;
+}
+
+/**
+ * Get the real-time priority of a process.
+ */
+int sched_getparam(int pid)
+{
+    struct proc *p = pid ? get_process(pid) : curproc;
+
+    if (!p || p->state == PS_ZOMBIE)
+        return -ESRCH;
+    return p->rt_priority;
+}
+
+/**
+ * Charge the time since a thread's last accounting stamp to its user or system
+ * time. Called on every switch between user and kernel mode, and when the
+ * thread is switched out.
+ */
+void account_time(struct thread *t, bool user)
+{
+    uint64_t now = sched_clock();
+
+    /* Threads can migrate between CPUs whose TSCs aren't quite in step. */
+    if (now > t->stamp) {
+        if (user)
+            t->utime += now - t->stamp;
+        else
+            t->stime += now - t->stamp;
+    }
+    t->stamp = now;
+}
+
+/**
+ * Get the CPU time used by a process, including its exited threads.
+ */
+void sched_proc_times(struct proc *p, uint64_t *utime, uint64_t *stime)
+{
+    struct thread *t;
+    uint32_t flags;
+
+    SAVE_INTERRUPTS(flags);
+    if (p == curproc)
+        account_time(curthread, false);
+    *utime = p->utime;
+    *stime = p->stime;
+    for (t = p->threads; t; t = t->proc_next) {
+        if (t->state != TS_ZOMBIE) {
+            *utime += t->utime;
+            *stime += t->stime;
+        }
     }
+    RESTORE_INTERRUPTS(flags);
 }
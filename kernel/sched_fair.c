@@ -0,0 +1,238 @@
+/**
+ * The SakuraOS Kernel
+ * Copyright 2025 Adam Judge
+ * File: sched_fair.c
+ */
+
+/*
+ * Fair-share scheduling class. Every thread accumulates virtual run time at a
+ * rate inversely proportional to its weight, which is derived from the nice
+ * value of its process, and each CPU keeps its runnable threads in a red-black
+ * tree ordered by it. The thread that is furthest behind runs next, for a slice
+ * of the scheduling latency proportional to its share of the queue's weight.
+ *
+ * Run time is sampled on timer ticks, so a thread is charged a whole tick for
+ * each tick it's found running.
+ */
+
+#include <kernel.h>
+#include <rbtree.h>
+#include <sched.h>
+#include <smp.h>
+
+/* Load weight for each nice value. Each step is about 10% of CPU time between
+ * two competing threads. */
+static const unsigned int nice_weights[NICE_MAX - NICE_MIN + 1] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */  9548,  7620,  6100,  4904,  3906,
+    /*  -5 */  3121,  2501,  1991,  1586,  1277,
+    /*   0 */  1024,   820,   655,   526,   423,
+    /*   5 */   335,   272,   215,   172,   137,
+    /*  10 */   110,    87,    70,    56,    45,
+    /*  15 */    36,    29,    23,    18,    15,
+};
+
+unsigned int nice_to_weight(int nice)
+{
+    if (nice < NICE_MIN)
+        nice = NICE_MIN;
+    else if (nice > NICE_MAX)
+        nice = NICE_MAX;
+    return nice_weights[nice - NICE_MIN];
+}
+
+/* Virtual run time charged to a thread for a number of ticks. */
+static unsigned int ticks_to_vruntime(struct thread *t, unsigned int ticks)
+{
+    return ticks * TICK_USEC * NICE_0_WEIGHT / t->weight;
+}
+
+static void update_min_vruntime(struct cpu *cpu)
+{
+    struct thread *curr = cpu->thread, *t;
+    struct rb_node *first = rb_first(&cpu->rq.tree);
+    uint64_t vruntime = cpu->rq.min_vruntime;
+    bool found = false;
+
+    if (curr != cpu->idle && curr->policy == SCHED_OTHER && !curr->on_rq) {
+        vruntime = curr->vruntime;
+        found = true;
+    }
+    if (first) {
+        t = rb_entry(first, struct thread, rq_node);
+        if (!found || t->vruntime < vruntime)
+            vruntime = t->vruntime;
+    }
+
+    if (vruntime > cpu->rq.min_vruntime)
+        cpu->rq.min_vruntime = vruntime;
+}
+
+/* Length of the running thread's slice in ticks. */
+static unsigned int sched_slice(struct cpu *cpu, struct thread *t)
+{
+    unsigned int nr = cpu->rq.nr_running + 1;
+    unsigned int period = SCHED_LATENCY, slice;
+
+    if (nr * SCHED_MIN_GRANULARITY > period)
+        period = nr * SCHED_MIN_GRANULARITY;
+    slice = period * t->weight / (cpu->rq.load + t->weight);
+    return MAX(slice, SCHED_MIN_GRANULARITY);
+}
+
+/* A waking thread is given credit for at most half a latency period of sleep,
+ * so it runs soon without being able to starve threads that kept running. */
+#define WAKEUP_CREDIT (SCHED_LATENCY * TICK_USEC / 2)
+
+static void place_thread(struct cpu *cpu, struct thread *t)
+{
+    uint64_t vruntime = cpu->rq.min_vruntime;
+    unsigned int credit = WAKEUP_CREDIT;
+
+    if (vruntime > credit)
+        vruntime -= credit;
+    else
+        vruntime = 0;
+
+    if (t->vruntime < vruntime)
+        t->vruntime = vruntime;
+}
+
+/**
+ * Add a runnable thread to a CPU's run queue. Threads that are waking up have
+ * their virtual run time brought up to the queue's.
+ */
+void fair_enqueue(struct cpu *cpu, struct thread *t, bool wakeup)
+{
+    struct rb_node **link = &cpu->rq.tree.node, *parent = NULL;
+    struct thread *entry;
+
+    if (wakeup)
+        place_thread(cpu, t);
+
+    /* Threads with equal run time are kept in FIFO order. */
+    while (*link) {
+        parent = *link;
+        entry = rb_entry(parent, struct thread, rq_node);
+        if (t->vruntime < entry->vruntime)
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+    rb_link_node(&t->rq_node, parent, link);
+    rb_insert_color(&cpu->rq.tree, &t->rq_node);
+
+    cpu->rq.load += t->weight;
+    cpu->rq.nr_running++;
+    t->on_rq = true;
+}
+
+void fair_dequeue(struct cpu *cpu, struct thread *t)
+{
+    rb_erase(&cpu->rq.tree, &t->rq_node);
+    cpu->rq.load -= t->weight;
+    cpu->rq.nr_running--;
+    t->on_rq = false;
+}
+
+/**
+ * Remove and return the queued thread with the least virtual run time,
+ * skipping threads of stopped processes and the one given as skip.
+ */
+struct thread *fair_pick(struct cpu *cpu, struct thread *skip)
+{
+    struct rb_node *n;
+    struct thread *t;
+
+    update_min_vruntime(cpu);
+
+    for (n = rb_first(&cpu->rq.tree); n; n = rb_next(n)) {
+        t = rb_entry(n, struct thread, rq_node);
+        if (t != skip && thread_can_run(t)) {
+            fair_dequeue(cpu, t);
+            t->slice = 0;
+            return t;
+        }
+    }
+    return NULL;
+}
+
+/* Move a dequeued thread to another CPU, keeping its lag relative to the
+ * queue it came from. The lag is negative for a thread placed behind the
+ * minimum on waking, so it's kept signed and clamped to what a thread could
+ * have gained or lost there, rather than letting the run time wrap around. */
+static void fair_migrate(struct thread *t, struct cpu *to)
+{
+    int64_t lag = (int64_t)(t->vruntime - t->cpu->rq.min_vruntime);
+    uint64_t base = to->rq.min_vruntime;
+
+    if (lag < -(int64_t)WAKEUP_CREDIT)
+        lag = -(int64_t)WAKEUP_CREDIT;
+    else if (lag > (int64_t)SCHED_LATENCY * TICK_USEC)
+        lag = (int64_t)SCHED_LATENCY * TICK_USEC;
+
+    if (lag < 0 && base < (uint64_t)-lag)
+        t->vruntime = 0;
+    else
+        t->vruntime = base + lag;
+    t->cpu = to;
+}
+
+/**
+ * Take a thread from another CPU's queue for an idle one. The thread with the
+ * most virtual run time is taken, since it would have waited longest there.
+ */
+struct thread *fair_steal(struct cpu *thief, struct cpu *victim)
+{
+    struct rb_node *n;
+    struct thread *t;
+
+    for (n = rb_last(&victim->rq.tree); n; n = rb_prev(n)) {
+        t = rb_entry(n, struct thread, rq_node);
+        if (thread_can_run(t)) {
+            fair_dequeue(victim, t);
+            fair_migrate(t, thief);
+            t->slice = 0;
+            return t;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Charge a timer tick to the normal thread running on a CPU. Returns true if
+ * it used up its slice and should be preempted.
+ */
+bool fair_tick(struct cpu *cpu)
+{
+    struct thread *curr = cpu->thread;
+
+    curr->vruntime += ticks_to_vruntime(curr, 1);
+    curr->slice++;
+    update_min_vruntime(cpu);
+
+    return cpu->rq.nr_running > 0 && curr->slice >= sched_slice(cpu, curr);
+}
+
+/**
+ * Check whether a normal thread just queued on a CPU should preempt the normal
+ * thread it's running.
+ */
+bool fair_wakeup_preempt(struct cpu *cpu, struct thread *t)
+{
+    struct thread *curr = cpu->thread;
+
+    return t->vruntime + ticks_to_vruntime(t, SCHED_WAKEUP_GRANULARITY)
+           < curr->vruntime;
+}
+
+/**
+ * Change the weight of a thread, which may be queued.
+ */
+void fair_reweight(struct thread *t, unsigned int weight)
+{
+    if (t->on_rq && t->policy == SCHED_OTHER)
+        t->cpu->rq.load = t->cpu->rq.load - t->weight + weight;
+    t->weight = weight;
+}
@@ -0,0 +1,144 @@
+/**
+ * The SakuraOS Kernel
+ * Copyright 2025 Adam Judge
+ * File: sched_rt.c
+ */
+
+/*
+ * Real-time scheduling class. SCHED_FIFO and SCHED_RR threads always run ahead
+ * of normal threads, highest priority first, from a FIFO list per priority. A
+ * FIFO thread runs until it blocks, yields or is preempted by a higher
+ * priority, and an RR thread also takes turns with its equals every
+ * SCHED_RR_TIMESLICE ticks.
+ *
+ * So that a runaway real-time thread can't lock up a CPU, real-time threads may
+ * only use SCHED_RT_RUNTIME ticks of every SCHED_RT_PERIOD. Past that the CPU
+ * is throttled, and runs real-time threads only if no normal thread is waiting.
+ */
+
+#include <kernel.h>
+#include <sched.h>
+#include <smp.h>
+
+/**
+ * Queue a real-time thread at the head of its priority, for one that was
+ * preempted and keeps the rest of its round-robin slice, or at the tail with a
+ * new slice.
+ */
+void rt_enqueue(struct cpu *cpu, struct thread *t, bool head)
+{
+    struct rt_runqueue *rq = &cpu->rt;
+    int prio = t->rt_priority;
+
+    if (head) {
+        t->rt_prev = NULL;
+        t->rt_next = rq->head[prio];
+        if (rq->head[prio])
+            rq->head[prio]->rt_prev = t;
+        else
+            rq->tail[prio] = t;
+        rq->head[prio] = t;
+    } else {
+        t->slice = 0;
+        t->rt_next = NULL;
+        t->rt_prev = rq->tail[prio];
+        if (rq->tail[prio])
+            rq->tail[prio]->rt_next = t;
+        else
+            rq->head[prio] = t;
+        rq->tail[prio] = t;
+    }
+
+    rq->bitmap[prio / 32] |= 1u << (prio % 32);
+    rq->nr_running++;
+    t->on_rq = true;
+}
+
+void rt_dequeue(struct cpu *cpu, struct thread *t)
+{
+    struct rt_runqueue *rq = &cpu->rt;
+    int prio = t->rt_priority;
+
+    if (t->rt_prev)
+        t->rt_prev->rt_next = t->rt_next;
+    else
+        rq->head[prio] = t->rt_next;
+    if (t->rt_next)
+        t->rt_next->rt_prev = t->rt_prev;
+    else
+        rq->tail[prio] = t->rt_prev;
+    t->rt_next = t->rt_prev = NULL;
+
+    if (!rq->head[prio])
+        rq->bitmap[prio / 32] &= ~(1u << (prio % 32));
+    rq->nr_running--;
+    t->on_rq = false;
+}
+
+/**
+ * Get the highest priority queued thread that is allowed to run, other than
+ * the one given as skip, without removing it.
+ */
+struct thread *rt_first(struct cpu *cpu, struct thread *skip)
+{
+    struct rt_runqueue *rq = &cpu->rt;
+    struct thread *t;
+    uint32_t bits;
+    int i, bit;
+
+    for (i = RT_BITMAP_WORDS - 1; i >= 0; i--) {
+        for (bits = rq->bitmap[i]; bits; bits &= ~(1u << bit)) {
+            bit = 31 - __builtin_clz(bits);
+            for (t = rq->head[i * 32 + bit]; t; t = t->rt_next) {
+                if (t != skip && thread_can_run(t))
+                    return t;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Remove and return the highest priority queued thread that is allowed to
+ * run, other than the one given as skip.
+ */
+struct thread *rt_pick(struct cpu *cpu, struct thread *skip)
+{
+    struct thread *t = rt_first(cpu, skip);
+
+    if (t)
+        rt_dequeue(cpu, t);
+    return t;
+}
+
+/**
+ * Charge a timer tick to the real-time thread running on a CPU. Returns true
+ * if it should be preempted, because the CPU was throttled with normal threads
+ * waiting, or its round-robin slice is up with equals waiting.
+ */
+bool rt_tick(struct cpu *cpu)
+{
+    struct thread *curr = cpu->thread;
+
+    curr->slice++;
+    if (++cpu->rt.time >= SCHED_RT_RUNTIME)
+        cpu->rt.throttled = true;
+
+    if (cpu->rt.throttled && cpu->rq.nr_running > 0)
+        return true;
+    return curr->policy == SCHED_RR && curr->slice >= SCHED_RR_TIMESLICE
+           && cpu->rt.head[curr->rt_priority];
+}
+
+/**
+ * Start a new throttling period on a CPU.
+ */
+void rt_new_period(struct cpu *cpu)
+{
+    cpu->rt.time = 0;
+    if (cpu->rt.throttled) {
+        cpu->rt.throttled = false;
+        if (cpu->rt.nr_running > 0)
+            smp_reschedule(cpu);
+    }
+}
@@ -13,17 +13,19 @@
 
 uint32_t signal_pending()
 {
-    if (thread->proc)
-        return (proc->signal | thread->signal) & ~thread->sigmask;
+    if (curthread->proc)
+        return (curproc->signal | curthread->signal) & ~curthread->sigmask;
     else
-        return thread->signal & ~thread->sigmask;
+        return curthread->signal & ~curthread->sigmask;
 }
 
 void send_proc_signal(struct proc *p, int signum)
 {
     p->signal |= (1 << signum);
-    if (p->state == PS_STOPPED && signum == SIGCONT)
-        p->state = PS_RUNNING;
+    if (p->state == PS_STOPPED && (signum == SIGCONT || signum == SIGKILL)) {
+        sched_continue_proc(p);
+        return;
+    }
 
     /* If all threads in interruptible sleep, wake one to process signal */
     sched_interrupt_proc(p);
@@ -34,27 +36,28 @@ void handle_signal(struct exception *e)
     int signum = 0;
     struct sigframe *frame;
 
-    if (thread->signal & SIG_KILL_THREAD)
+    if (curthread->signal & SIG_KILL_THREAD)
         sched_stop_thread();
 
     while ((signal_pending() & (1 << signum)) == 0)
         signum++;
 
-    thread->signal &= ~(1 << signum);
-    proc->signal &= ~(1 << signum);
+    curthread->signal &= ~(1 << signum);
+    curproc->signal &= ~(1 << signum);
 
     ENABLE_INTERRUPTS;
 
     if (signum == SIGKILL) {
         sched_terminate(SIGKILL | TERM_SIGNALED);
     } else if (signum == SIGSTOP) {
-        printk("pid %d stopped by SIGSTOP\n", proc->pid);
-        block_thread_interruptible(); // huh?
+        printk("pid %d stopped by SIGSTOP\n", curproc->pid);
+        sched_stop_proc(signum);
+        return;
     }
 
-    if (proc->sigdisp[signum] == SIG_IGN) {
+    if (curproc->sigdisp[signum] == SIG_IGN) {
         return;
-    } else if (proc->sigdisp[signum] == SIG_DFL) {
+    } else if (curproc->sigdisp[signum] == SIG_DFL) {
         switch (signum) {
         case SIGABRT:
         case SIGBUS:
@@ -85,8 +88,14 @@ void handle_signal(struct exception *e)
         case SIGTSTP:
         case SIGTTIN:
         case SIGTTOU:
-            printk("pid %d stopped by signal %d\n", proc->pid, signum);
-            block_thread_interruptible();
+            printk("pid %d stopped by signal %d\n", curproc->pid, signum);
+            sched_stop_proc(signum);
+            return;
+
+        case SIGCHLD:
+        case SIGCONT:
+        case SIGURG:
+        case SIGWINCH:
             return;
         }
     }
@@ -114,8 +123,8 @@ void handle_signal(struct exception *e)
     frame->eflags = e->eflags;
     frame->signum = signum;
 
-    e->eip = proc->sigdisp[signum];
-    proc->sigdisp[signum] = SIG_DFL;
+    e->eip = curproc->sigdisp[signum];
+    curproc->sigdisp[signum] = SIG_DFL;
 }
 
 void sys_sigreturn(struct exception *e)
@@ -0,0 +1,389 @@
+/**
+ * The SakuraOS Kernel
+ * Copyright 2025 Adam Judge
+ * File: smp.c
+ */
+
+/*
+ * Multiprocessor support. Each CPU has a private GDT, TSS, idle thread and run
+ * queue, reached through the %fs segment. Application processors are started
+ * by broadcasting INIT and startup IPIs through the local APIC, and each one
+ * claims the next free CPU number as it comes up.
+ *
+ * The rest of the kernel was written for one processor and protects its data
+ * by disabling interrupts, so kernel code is serialized by a big kernel lock.
+ * A CPU takes it when entering the kernel from user mode or the idle loop, and
+ * drops it when returning there, so only user code runs truly in parallel. The
+ * lock nesting depth is handed over with the CPU on every context switch.
+ */
+
+#include <kernel.h>
+#include <x86.h>
+#include <exception.h>
+#include <mm.h>
+#include <sched.h>
+#include <smp.h>
+
+/* Defined in x86/smpboot.s */
+extern uint8_t ap_trampoline[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t ap_gdtr[];
+extern uint32_t ap_stacks[];
+
+extern void load_idt();
+extern void sysenter_entry();
+extern void load_cpu_gdt(uint64_t *gdt, unsigned int size);
+
+struct cpu cpus[NCPUS];
+unsigned int ncpus = 1;
+
+static volatile uint32_t *lapic;
+static volatile unsigned int naps_started;
+static spinlock_t kernel_lock;
+
+static void set_segment(uint64_t *desc, uint32_t base, uint32_t limit,
+                        uint8_t access, uint8_t flags)
+{
+    *desc = (limit & 0xffff)
+            | ((uint64_t)(base & 0xffffff) << 16)
+            | ((uint64_t)access << 40)
+            | ((uint64_t)((limit >> 16) & 0xf) << 48)
+            | ((uint64_t)(flags & 0xf) << 52)
+            | ((uint64_t)(base >> 24) << 56);
+}
+
+/* Point SYSENTER at the fast system call entry in x86/idt.s. The stack it
+ * switches to is TSS.ESP0 itself, from which the entry code loads the current
+ * thread's kernel stack pointer. Early Pentium Pros report SEP without
+ * actually supporting it. */
+static void sysenter_setup(struct cpu *cpu)
+{
+    uint32_t regs[4];
+
+    read_cpuid(1, regs);
+    if (!(regs[3] & CPUID_SEP) || (regs[0] & 0xfff) < 0x633)
+        return;
+
+    write_msr(MSR_SYSENTER_CS, KERNEL_CS);
+    write_msr(MSR_SYSENTER_ESP, (uint32_t)&cpu->tss.esp0);
+    write_msr(MSR_SYSENTER_EIP, (uint32_t)sysenter_entry);
+}
+
+/* Build this CPU's GDT and TSS and switch to them. The segments are the same
+ * as the boot GDT in x86/start.s, plus the TSS and per-CPU data segments. */
+static void cpu_setup(struct cpu *cpu)
+{
+    cpu->self = cpu;
+    cpu->id = cpu - cpus;
+    cpu->tss.ss0 = KERNEL_DS;
+    cpu->tss.iomap_base = sizeof(struct tss);
+
+    set_segment(&cpu->gdt[0], 0, 0, 0, 0);
+    set_segment(&cpu->gdt[KERNEL_CS >> 3], 0, 0xfffff, 0x9b, 0xc);
+    set_segment(&cpu->gdt[KERNEL_DS >> 3], 0, 0xfffff, 0x93, 0xc);
+    set_segment(&cpu->gdt[USER_CS >> 3], 0, 0xfffff, 0xfb, 0xc);
+    set_segment(&cpu->gdt[USER_DS >> 3], 0, 0xfffff, 0xf3, 0xc);
+    set_segment(&cpu->gdt[KERNEL_TS >> 3], (uint32_t)&cpu->tss,
+                sizeof(struct tss) - 1, 0x89, 0);
+    set_segment(&cpu->gdt[KERNEL_PERCPU >> 3], (uint32_t)cpu,
+                sizeof(struct cpu) - 1, 0x93, 0x4);
+
+    load_cpu_gdt(cpu->gdt, sizeof(cpu->gdt));
+    sysenter_setup(cpu);
+}
+
+static uint32_t lapic_read(int reg)
+{
+    return lapic[reg / 4];
+}
+
+static void lapic_write(int reg, uint32_t value)
+{
+    lapic[reg / 4] = value;
+    lapic_read(LAPIC_ID); /* Wait for the write to finish */
+}
+
+static void lapic_init(struct cpu *cpu)
+{
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+
+    /* Only the bootstrap processor keeps receiving PIC interrupts, through
+     * LINT0 in virtual wire mode. */
+    if (cpu->id == 0) {
+        lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_EXTINT);
+        lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+    } else {
+        lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+        lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_MASKED);
+    }
+
+    lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_ESR, 0);
+    lapic_write(LAPIC_ESR, 0);
+    lapic_write(LAPIC_EOI, 0);
+    lapic_write(LAPIC_TPR, 0);
+
+    cpu->apic_id = lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi()
+{
+    if (lapic)
+        lapic_write(LAPIC_EOI, 0);
+}
+
+static void lapic_send(uint32_t dest, uint32_t cmd)
+{
+    uint32_t flags;
+
+    SAVE_INTERRUPTS(flags);
+    lapic_write(LAPIC_ICR_HI, dest << 24);
+    lapic_write(LAPIC_ICR_LO, cmd);
+    while (lapic_read(LAPIC_ICR_LO) & LAPIC_ICR_PENDING)
+        CPU_RELAX;
+    RESTORE_INTERRUPTS(flags);
+}
+
+void smp_send_ipi(struct cpu *cpu, uint8_t vector)
+{
+    lapic_send(cpu->apic_id, vector);
+}
+
+/**
+ * Make a CPU call schedule() on its way out of the kernel. Another CPU is sent
+ * an IPI so that it enters the kernel to do so.
+ */
+void smp_reschedule(struct cpu *cpu)
+{
+    cpu->need_resched = true;
+    if (cpu->online && cpu != this_cpu())
+        smp_send_ipi(cpu, ENO_IPI_RESCHEDULE);
+}
+
+/* Flush the TLB here and on other CPUs, either all of them or only those
+ * running the current process, and wait for them. */
+static void send_tlb_flush(bool all)
+{
+    struct cpu *cpu, *self;
+    uint32_t flags;
+
+    flush_tlb();
+    if (ncpus == 1)
+        return;
+
+    SAVE_INTERRUPTS(flags);
+    self = this_cpu();
+    for (cpu = cpus; cpu < cpus + NCPUS; cpu++) {
+        if (cpu != self && cpu->online && (all || cpu->proc == self->proc)) {
+            cpu->tlb_flush = 1;
+            smp_send_ipi(cpu, ENO_IPI_TLB_FLUSH);
+        }
+    }
+    for (cpu = cpus; cpu < cpus + NCPUS; cpu++) {
+        while (cpu->tlb_flush)
+            CPU_RELAX;
+    }
+    RESTORE_INTERRUPTS(flags);
+}
+
+/**
+ * Flush the TLB on this CPU and on every other CPU that is running a thread of
+ * the current process, waiting until they have all done so. Used after user
+ * page table entries are made more restrictive or remapped.
+ */
+void tlb_shootdown()
+{
+    send_tlb_flush(false);
+}
+
+/**
+ * Flush the TLB on every CPU, for kernel page table entries that are removed.
+ */
+void tlb_shootdown_all()
+{
+    send_tlb_flush(true);
+}
+
+/**
+ * TLB shootdown IPI handler. Called directly from x86/idt.s without taking the
+ * big kernel lock, since the CPU that sent it holds the lock while waiting.
+ */
+void handle_tlb_flush_ipi()
+{
+    struct cpu *cpu = this_cpu();
+
+    flush_tlb();
+    cpu->tlb_flush = 0;
+    lapic_eoi();
+}
+
+/**
+ * Take the big kernel lock on entry from an exception or interrupt, given the
+ * code segment of the interrupted context. Entries nested inside the kernel
+ * only increase the depth.
+ */
+void kernel_enter(uint32_t cs)
+{
+    struct cpu *cpu;
+    uint32_t flags;
+
+    SAVE_INTERRUPTS(flags);
+    cpu = this_cpu();
+    if (cpu->lock_depth++ == 0) {
+        while (!spin_trylock(&kernel_lock)) {
+            /* The lock holder may be waiting for us to flush. */
+            if (cpu->tlb_flush) {
+                flush_tlb();
+                cpu->tlb_flush = 0;
+            }
+            CPU_RELAX;
+        }
+    }
+    if (cs & 3)
+        account_time(cpu->thread, true);
+    RESTORE_INTERRUPTS(flags);
+}
+
+/**
+ * Drop the big kernel lock when returning from the outermost kernel entry or
+ * to user mode. Called with interrupts disabled, with the code segment of the
+ * context being returned to.
+ */
+void kernel_exit(uint32_t cs)
+{
+    struct cpu *cpu = this_cpu();
+
+    if (cs & 3)
+        account_time(cpu->thread, false);
+    if ((cs & 3) || --cpu->lock_depth == 0) {
+        cpu->lock_depth = 0;
+        spin_unlock(&kernel_lock);
+    }
+}
+
+/**
+ * Drop the big kernel lock and halt until there is work to do. Each CPU calls
+ * this once it's done initializing, and from then on runs as its idle thread.
+ */
+void cpu_idle()
+{
+    DISABLE_INTERRUPTS;
+    this_cpu()->lock_depth = 0;
+    spin_unlock(&kernel_lock);
+
+    for (;;) {
+        ENABLE_INTERRUPTS;
+        HALT;
+    }
+}
+
+/**
+ * Set up the bootstrap processor's per-CPU data. Called first thing in kmain,
+ * which then runs holding the big kernel lock.
+ */
+void smp_early_init()
+{
+    struct cpu *cpu = &cpus[0];
+
+    cpu_setup(cpu);
+    spin_trylock(&kernel_lock);
+    cpu->lock_depth = 1;
+}
+
+/**
+ * C entry point of each application processor, running on its idle thread's
+ * kernel stack with paging already enabled.
+ */
+void ap_main(unsigned int id)
+{
+    struct cpu *cpu = &cpus[id];
+
+    cpu_setup(cpu);
+    load_idt();
+    fpu_init();
+    lapic_init(cpu);
+    cpu->thread = cpu->idle;
+    inc_dword((uint32_t *)&naps_started);
+
+    kernel_enter(KERNEL_CS);
+    cpu->online = true;
+    ncpus++;
+    printk("smp: CPU %d online (APIC ID %d)\n", cpu->id, cpu->apic_id);
+    cpu_idle();
+}
+
+static void wait_ticks(unsigned int ticks)
+{
+    unsigned int end = jiffies() + ticks;
+
+    while (jiffies() < end)
+        HALT;
+}
+
+/**
+ * Start all application processors. Must be called after the scheduler has
+ * started, since the startup delays are timed with jiffies.
+ */
+void smp_init()
+{
+    struct thread *t;
+    uint32_t regs[4];
+    unsigned int i;
+    struct {
+        uint16_t limit;
+        uint32_t base;
+    } __attribute__((packed)) *gdtr;
+
+    read_cpuid(1, regs);
+    if ((regs[3] & CPUID_APIC) == 0) {
+        printk("smp: no local APIC, using one CPU\n");
+        return;
+    }
+
+    lapic = (uint32_t *)map_kernel_page(read_msr(MSR_APIC_BASE) & ~PAGE_MASK,
+                                        PAGE_WRITABLE | PAGE_NOCACHE);
+    if (!lapic)
+        panic("failed to map local APIC");
+    lapic_init(&cpus[0]);
+
+    /* Each AP starts out on the kernel stack of its own idle thread. */
+    for (i = 1; i < NCPUS; i++) {
+        t = create_thread(NULL);
+        if (!t)
+            panic("failed to create idle thread");
+        t->state = TS_RUNNING;
+        t->cpu = &cpus[i];
+        cpus[i].idle = t;
+        ap_stacks[i] = (uint32_t)t->kstack + PAGE_SIZE;
+    }
+
+    /* Copy the real mode trampoline into low memory and point it at the BSP's
+     * GDT, which APs use until they switch to their own. */
+    if (!map_page(AP_TRAMPOLINE, AP_TRAMPOLINE, PAGE_WRITABLE))
+        panic("failed to map AP trampoline");
+    memcpy((void *)AP_TRAMPOLINE, ap_trampoline,
+           ap_trampoline_end - ap_trampoline);
+    gdtr = (void *)(AP_TRAMPOLINE + (ap_gdtr - ap_trampoline));
+    gdtr->limit = sizeof(cpus[0].gdt) - 1;
+    gdtr->base = (uint32_t)cpus[0].gdt;
+
+    lapic_send(0, LAPIC_ICR_ALLBUTME | LAPIC_ICR_ASSERT | LAPIC_ICR_INIT);
+    wait_ticks(2);
+    for (i = 0; i < 2; i++) {
+        lapic_send(0, LAPIC_ICR_ALLBUTME | LAPIC_ICR_ASSERT | LAPIC_ICR_STARTUP
+                      | (AP_TRAMPOLINE >> 12));
+        wait_ticks(1);
+    }
+    wait_ticks(10);
+
+    /* Release the idle threads of CPUs that didn't show up, so their stacks
+     * and thread entries are freed. */
+    for (i = naps_started + 1; i < NCPUS; i++) {
+        ap_stacks[i] = 0;
+        release_thread(cpus[i].idle);
+        cpus[i].idle = NULL;
+    }
+
+    printk("smp: started %d application processors\n", naps_started);
+}
@@ -0,0 +1,124 @@
+/**
+ * The SakuraOS Kernel
+ * Copyright 2025 Adam Judge
+ * File: softirq.c
+ */
+
+/*
+ * Bottom halves. Interrupt handlers only acknowledge the device and raise a
+ * softirq, and the rest of the work is done on the way out of the outermost
+ * interrupt with interrupts enabled again. Softirqs are per-CPU and never run
+ * nested, so a handler doesn't need to be reentrant, but it must not sleep.
+ *
+ * Tasklets are the general-purpose softirq, for drivers to defer work to
+ * without a softirq number of their own.
+ */
+
+#include <kernel.h>
+#include <x86.h>
+#include <sched.h>
+#include <smp.h>
+#include <softirq.h>
+
+extern void floppy_update_timer();
+
+static void timer_softirq()
+{
+    sched_run_timers();
+    floppy_update_timer();
+}
+
+/* Run every tasklet scheduled on this CPU so far. Tasklets scheduled while
+ * this runs are picked up by the next pass of do_softirq(). */
+static void tasklet_softirq()
+{
+    struct cpu *cpu = this_cpu();
+    struct tasklet *t;
+
+    DISABLE_INTERRUPTS;
+    t = cpu->tasklet_head;
+    cpu->tasklet_head = cpu->tasklet_tail = NULL;
+    ENABLE_INTERRUPTS;
+
+    while (t) {
+        struct tasklet *next = t->next;
+
+        t->next = NULL;
+        t->scheduled = false;
+        t->func(t->data);
+        t = next;
+    }
+}
+
+static void (*const softirq_handlers[NR_SOFTIRQS])() = {
+    [SOFTIRQ_TIMER] = timer_softirq,
+    [SOFTIRQ_TASKLET] = tasklet_softirq,
+};
+
+/**
+ * Mark a softirq pending on this CPU. May be called from interrupt handlers.
+ */
+void raise_softirq(int nr)
+{
+    uint32_t flags;
+
+    SAVE_INTERRUPTS(flags);
+    this_cpu()->softirq_pending |= 1u << nr;
+    RESTORE_INTERRUPTS(flags);
+}
+
+/**
+ * Run pending softirqs on this CPU with interrupts enabled. Does nothing if
+ * softirqs are already running further up the stack.
+ */
+void do_softirq()
+{
+    struct cpu *cpu;
+    uint32_t flags, pending;
+    int restart = SOFTIRQ_RESTART, nr;
+
+    SAVE_INTERRUPTS(flags);
+    cpu = this_cpu();
+    if (cpu->in_softirq) {
+        RESTORE_INTERRUPTS(flags);
+        return;
+    }
+    cpu->in_softirq = true;
+
+    while ((pending = cpu->softirq_pending) && restart-- > 0) {
+        cpu->softirq_pending = 0;
+        ENABLE_INTERRUPTS;
+        for (nr = 0; nr < NR_SOFTIRQS; nr++) {
+            if (pending & (1u << nr))
+                softirq_handlers[nr]();
+        }
+        DISABLE_INTERRUPTS;
+    }
+
+    cpu->in_softirq = false;
+    RESTORE_INTERRUPTS(flags);
+}
+
+/**
+ * Schedule a tasklet to run on this CPU, unless it's already scheduled. May be
+ * called from interrupt handlers.
+ */
+void tasklet_schedule(struct tasklet *t)
+{
+    struct cpu *cpu;
+    uint32_t flags;
+
+    SAVE_INTERRUPTS(flags);
+    if (!t->scheduled) {
+        cpu = this_cpu();
+        t->scheduled = true;
+        t->next = NULL;
+        if (cpu->tasklet_tail)
+            cpu->tasklet_tail->next = t;
+        else
+            cpu->tasklet_head = t;
+        cpu->tasklet_tail = t;
+        cpu->softirq_pending |= 1u << SOFTIRQ_TASKLET;
+    }
+    RESTORE_INTERRUPTS(flags);
+}
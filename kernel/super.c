@@ -40,6 +40,7 @@ int mount(dev_t dev, struct inode **ip)
         return -1; // io error
     }
     memcpy(s, b->data, SB_SIZE);
+    buf_mark_meta(b);
     relbuf(b);
 
     if (s->magic != MINIX_14_MAGIC) {
@@ -11,10 +11,15 @@
 #include <sched.h>
 #include <x86.h>
 #include <signal.h>
+#include <futex.h>
+#include <syscall.h>
+#include <buffer.h>
+#include <blkdev.h>
 
-void sys_exit(struct exception *e)
+int sys_exit(struct exception *e)
 {
     sched_terminate(e->ebx & 0xff);
+    return 0;
 }
 
 int sys_waitpid(struct exception *e)
@@ -22,13 +27,26 @@ int sys_waitpid(struct exception *e)
     return sched_waitpid(e->ebx, (int *)e->ecx, e->edx);
 }
 
+int sys_setpgid(struct exception *e)
+{
+    return sched_setpgid(e->ebx, e->ecx);
+}
+
+int sys_getpgid(struct exception *e)
+{
+    return sched_getpgid(e->ebx);
+}
+
 int sys_alarm(struct exception *e)
 {
-    int ret = proc->alarm / 100;
+    int ret = 0;
+
+    if (curproc->alarm > jiffies())
+        ret = (curproc->alarm - jiffies()) / 100;
     if (!e->ebx)
         return ret;
 
-    proc->alarm = e->ebx * 100;
+    curproc->alarm = jiffies() + e->ebx * 100;
     return ret;
 }
 
@@ -36,12 +54,12 @@ static bool can_kill(struct proc *p, int signum)
 {
     if (p->pid == 1 && p->sigdisp[signum] <= SIG_IGN)
         return false;
-    else if (proc->uid == 0)
+    else if (curproc->uid == 0)
         return true;
-    else if (signum == SIGCONT && p->sid == proc->sid)
+    else if (signum == SIGCONT && p->sid == curproc->sid)
         return true;
     else
-        return p->uid == proc->uid;
+        return p->uid == curproc->uid;
 }
 
 int sys_kill(struct exception *e)
@@ -71,7 +89,7 @@ int sys_signal(struct exception *e)
     if (e->ebx == 0 || e->ebx > SIGSYS)
         return -EINVAL;
 
-    proc->sigdisp[e->ebx] = e->ecx;
+    curproc->sigdisp[e->ebx] = e->ecx;
     return 0;
 }
 
@@ -90,56 +108,129 @@ int sys_fork(struct exception *e)
     struct init_kstack *kstack;
     int i;
 
-    new_proc = create_proc();
+    new_proc = create_proc(curproc);
     if (!new_proc) {
-        printk("WARNING: fork: process table full\n");
+        printk("WARNING: fork: out of memory for process\n");
         return -EAGAIN;
     }
 
     new_thread = create_thread(new_proc);
     if (!new_thread) {
-        printk("WARNING: fork: thread table full\n");
-        new_proc->state = PS_NONE;
+        printk("WARNING: fork: out of memory for thread\n");
+        release_proc(new_proc);
         return -EAGAIN;
     }
 
     if (!mm_fork_memory(new_proc->pdir)) {
         printk("WARNING: fork: out of memory\n");
-        new_proc->state = PS_NONE;
-        new_thread->state = TS_NONE;
+        release_thread(new_thread);
+        release_proc(new_proc);
         return -ENOMEM;
     }
-    memcpy(new_proc->vmaps, proc->vmaps, sizeof(proc->vmaps));
-
-    new_proc->ppid = proc->pid;
-    new_proc->pgid = proc->pgid;
-    new_proc->sid = proc->sid;
-    new_proc->uid = proc->uid;
-    new_proc->gid = proc->gid;
-    new_proc->euid = proc->euid;
-    new_proc->egid = proc->egid;
-    new_proc->cwd = idup(proc->cwd);
-    new_proc->exe = idup(proc->exe);
-    memcpy(new_proc->sigdisp, proc->sigdisp, sizeof(proc->sigdisp));
+    memcpy(new_proc->vmaps, curproc->vmaps, sizeof(curproc->vmaps));
+
+    new_proc->nice = curproc->nice;
+    new_thread->weight = nice_to_weight(new_proc->nice);
+    new_proc->policy = new_thread->policy = curproc->policy;
+    new_proc->rt_priority = new_thread->rt_priority = curproc->rt_priority;
+    new_proc->pgid = curproc->pgid;
+    new_proc->sid = curproc->sid;
+    new_proc->uid = curproc->uid;
+    new_proc->gid = curproc->gid;
+    new_proc->euid = curproc->euid;
+    new_proc->egid = curproc->egid;
+    new_proc->cwd = idup(curproc->cwd);
+    new_proc->exe = idup(curproc->exe);
+    memcpy(new_proc->sigdisp, curproc->sigdisp, sizeof(curproc->sigdisp));
 
     for (i = 0; i < OPEN_MAX; i++) {
-        new_proc->files[i] = proc->files[i];
-        if (proc->files[i])
-            inc_dword(&proc->files[i]->count);
+        new_proc->files[i] = curproc->files[i];
+        if (curproc->files[i])
+            inc_dword(&curproc->files[i]->count);
     }
 
-    new_thread->sigmask = thread->sigmask;
+    new_thread->sigmask = curthread->sigmask;
+    fpu_copy(new_thread);
     new_thread->esp -= sizeof(struct init_kstack);
     kstack = (struct init_kstack *)new_thread->esp;
     kstack->ret_addr = (uint32_t)iret_from_exception;
     kstack->except = *e;
     kstack->except.eax = 0;
 
-    printk("fork: pid %d -> pid %d\n", proc->pid, new_proc->pid);
-    new_thread->state = TS_RUNNING;
+    printk("fork: pid %d -> pid %d\n", curproc->pid, new_proc->pid);
+    wake_thread(new_thread);
     return new_proc->pid;
 }
 
+/**
+ * Start a new thread in the current process. It begins at the start routine
+ * given in esi, with the entry point and argument pushed on its stack. If no
+ * stack is given, one is allocated, and freed again when the thread exits.
+ */
+int sys_thread_create(struct exception *e)
+{
+    uint32_t entry = e->ebx, stack = e->ecx, arg = e->edx, start = e->esi;
+    struct thread *new_thread;
+    struct init_kstack *kstack;
+    uint32_t *sp;
+
+    new_thread = create_thread(curproc);
+    if (!new_thread) {
+        printk("WARNING: thread_create: out of memory for thread\n");
+        return -EAGAIN;
+    }
+
+    if (!stack) {
+        stack = mm_alloc_stack();
+        if (!stack) {
+            release_thread(new_thread);
+            dec_dword(&curproc->nthreads);
+            return -ENOMEM;
+        }
+        new_thread->ustack = stack;
+    }
+
+    /* Faults in the stack page if it isn't present yet. */
+    sp = (uint32_t *)(stack & ~3);
+    *--sp = arg;
+    *--sp = entry;
+
+    new_thread->sigmask = curthread->sigmask;
+    new_thread->esp -= sizeof(struct init_kstack);
+    kstack = (struct init_kstack *)new_thread->esp;
+    kstack->ret_addr = (uint32_t)iret_from_exception;
+    kstack->except = *e;
+    kstack->except.eax = 0;
+    kstack->except.eip = start;
+    kstack->except.esp = (uint32_t)sp;
+
+    wake_thread(new_thread);
+    return new_thread->tid;
+}
+
+int sys_thread_exit(struct exception *e)
+{
+    sched_exit_thread(e->ebx);
+    return 0;
+}
+
+int sys_thread_join(struct exception *e)
+{
+    return sched_join_thread(e->ebx, (int *)e->ecx);
+}
+
+int sys_futex(struct exception *e)
+{
+    switch (e->ecx) {
+    case FUTEX_WAIT:
+        return futex_wait(e->ebx, e->edx);
+    case FUTEX_WAKE:
+        return futex_wake(e->ebx, e->edx);
+    default:
+        return -EINVAL;
+    }
+}
+
 int sys_open(struct exception *e)
 {
     return open((char *)e->ebx, e->ecx, e->edx);
@@ -165,53 +256,247 @@ int sys_dup(struct exception *e)
     return dup(e->ebx);
 }
 
-extern int sys_execve(struct exception *e);
+int sys_sync(struct exception *e)
+{
+    return sync();
+}
 
-void syscall(struct exception *e)
+int sys_fsync(struct exception *e)
 {
-    ENABLE_INTERRUPTS;
+    return fsync(e->ebx);
+}
 
-    switch (e->eax) {
-    case 0xffffffff:
-        sys_sigreturn(e);
-        break;
-    case 0:
-        sys_exit(e);
-    case 1:
-        e->eax = sys_fork(e);
-        break;
-    case 2:
-        e->eax = sys_execve(e);
-        break;
-    case 3:
-        e->eax = sys_waitpid(e);
-        break;
-    case 4:
-        e->eax = sys_signal(e);
-        break;
-    case 5:
-        e->eax = sys_alarm(e);
-        break;
-    case 6:
-        e->eax = sys_kill(e);
-        break;
-    case 7:
-        e->eax = sys_open(e);
-        break;
-    case 8:
-        e->eax = sys_close(e);
-        break;
-    case 9:
-        e->eax = sys_read(e);
+int sys_fdatasync(struct exception *e)
+{
+    return fdatasync(e->ebx);
+}
+
+int sys_nice(struct exception *e)
+{
+    return sched_setpriority(PRIO_PROCESS, 0, curproc->nice + (int)e->ebx);
+}
+
+int sys_getpriority(struct exception *e)
+{
+    return sched_getpriority(e->ebx, e->ecx);
+}
+
+int sys_setpriority(struct exception *e)
+{
+    return sched_setpriority(e->ebx, e->ecx, e->edx);
+}
+
+int sys_sched_setscheduler(struct exception *e)
+{
+    struct sched_param *param = (struct sched_param *)e->edx;
+
+    if (!param)
+        return -EINVAL;
+    return sched_setscheduler(e->ebx, e->ecx, param->sched_priority);
+}
+
+int sys_sched_getscheduler(struct exception *e)
+{
+    return sched_getscheduler(e->ebx);
+}
+
+int sys_sched_getparam(struct exception *e)
+{
+    struct sched_param *param = (struct sched_param *)e->ecx;
+    int ret;
+
+    if (!param)
+        return -EINVAL;
+    ret = sched_getparam(e->ebx);
+    if (ret < 0)
+        return ret;
+    param->sched_priority = ret;
+    return 0;
+}
+
+static unsigned int ns_to_ticks(uint64_t ns)
+{
+    div64_32(&ns, TICK_USEC * NSEC_PER_USEC);
+    return ns;
+}
+
+int sys_times(struct exception *e)
+{
+    struct tms *buf = (struct tms *)e->ebx;
+    uint64_t utime, stime;
+
+    if (buf) {
+        sched_proc_times(curproc, &utime, &stime);
+        buf->tms_utime = ns_to_ticks(utime);
+        buf->tms_stime = ns_to_ticks(stime);
+        buf->tms_cutime = ns_to_ticks(curproc->cutime);
+        buf->tms_cstime = ns_to_ticks(curproc->cstime);
+    }
+    return jiffies();
+}
+
+int sys_getrusage(struct exception *e)
+{
+    struct rusage *usage = (struct rusage *)e->ecx;
+    uint64_t utime, stime;
+
+    if (!usage)
+        return -EFAULT;
+
+    switch ((int)e->ebx) {
+    case RUSAGE_SELF:
+        sched_proc_times(curproc, &utime, &stime);
         break;
-    case 10:
-        e->eax = sys_write(e);
+    case RUSAGE_CHILDREN:
+        utime = curproc->cutime;
+        stime = curproc->cstime;
         break;
-    case 11:
-        e->eax = sys_dup(e);
+    case RUSAGE_THREAD:
+        account_time(curthread, false);
+        utime = curthread->utime;
+        stime = curthread->stime;
         break;
     default:
-        printk("pid %d tried invalid syscall %d\n", proc->pid, e->eax);
+        return -EINVAL;
+    }
+
+    ns_to_timeval(utime, &usage->ru_utime);
+    ns_to_timeval(stime, &usage->ru_stime);
+    return 0;
+}
+
+/* Sleep until a clock reaches the requested time, which is relative unless
+ * TIMER_ABSTIME is given. If a signal interrupts a relative sleep, the time
+ * left is stored in rem. */
+static int do_nanosleep(int clock, int flags, const struct timespec *req,
+                        struct timespec *rem)
+{
+    uint64_t ns, now, deadline;
+
+    if (!req)
+        return -EFAULT;
+    if (clock != CLOCK_REALTIME && clock != CLOCK_MONOTONIC)
+        return -EINVAL;
+    if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= NSEC_PER_SEC)
+        return -EINVAL;
+
+    ns = timespec_to_ns(req);
+    if (flags & TIMER_ABSTIME) {
+        now = clock_read(clock);
+        if (ns <= now)
+            return 0;
+        ns -= now;
+    }
+    deadline = sched_clock() + ns;
+
+    while ((now = sched_clock()) < deadline) {
+        if (signal_pending()) {
+            if (rem && !(flags & TIMER_ABSTIME))
+                ns_to_timespec(deadline - now, rem);
+            return -EINTR;
+        }
+        sleep_until(deadline);
+    }
+    return 0;
+}
+
+int sys_nanosleep(struct exception *e)
+{
+    return do_nanosleep(CLOCK_MONOTONIC, 0, (struct timespec *)e->ebx,
+                        (struct timespec *)e->ecx);
+}
+
+int sys_clock_nanosleep(struct exception *e)
+{
+    return do_nanosleep(e->ebx, e->ecx, (struct timespec *)e->edx,
+                        (struct timespec *)e->esi);
+}
+
+int sys_sched_yield(struct exception *e)
+{
+    yield_thread();
+    return 0;
+}
+
+int sys_buffer_stats(struct exception *e)
+{
+    buffer_get_stats((struct buffer_stats *)e->ebx);
+    return 0;
+}
+
+int sys_block_stats(struct exception *e)
+{
+    block_get_stats((struct block_stats *)e->ebx);
+    return 0;
+}
+
+static struct syscall_stats stats[NR_SYSCALLS];
+
+/**
+ * Copy the statistics of a system call to the caller. Returns the TSC
+ * frequency in kHz, to convert the cycle counts with, or 0 if there is no TSC.
+ */
+int sys_syscall_stats(struct exception *e)
+{
+    if (e->ebx >= NR_SYSCALLS)
+        return -EINVAL;
+
+    memcpy((void *)e->ecx, &stats[e->ebx], sizeof(struct syscall_stats));
+    return tsc_khz;
+}
+
+extern int sys_execve(struct exception *e);
+
+struct syscall {
+    int (*handler)(struct exception *e);
+    unsigned int nargs;
+};
+
+static const struct syscall sys_call_table[NR_SYSCALLS] = {
+#define SYSCALL(nr, kname, uname, nargs) [nr] = { sys_##kname, nargs },
+#include <syscalls.h>
+#undef SYSCALL
+};
+
+static void record_latency(struct syscall_stats *st, uint64_t cycles)
+{
+    int bucket = SYSCALL_HIST_BUCKETS - 1;
+
+    if (cycles >> 32 == 0)
+        bucket = 31 - __builtin_clz((uint32_t)cycles | 1);
+    st->cycles += cycles;
+    st->hist[bucket]++;
+}
+
+/**
+ * Dispatch a system call through the table, counting it and timing it with the
+ * TSC. Calls that don't return, like exit, are counted but not timed.
+ */
+void syscall(struct exception *e)
+{
+    const struct syscall *call;
+    uint64_t start = 0;
+    uint32_t nr = e->eax;
+
+    ENABLE_INTERRUPTS;
+
+    if (nr == SYS_SIGRETURN) {
+        sys_sigreturn(e);
+        return;
+    }
+    if (nr >= NR_SYSCALLS || !sys_call_table[nr].handler) {
+        printk("pid %d tried invalid syscall %d\n", curproc->pid, nr);
         e->eax = -ENOSYS;
+        return;
     }
+
+    call = &sys_call_table[nr];
+    stats[nr].count++;
+    if (tsc_khz)
+        start = read_tsc();
+
+    e->eax = call->handler(e);
+
+    if (tsc_khz)
+        record_latency(&stats[nr], read_tsc() - start);
 }
@@ -0,0 +1,406 @@
+/**
+ * The SakuraOS Kernel
+ * Copyright 2025 Adam Judge
+ * File: time.c
+ */
+
+/*
+ * Time keeping. When the CPU has a time stamp counter, it's calibrated against
+ * PIT channel 2 at boot and used as a nanosecond clock. Otherwise the clock
+ * only advances with timer ticks.
+ *
+ * With a calibrated TSC, PIT channel 0 is switched from periodic to one-shot
+ * mode and reprogrammed on every interrupt for whichever comes first, the next
+ * tick or the earliest sleep deadline, so sleeps aren't rounded up to ticks.
+ * Ticks are counted against the TSC, so reprogramming doesn't make them drift.
+ *
+ * The calibration and the tick count are also published in the vDSO page, a
+ * kernel page mapped read-only into every process so that the library can read
+ * the clocks without a system call.
+ */
+
+#include <kernel.h>
+#include <x86.h>
+#include <sched.h>
+#include <mm.h>
+#include <time.h>
+#include <vdso.h>
+
+/* Programmable interval timer registers */
+#define PIT_CH0 0x40
+#define PIT_CH2 0x42
+#define PIT_CMD 0x43
+#define PIT_PORTB 0x61
+
+/* PIT input clock frequency in Hz */
+#define PIT_HZ 1193182
+
+/* PIT commands: channel, lobyte/hibyte access and mode */
+#define PIT_CH0_PERIODIC 0x36
+#define PIT_CH0_ONESHOT 0x30
+#define PIT_CH2_ONESHOT 0xb0
+
+/* Port B bits for PIT channel 2 */
+#define PORTB_GATE2 0x01
+#define PORTB_SPEAKER 0x02
+#define PORTB_OUT2 0x20
+
+/* Shortest one-shot count to program, about 17 us, so the interrupt doesn't
+ * arrive before the reprogramming is done */
+#define PIT_MIN_COUNT 20
+
+/* Time to measure the TSC over with channel 2, at most 54 ms */
+#define TSC_CALIBRATE_MSEC 50
+
+/* Polls of channel 2 before giving up, about ten times the time expected */
+#define TSC_CALIBRATE_POLLS 500000
+
+/* Nanoseconds per cycle as a fixed point fraction with TSC_SHIFT bits */
+#define TSC_SHIFT 24
+
+/* CMOS real time clock registers */
+#define CMOS_ADDR 0x70
+#define CMOS_DATA 0x71
+#define RTC_SECONDS 0x00
+#define RTC_MINUTES 0x02
+#define RTC_HOURS 0x04
+#define RTC_DAY 0x07
+#define RTC_MONTH 0x08
+#define RTC_YEAR 0x09
+#define RTC_STATUS_A 0x0a
+#define RTC_STATUS_B 0x0b
+#define RTC_UPDATING 0x80
+#define RTC_24HOUR 0x02
+#define RTC_BINARY 0x04
+#define RTC_PM 0x80
+
+unsigned int tsc_khz;
+static uint32_t tsc_mult;
+static uint64_t tsc_base;
+static uint64_t clock_base;
+static uint32_t boot_time;
+
+/* One-shot timer state, only touched with interrupts disabled and the big
+ * kernel lock held. Deadlines are in sched_clock() time. */
+static bool oneshot;
+static uint64_t next_tick;
+static uint64_t timer_deadline;
+
+static struct vdso_data *vdso;
+
+static uint64_t cycles_to_ns(uint64_t cycles)
+{
+    uint64_t high = (cycles >> 32) * tsc_mult;
+    uint64_t low = (uint32_t)cycles * (uint64_t)tsc_mult;
+
+    return (high << (32 - TSC_SHIFT)) + (low >> TSC_SHIFT);
+}
+
+/**
+ * Start the timer in periodic mode, interrupting every tick.
+ */
+void timer_init()
+{
+    out_byte_wait(PIT_CMD, PIT_CH0_PERIODIC);
+    out_byte_wait(PIT_CH0, TIMER_DIVIDER & 0xff);
+    out_byte_wait(PIT_CH0, (TIMER_DIVIDER >> 8) & 0xff);
+}
+
+/* Program the one-shot timer for the next tick or the sleep deadline, if it's
+ * sooner. The count is rounded up so the interrupt is never early. */
+static void program_timer(uint64_t now)
+{
+    uint64_t event = next_tick, count = 0;
+
+    if (timer_deadline && timer_deadline < event)
+        event = timer_deadline;
+    if (event > now) {
+        count = (event - now) * PIT_HZ + NSEC_PER_SEC - 1;
+        div64_32(&count, NSEC_PER_SEC);
+    }
+    if (count < PIT_MIN_COUNT)
+        count = PIT_MIN_COUNT;
+    else if (count > 0xffff)
+        count = 0xffff;
+
+    out_byte(PIT_CMD, PIT_CH0_ONESHOT);
+    out_byte(PIT_CH0, count & 0xff);
+    out_byte(PIT_CH0, (count >> 8) & 0xff);
+}
+
+/* Count TSC cycles while PIT channel 2 counts down a known interval, with the
+ * speaker disconnected. Returns the TSC frequency in kHz, or 0 on failure. */
+static unsigned int pit_calibrate_tsc()
+{
+    uint64_t start, cycles;
+    uint32_t flags;
+    unsigned int polls = 0;
+    uint8_t portb;
+    uint16_t count = PIT_HZ * TSC_CALIBRATE_MSEC / 1000;
+
+    SAVE_INTERRUPTS(flags);
+
+    portb = in_byte(PIT_PORTB);
+    out_byte(PIT_PORTB, (portb & ~PORTB_SPEAKER) | PORTB_GATE2);
+    out_byte(PIT_CMD, PIT_CH2_ONESHOT);
+    out_byte(PIT_CH2, count & 0xff);
+    out_byte(PIT_CH2, count >> 8);
+
+    start = read_tsc();
+    while (!(in_byte(PIT_PORTB) & PORTB_OUT2) && polls < TSC_CALIBRATE_POLLS)
+        polls++;
+    cycles = read_tsc() - start;
+
+    out_byte(PIT_PORTB, portb);
+    RESTORE_INTERRUPTS(flags);
+
+    if (polls == TSC_CALIBRATE_POLLS)
+        return 0;
+    div64_32(&cycles, TSC_CALIBRATE_MSEC);
+    return cycles;
+}
+
+/**
+ * Calibrate the TSC and switch the clock and the timer over to it. Must be
+ * called after timer_init().
+ */
+void tsc_init()
+{
+    uint32_t regs[4], flags;
+    uint64_t n;
+
+    read_cpuid(1, regs);
+    if ((regs[3] & CPUID_TSC) == 0) {
+        printk("time: no TSC, using timer ticks\n");
+        return;
+    }
+
+    tsc_khz = pit_calibrate_tsc();
+    if (tsc_khz == 0 && g_cpuid_base_freq) {
+        printk("time: PIT calibration failed, using CPUID frequency\n");
+        tsc_khz = g_cpuid_base_freq * 1000;
+    }
+    if (tsc_khz == 0) {
+        printk("time: TSC not counting, using timer ticks\n");
+        return;
+    }
+
+    n = (uint64_t)1000000 << TSC_SHIFT;
+    div64_32(&n, tsc_khz);
+
+    /* Carry on from the tick-based clock without jumping back, and keep the
+     * ticks on the same boundaries in one-shot mode. */
+    SAVE_INTERRUPTS(flags);
+    tsc_base = read_tsc();
+    clock_base = (uint64_t)jiffies() * TICK_NSEC;
+    tsc_mult = n;
+    next_tick = clock_base + TICK_NSEC;
+    oneshot = true;
+    program_timer(clock_base);
+    RESTORE_INTERRUPTS(flags);
+
+    if (g_cpuid_base_freq)
+        printk("time: TSC running at %u kHz (CPUID base %u MHz)\n", tsc_khz,
+               g_cpuid_base_freq);
+    else
+        printk("time: TSC running at %u kHz\n", tsc_khz);
+}
+
+/**
+ * Handle a timer interrupt, reprogramming the timer in one-shot mode. Returns
+ * the number of ticks that have passed, which is 0 when the interrupt was only
+ * for a sleep deadline.
+ */
+unsigned int timer_interrupt()
+{
+    unsigned int ticks = 0;
+    uint64_t now;
+
+    if (!oneshot)
+        return 1;
+
+    now = sched_clock();
+    while (next_tick <= now) {
+        next_tick += TICK_NSEC;
+        ticks++;
+    }
+    if (timer_deadline && timer_deadline <= now)
+        timer_deadline = 0;
+    program_timer(now);
+    return ticks;
+}
+
+/**
+ * Make sure there's a timer interrupt at a sched_clock() time, for waking a
+ * sleeping thread. Without one-shot mode, the next tick after it will do.
+ */
+void timer_arm(uint64_t deadline)
+{
+    uint32_t flags;
+
+    if (!oneshot)
+        return;
+
+    SAVE_INTERRUPTS(flags);
+    if (!timer_deadline || deadline < timer_deadline) {
+        timer_deadline = deadline;
+        if (deadline < next_tick)
+            program_timer(sched_clock());
+    }
+    RESTORE_INTERRUPTS(flags);
+}
+
+/**
+ * Get the monotonic time since boot in nanoseconds. Also used for measuring CPU
+ * usage.
+ */
+uint64_t sched_clock()
+{
+    if (!tsc_mult)
+        return (uint64_t)jiffies() * TICK_NSEC;
+    return clock_base + cycles_to_ns(read_tsc() - tsc_base);
+}
+
+/**
+ * Read a clock in nanoseconds. The real time clock counts from the epoch,
+ * stepping from the RTC time read at boot.
+ */
+uint64_t clock_read(int clock)
+{
+    uint64_t ns = sched_clock();
+
+    if (clock == CLOCK_REALTIME)
+        ns += (uint64_t)boot_time * NSEC_PER_SEC;
+    return ns;
+}
+
+void ns_to_timeval(uint64_t ns, struct timeval *tv)
+{
+    div64_32(&ns, NSEC_PER_USEC);
+    tv->tv_usec = div64_32(&ns, USEC_PER_SEC);
+    tv->tv_sec = ns;
+}
+
+void ns_to_timespec(uint64_t ns, struct timespec *ts)
+{
+    ts->tv_nsec = div64_32(&ns, NSEC_PER_SEC);
+    ts->tv_sec = ns;
+}
+
+uint64_t timespec_to_ns(const struct timespec *ts)
+{
+    return (uint64_t)ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static uint8_t cmos_read(uint8_t reg)
+{
+    out_byte(CMOS_ADDR, reg);
+    return in_byte(CMOS_DATA);
+}
+
+static unsigned int bcd_to_bin(unsigned int val)
+{
+    return (val >> 4) * 10 + (val & 0xf);
+}
+
+/**
+ * Read the wall clock time from the RTC as seconds since the epoch. The RTC is
+ * assumed to be set to UTC, in the 21st century.
+ */
+static uint32_t rtc_read()
+{
+    unsigned int sec, min, hour, day, mon, year, days;
+    uint8_t status;
+    bool pm;
+
+    while (cmos_read(RTC_STATUS_A) & RTC_UPDATING)
+        CPU_RELAX;
+
+    sec = cmos_read(RTC_SECONDS);
+    min = cmos_read(RTC_MINUTES);
+    hour = cmos_read(RTC_HOURS);
+    day = cmos_read(RTC_DAY);
+    mon = cmos_read(RTC_MONTH);
+    year = cmos_read(RTC_YEAR);
+    status = cmos_read(RTC_STATUS_B);
+
+    pm = hour & RTC_PM;
+    hour &= ~RTC_PM;
+    if (!(status & RTC_BINARY)) {
+        sec = bcd_to_bin(sec);
+        min = bcd_to_bin(min);
+        hour = bcd_to_bin(hour);
+        day = bcd_to_bin(day);
+        mon = bcd_to_bin(mon);
+        year = bcd_to_bin(year);
+    }
+    if (!(status & RTC_24HOUR)) {
+        hour %= 12;
+        if (pm)
+            hour += 12;
+    }
+    year += 2000;
+
+    /* Count days from 1 March of year 0, so the leap day is last in the year,
+     * then shift to the epoch. */
+    if (mon <= 2) {
+        year--;
+        mon += 12;
+    }
+    days = 365 * year + year / 4 - year / 100 + year / 400
+           + (153 * (mon - 3) + 2) / 5 + day - 719469;
+
+    return days * 86400 + hour * 3600 + min * 60 + sec;
+}
+
+/**
+ * Read the boot time from the RTC, then allocate the vDSO page and publish the
+ * TSC calibration and the boot time in it. Must be called after tsc_init().
+ */
+void vdso_init()
+{
+    struct vdso_data *vd;
+
+    vd = (struct vdso_data *)alloc_kernel_page(PAGE_WRITABLE);
+    if (!vd)
+        panic("vdso_init: out of memory");
+    memset(vd, 0, PAGE_SIZE);
+
+    boot_time = rtc_read() - jiffies() / (USEC_PER_SEC / TICK_USEC);
+
+    vd->jiffies = jiffies();
+    vd->tick_nsec = TICK_NSEC;
+    vd->boot_time = boot_time;
+    if (tsc_mult) {
+        vd->tsc_mult = tsc_mult;
+        vd->tsc_shift = TSC_SHIFT;
+        vd->tsc_base = tsc_base;
+        vd->clock_base = clock_base;
+    }
+    vdso = vd;
+}
+
+/**
+ * Publish a new tick count to user space. Called from the timer interrupt.
+ */
+void vdso_update(unsigned int jiffies)
+{
+    if (!vdso)
+        return;
+
+    vdso->seq++;
+    BARRIER;
+    vdso->jiffies = jiffies;
+    BARRIER;
+    vdso->seq++;
+}
+
+/**
+ * Map the vDSO page read-only into the current process.
+ */
+bool vdso_map()
+{
+    if (!vdso)
+        return false;
+    return mm_share_kernel_page(VDSO_BASE, (uint32_t)vdso);
+}
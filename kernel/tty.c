@@ -8,6 +8,7 @@
 #include <sched.h>
 #include <signal.h>
 #include <x86.h>
+#include <workqueue.h>
 
 #define NUM_TTYS 3
 
@@ -19,14 +20,38 @@ struct tty {
     unsigned int tail;
     char buffer[256];
     unsigned int avail;
+    unsigned int echo_head;
+    unsigned int echo_tail;
+    char echo[64];
 };
 
 struct tty ttys[NUM_TTYS];
 
+/* Echo input to the console from a worker thread, since console output takes
+ * a lock and may scroll the whole screen. */
+static void echo_input(void *data)
+{
+    struct tty *tty = &ttys[0];
+    uint32_t flags;
+    char c;
+
+    SAVE_INTERRUPTS(flags);
+    while (tty->echo_tail != tty->echo_head) {
+        c = tty->echo[tty->echo_tail];
+        tty->echo_tail = (tty->echo_tail + 1) % sizeof(tty->echo);
+        RESTORE_INTERRUPTS(flags);
+        console_putc(c);
+        SAVE_INTERRUPTS(flags);
+    }
+    RESTORE_INTERRUPTS(flags);
+}
+
+static struct work echo_work = WORK_INIT(echo_input, NULL);
+
 /*
- * Runs in interrupt context when a character is received.
+ * Runs in softirq context when a character is received.
  */
-extern void tty_handle_input(uint8_t minor, char c)
+void tty_handle_input(uint8_t minor, char c)
 {
     struct tty *tty = &ttys[minor];
 
@@ -38,12 +63,16 @@ extern void tty_handle_input(uint8_t minor, char c)
     } else
         return;
 
-    if (minor == 0)
-        console_putc(c);
+    if (minor == 0
+        && (tty->echo_head + 1) % sizeof(tty->echo) != tty->echo_tail) {
+        tty->echo[tty->echo_head] = c;
+        tty->echo_head = (tty->echo_head + 1) % sizeof(tty->echo);
+        schedule_work(&echo_work);
+    }
     if (c == '\n') {
         tty->avail++;
         if (tty->waiting)
-            tty->waiting->state = TS_RUNNING;
+            wake_thread(tty->waiting);
     }
 }
 
@@ -58,7 +87,7 @@ int tty_read(uint8_t minor, char *buf, unsigned int length)
 
     spin_lock(&tty->lock);
     if (tty->avail == 0) {
-        tty->waiting = thread;
+        tty->waiting = curthread;
         block_thread_interruptible();
         tty->waiting = NULL;
         if (signal_pending()) {
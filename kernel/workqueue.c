@@ -0,0 +1,94 @@
+/**
+ * The SakuraOS Kernel
+ * Copyright 2025 Adam Judge
+ * File: workqueue.c
+ */
+
+/*
+ * Work queues. Each queue has a kernel thread that runs its work items in the
+ * order they were queued, so unlike softirqs and tasklets, work runs in thread
+ * context and may sleep or take locks. Interrupt handlers and softirqs can
+ * queue work for anything too slow to do with the interrupted thread stalled.
+ */
+
+#include <kernel.h>
+#include <x86.h>
+#include <sched.h>
+#include <smp.h>
+#include <workqueue.h>
+
+static struct workqueue system_wq;
+
+static void worker_thread(void *arg)
+{
+    struct workqueue *wq = arg;
+    struct work *w;
+
+    for (;;) {
+        DISABLE_INTERRUPTS;
+        while (!wq->head) {
+            curthread->state = TS_INTERRUPTIBLE;
+            schedule();
+        }
+        w = wq->head;
+        wq->head = w->next;
+        if (!wq->head)
+            wq->tail = NULL;
+        w->next = NULL;
+        w->pending = false;
+        ENABLE_INTERRUPTS;
+
+        w->func(w->data);
+    }
+}
+
+/**
+ * Set up a work queue and start its worker thread.
+ */
+void workqueue_init(struct workqueue *wq)
+{
+    wq->head = wq->tail = NULL;
+    wq->worker = kthread_create(worker_thread, wq);
+    if (!wq->worker)
+        panic("failed to create worker thread");
+}
+
+/**
+ * Add work to a queue, unless it's already pending. Returns whether it was
+ * added. May be called from interrupt handlers.
+ */
+bool queue_work(struct workqueue *wq, struct work *w)
+{
+    uint32_t flags;
+
+    SAVE_INTERRUPTS(flags);
+    if (w->pending) {
+        RESTORE_INTERRUPTS(flags);
+        return false;
+    }
+
+    w->pending = true;
+    w->next = NULL;
+    if (wq->tail)
+        wq->tail->next = w;
+    else
+        wq->head = w;
+    wq->tail = w;
+
+    wake_thread(wq->worker);
+    RESTORE_INTERRUPTS(flags);
+    return true;
+}
+
+/**
+ * Add work to the system work queue, shared by the whole kernel.
+ */
+bool schedule_work(struct work *w)
+{
+    return queue_work(&system_wq, w);
+}
+
+void workqueues_init()
+{
+    workqueue_init(&system_wq);
+}
@@ -5,10 +5,21 @@
 
 extern schedule
 extern init_pdir
-extern thread
-extern next_thread
-extern proc
-extern tss_esp0
+
+%define KERNEL_TS     0x28
+%define KERNEL_PERCPU 0x30
+
+; Offsets into struct cpu (smp.h) and struct thread (sched.h).
+%define CPU_THREAD      4
+%define CPU_PROC        8
+%define CPU_NEXT_THREAD 12
+%define CPU_LOCK_DEPTH  16
+%define CPU_TSS_ESP0    36
+%define THREAD_ESP      0
+%define THREAD_ESP0     4
+%define THREAD_PROC     8
+%define THREAD_DEPTH    12
+%define PROC_CR3        4
 
 ; void inc_byte(uint8_t *val)
 ; Atomically increment a byte in memory.
@@ -147,6 +158,108 @@ spin_lock:
 .done:
     ret
 
+; bool spin_trylock(spinlock_t *spinlock)
+; Try once to lock a simple spinlock without yielding. Returns whether the lock
+; was taken.
+global spin_trylock
+spin_trylock:
+    mov edx, [esp+4]
+    mov eax, 1
+    xchg eax, [edx]
+    xor eax, 1
+    ret
+
+; void read_cpuid(uint32_t leaf, uint32_t *regs)
+; Execute CPUID and store EAX, EBX, ECX and EDX into regs.
+global read_cpuid
+read_cpuid:
+    push ebx
+    push edi
+    mov eax, [esp+12]
+    mov edi, [esp+16]
+    xor ecx, ecx
+    cpuid
+    mov [edi], eax
+    mov [edi+4], ebx
+    mov [edi+8], ecx
+    mov [edi+12], edx
+    pop edi
+    pop ebx
+    ret
+
+; uint64_t read_msr(uint32_t msr)
+; Read a model-specific register.
+global read_msr
+read_msr:
+    mov ecx, [esp+4]
+    rdmsr
+    ret
+
+; uint64_t read_tsc()
+; Read the time stamp counter.
+global read_tsc
+read_tsc:
+    rdtsc
+    ret
+
+; void write_msr(uint32_t msr, uint64_t value)
+; Write a model-specific register.
+global write_msr
+write_msr:
+    mov ecx, [esp+4]
+    mov eax, [esp+8]
+    mov edx, [esp+12]
+    wrmsr
+    ret
+
+; uint32_t read_cr0()
+; Read control register 0.
+global read_cr0
+read_cr0:
+    mov eax, cr0
+    ret
+
+; void write_cr0(uint32_t value)
+; Write control register 0.
+global write_cr0
+write_cr0:
+    mov eax, [esp+4]
+    mov cr0, eax
+    ret
+
+; uint32_t read_cr4()
+; Read control register 4.
+global read_cr4
+read_cr4:
+    mov eax, cr4
+    ret
+
+; void write_cr4(uint32_t value)
+; Write control register 4.
+global write_cr4
+write_cr4:
+    mov eax, [esp+4]
+    mov cr4, eax
+    ret
+
+; void load_cpu_gdt(uint64_t *gdt, unsigned int size)
+; Load a processor's private GDT, then its task register and per-CPU segment.
+global load_cpu_gdt
+load_cpu_gdt:
+    mov eax, [esp+4]
+    mov ecx, [esp+8]
+    dec ecx
+    sub esp, 8
+    mov [esp], cx
+    mov [esp+2], eax
+    lgdt [esp]
+    add esp, 8
+    mov ax, KERNEL_TS
+    ltr ax
+    mov ax, KERNEL_PERCPU
+    mov fs, ax
+    ret
+
 ; void enable_paging()
 global enable_paging
 enable_paging:
@@ -165,36 +278,43 @@ flush_tlb:
     ret
 
 ; void switch_context()
+; Switch this CPU from its current thread to its next_thread.
 global switch_context
 switch_context:
     pusha
-    mov edi, [thread]
-    mov esi, [next_thread]
+    mov edi, [fs:CPU_THREAD]
+    mov esi, [fs:CPU_NEXT_THREAD]
 
     ; Stash current ESP and load next thread's ESP.
-    mov [edi], esp
-    mov esp, [esi]
+    mov [edi+THREAD_ESP], esp
+    mov esp, [esi+THREAD_ESP]
 
     ; Set TSS.ESP0 to next thread's kernel stack.
-    mov eax, [esi+4]
-    mov [tss_esp0], eax
+    mov eax, [esi+THREAD_ESP0]
+    mov [fs:CPU_TSS_ESP0], eax
+
+    ; Hand over the big kernel lock nesting depth.
+    mov eax, [fs:CPU_LOCK_DEPTH]
+    mov [edi+THREAD_DEPTH], eax
+    mov eax, [esi+THREAD_DEPTH]
+    mov [fs:CPU_LOCK_DEPTH], eax
 
     ; Set the new current process.
-    mov eax, [esi+8]
-    mov [proc], eax
+    mov eax, [esi+THREAD_PROC]
+    mov [fs:CPU_PROC], eax
 
     ; If the new current process is not null and is different from the one being
     ; switched from, load its page directory.
     cmp eax, 0
     je .no_cr3
-    cmp eax, [edi+8]
+    cmp eax, [edi+THREAD_PROC]
     je .no_cr3
-    mov eax, [eax+4]
+    mov eax, [eax+PROC_CR3]
     mov cr3, eax
 
     ; Make next the new current and return to it.
 .no_cr3:
-    mov [thread], esi
+    mov [fs:CPU_THREAD], esi
     popa
     ret
 
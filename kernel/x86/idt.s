@@ -4,9 +4,18 @@
 ; ==============================================================================
 
 extern handle_exception
+extern handle_sysenter
+extern handle_tlb_flush_ipi
+extern kernel_enter
+extern kernel_exit
 
 %define KERNEL_CS     0x0008
 %define KERNEL_DS     0x0010
+%define KERNEL_PERCPU 0x0030
+%define USER_CS       0x001B
+%define USER_DS       0x0023
+
+%define IPI_TLB_FLUSH 0xF1
 
 %define GATE_INT32    0x0E
 %define GATE_TRAP32   0x0F
@@ -95,6 +104,7 @@ setup_idt:
     trapgate  13, general_protection
     trapgate  14, page_fault
     trapgate  16, coprocessor_error
+    trapgate  19, simd_exception
     intgate   32, irq0
     intgate   33, irq1
     intgate   34, irq2
@@ -111,6 +121,8 @@ setup_idt:
     intgate   45, irq13
     intgate   46, irq14
     intgate   47, irq15
+    intgate  240, ipi_reschedule
+    intgate  241, ipi_tlb_flush
     trapgate 255, system_call
 
     ; Reprogram the PICs to remap external interrupts to vectors starting at 32.
@@ -141,7 +153,12 @@ setup_idt:
     out PIC1_DATA, al
     call pic_wait
 
-    ; Load the IDT for use by the processor.
+    ; Fall through to load the IDT.
+
+; void load_idt()
+; Load the IDT for use by the processor. Also called by each AP.
+global load_idt
+load_idt:
     lidt [idt_desc]
     ret
 
@@ -176,8 +193,9 @@ common_handler:
     mov ax, KERNEL_DS
     mov ds, ax
     mov es, ax
-    mov fs, ax
     mov gs, ax
+    mov ax, KERNEL_PERCPU
+    mov fs, ax
 
     ; Send end-of-interrupt command to the PIC(s) if needed.
     mov bl, [esp+60]
@@ -194,8 +212,19 @@ common_handler:
 .no_pic1:
     out PIC0_CMD, al
 
-    ; Call C exception handling code.
 .skip_eoi:
+    ; TLB shootdowns are serviced without the big kernel lock, since the CPU
+    ; that requested one holds it while waiting for us.
+    cmp bl, IPI_TLB_FLUSH
+    jne .locked
+    call handle_tlb_flush_ipi
+    jmp restore_context
+
+    ; Call C exception handling code.
+.locked:
+    push dword [esp+72] ; CS of the interrupted context
+    call kernel_enter
+    add esp, 4
     call handle_exception
     cli
 
@@ -204,6 +233,10 @@ common_handler:
 ; start running userland code.
 global iret_from_exception
 iret_from_exception:
+    push dword [esp+72] ; CS of the context being returned to
+    call kernel_exit
+    add esp, 4
+restore_context:
     add esp, 12 ; Discard CRs from stack.
     popa
     pop ds
@@ -213,6 +246,68 @@ iret_from_exception:
     add esp, 8 ; Discard eno and err from stack.
     iret
 
+; ==============================================================================
+; Fast System Call Entry
+; ==============================================================================
+
+; SYSENTER lands here with interrupts disabled and ESP pointing at TSS.ESP0 of
+; this CPU. The user's EBP points at its return address, followed by its saved
+; EBP, EDX and ECX. Only the frame is built here, and handle_sysenter() reads
+; the rest from the user stack once it's safe to fault.
+global sysenter_entry
+sysenter_entry:
+    mov esp, [esp]
+    push USER_DS        ; SS
+    push ebp            ; ESP, adjusted by handle_sysenter()
+    pushf
+    push USER_CS
+    push 0              ; EIP, filled in by handle_sysenter()
+    push 0              ; Error code
+    push 255            ; Exception number
+    push gs
+    push fs
+    push es
+    push ds
+    pusha
+    sub esp, 12         ; CRs aren't needed here.
+
+    mov ax, KERNEL_DS
+    mov ds, ax
+    mov es, ax
+    mov gs, ax
+    mov ax, KERNEL_PERCPU
+    mov fs, ax
+
+    push USER_CS
+    call kernel_enter
+    add esp, 4
+    push esp
+    call handle_sysenter
+    add esp, 4
+    test eax, eax
+    jz iret_from_exception
+
+    ; Return with SYSEXIT, which takes the return address in EDX and the stack
+    ; pointer in ECX. The library restores the caller's EDX and ECX itself.
+    push USER_CS
+    call kernel_exit
+    add esp, 4
+    add esp, 12
+    popa
+    pop ds
+    pop es
+    pop fs
+    pop gs
+    add esp, 8          ; Discard eno and err.
+    pop edx             ; EIP
+    add esp, 4          ; CS
+    and dword [esp], ~0x200
+    popf                ; EFLAGS, with interrupts still disabled
+    pop ecx             ; ESP
+    add esp, 4          ; SS
+    sti                 ; Takes effect after SYSEXIT.
+    sysexit
+
 ; Exception and interrupt handler stubs.
 ignore:                 iret
 division_error:         exception 0
@@ -231,6 +326,7 @@ stack_fault:            exception_with_ecode 12
 general_protection:     exception_with_ecode 13
 page_fault:             exception_with_ecode 14
 coprocessor_error:      exception 16
+simd_exception:         exception 19
 irq0:                   exception 32
 irq1:                   exception 33
 irq2:                   exception 34
@@ -247,4 +343,6 @@ irq12:                  exception 44
 irq13:                  exception 45
 irq14:                  exception 46
 irq15:                  exception 47
+ipi_reschedule:         exception 240
+ipi_tlb_flush:          exception 241
 system_call:            exception 255
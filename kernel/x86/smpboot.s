@@ -0,0 +1,96 @@
+; ==============================================================================
+; The SakuraOS Kernel
+; Copyright 2025 Adam Judge
+; ==============================================================================
+
+extern init_pdir
+extern ap_main
+
+%define KERNEL_CS 0x08
+%define KERNEL_DS 0x10
+
+; Must match smp.h
+%define NCPUS 8
+
+section .text
+
+; ==============================================================================
+; Application processor startup
+; ==============================================================================
+
+bits 16
+
+; Real mode trampoline, copied by smp_init() to AP_TRAMPOLINE in low memory,
+; where each AP starts executing after the startup IPI with CS pointing at it.
+; Only offsets relative to ap_trampoline can be used until protected mode.
+global ap_trampoline
+ap_trampoline:
+    cli
+    mov ax, cs
+    mov ds, ax
+    o32 lgdt [ap_gdtr - ap_trampoline]
+    mov eax, cr0
+    or al, 1
+    mov cr0, eax
+    jmp dword KERNEL_CS:ap_entry
+
+; GDT descriptor filled in by smp_init() before the APs are started.
+align 4
+global ap_gdtr
+ap_gdtr:
+    dw 0
+    dd 0
+
+global ap_trampoline_end
+ap_trampoline_end:
+
+bits 32
+
+; Start of 32-bit protected mode code for APs.
+ap_entry:
+    mov ax, KERNEL_DS
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    mov fs, ax
+    mov gs, ax
+
+    ; Turn on paging using the kernel's initial page directory.
+    mov eax, init_pdir
+    mov cr3, eax
+    mov eax, cr0
+    or eax, 0x80010000
+    mov cr0, eax
+
+    ; Claim the next CPU number, then switch to the stack of the idle thread
+    ; prepared for it. Extra CPUs are parked.
+    mov eax, 1
+    lock xadd [ap_next_cpu], eax
+    cmp eax, NCPUS
+    jae .park
+    mov esp, [ap_stacks + 4*eax]
+    test esp, esp
+    jz .park
+
+    push eax
+    call ap_main
+
+.park:
+    cli
+    hlt
+    jmp .park
+
+section .data
+align 4
+
+; Next CPU number to be claimed by an AP (the BSP is 0)
+ap_next_cpu:
+    dd 1
+
+section .bss
+alignb 4
+
+; Initial stack pointer of each AP, set by smp_init()
+global ap_stacks
+ap_stacks:
+    resd NCPUS
@@ -8,10 +8,12 @@ extern _kernel_end
 extern detect_memory
 extern setup_idt
 extern kmain
+extern cpu_idle
+extern cpus
 
-%define KERNEL_CS 0x08
-%define KERNEL_DS 0x10
-%define KERNEL_TS 0x28
+%define KERNEL_CS     0x08
+%define KERNEL_DS     0x10
+%define KERNEL_PERCPU 0x30
 
 section .rodata
 
@@ -134,14 +136,13 @@ enter_protected_mode:
     mov fs, ax
     mov gs, ax
 
-    ; Set TSS segment base pointer manually.
-    mov eax, tss
-    or [gdt + KERNEL_TS + 2], eax
-
-    ; Set TSS.SS0 manually since it's in BSS, and load the TSS.
-    mov word [tss_ss0], KERNEL_DS
-    mov ax, KERNEL_TS
-    ltr ax
+    ; Point the per-CPU segment at the BSP's struct cpu, whose first field is
+    ; its own address. smp_early_init() later moves to a private GDT and TSS.
+    mov eax, cpus
+    or [gdt + KERNEL_PERCPU + 2], eax
+    mov [cpus], eax
+    mov ax, KERNEL_PERCPU
+    mov fs, ax
 
     ; Get CPUID processor info.
     xor eax, eax
@@ -180,9 +181,7 @@ enter_protected_mode:
     call kmain
 
     ; After initialization, this thread becomes the idle thread.
-.idle:
-    hlt
-    jmp .idle
+    call cpu_idle
 
 ; ==============================================================================
 ; Processor Data Structures
@@ -198,7 +197,8 @@ gdt:
     dq 0x00CF_9300_0000_FFFF  ; Kernel data
     dq 0x00CF_FB00_0000_FFFF  ; User code
     dq 0x00CF_F300_0000_FFFF  ; User data
-    dq 0x0000_8900_0000_0068  ; Task state segment
+    dq 0x0000_0000_0000_0000  ; Task state segment (per-CPU GDT only)
+    dq 0x0040_9300_0000_FFFF  ; Per-CPU data
 
 ; GDT Descriptor
 gdt_desc:
@@ -211,16 +211,6 @@ alignb 4
 ; Initial kernel stack used during startup
 init_stack: resb 1024
 
-; Task State Segment
-tss:
-    resd 1    ; Not needed
-global tss_esp0
-tss_esp0:
-    resd 1    ; ESP on switch to ring 0, set when task switching
-tss_ss0:
-    resd 1    ; SS on switch to ring 0
-    resb 192  ; Other fields we don't care about
-
 ; CPUID data
 global g_cpuid_vendor
 g_cpuid_vendor:     resb 13
@@ -0,0 +1,27 @@
+/**
+ * The SakuraOS Standard Library
+ * Copyright 2025 Adam Judge
+ */
+
+#ifndef _SCHED_H
+#define _SCHED_H
+
+#include <sys/types.h>
+
+#define SCHED_OTHER 0
+#define SCHED_FIFO 1
+#define SCHED_RR 2
+
+struct sched_param {
+    int sched_priority;
+};
+
+#define sched_get_priority_min(policy) ((policy) == SCHED_OTHER ? 0 : 1)
+#define sched_get_priority_max(policy) ((policy) == SCHED_OTHER ? 0 : 99)
+
+int sched_setscheduler(pid_t, int, const struct sched_param *);
+int sched_getscheduler(pid_t);
+int sched_getparam(pid_t, struct sched_param *);
+int sched_yield(void);
+
+#endif
@@ -0,0 +1,28 @@
+/**
+ * The SakuraOS Standard Library
+ * Copyright 2025 Adam Judge
+ */
+
+#ifndef _SYS_RESOURCE_H
+#define _SYS_RESOURCE_H
+
+#include <sys/time.h>
+
+#define PRIO_PROCESS 0
+#define PRIO_PGRP 1
+#define PRIO_USER 2
+
+#define RUSAGE_SELF 0
+#define RUSAGE_CHILDREN -1
+#define RUSAGE_THREAD 1
+
+struct rusage {
+    struct timeval ru_utime;
+    struct timeval ru_stime;
+};
+
+int getpriority(int, int);
+int getrusage(int, struct rusage *);
+int setpriority(int, int, int);
+
+#endif
@@ -0,0 +1,44 @@
+/**
+ * The SakuraOS Standard Library
+ * Copyright 2025 Adam Judge
+ */
+
+#ifndef _SYS_SYSCALL_H
+#define _SYS_SYSCALL_H
+
+/* Buckets of the latency histogram. Bucket n counts calls that took from 2^n
+ * to 2^(n+1)-1 TSC cycles. */
+#define SYSCALL_HIST_BUCKETS 32
+
+struct syscall_stats {
+    unsigned long long count;
+    unsigned long long cycles;
+    unsigned int hist[SYSCALL_HIST_BUCKETS];
+};
+
+/* Returns the TSC frequency in kHz, or 0 if cycles aren't counted. */
+int syscall_stats(int, struct syscall_stats *);
+
+struct buffer_stats {
+    unsigned int hits;
+    unsigned int misses;
+    unsigned int nbuffers;
+    unsigned int reclaimed;
+    unsigned int dirty;
+    unsigned int written;
+};
+
+int buffer_stats(struct buffer_stats *);
+
+struct block_stats {
+    unsigned int submitted;
+    unsigned int merged;
+    unsigned int dispatched;
+    unsigned int commands;
+    unsigned int seeks;
+    unsigned int seek_cyls;
+};
+
+int block_stats(struct block_stats *);
+
+#endif
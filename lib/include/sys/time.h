@@ -0,0 +1,16 @@
+/**
+ * The SakuraOS Standard Library
+ * Copyright 2025 Adam Judge
+ */
+
+#ifndef _SYS_TIME_H
+#define _SYS_TIME_H
+
+struct timeval {
+    int tv_sec;
+    int tv_usec;
+};
+
+int gettimeofday(struct timeval *tv, void *tz);
+
+#endif
@@ -0,0 +1,23 @@
+/**
+ * The SakuraOS Standard Library
+ * Copyright 2025 Adam Judge
+ */
+
+#ifndef _SYS_TIMES_H
+#define _SYS_TIMES_H
+
+#include <sys/types.h>
+
+/* Clock ticks per second, the unit of struct tms and times() */
+#define CLK_TCK 100
+
+struct tms {
+    clock_t tms_utime;
+    clock_t tms_stime;
+    clock_t tms_cutime;
+    clock_t tms_cstime;
+};
+
+clock_t times(struct tms *);
+
+#endif
@@ -10,5 +10,8 @@ typedef unsigned int size_t;
 typedef int ssize_t;
 typedef int off_t;
 typedef int pid_t;
+typedef long clock_t;
+typedef long time_t;
+typedef int clockid_t;
 
 #endif
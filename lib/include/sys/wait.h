@@ -9,10 +9,12 @@
 #define WNOHANG 1
 #define WUNTRACED 2
 
-#define WIFEXITED(wstatus)    ((wstatus & 0x100) == 0)
+#define WIFEXITED(wstatus)    ((wstatus & 0x300) == 0)
 #define WEXITSTATUS(wstatus)  (wstatus & 0xff)
 #define WIFSIGNALED(wstatus)  ((wstatus & 0x100) != 0)
 #define WTERMSIG(wstatus)     (wstatus & 0xff)
+#define WIFSTOPPED(wstatus)   ((wstatus & 0x200) != 0)
+#define WSTOPSIG(wstatus)     (wstatus & 0xff)
 
 pid_t waitpid(pid_t, int *, int);
 
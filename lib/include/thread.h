@@ -0,0 +1,44 @@
+/**
+ * The SakuraOS Standard Library
+ * Copyright 2025 Adam Judge
+ */
+
+#ifndef _THREAD_H
+#define _THREAD_H
+
+/* Returns the new thread's ID. The stack argument is the top of the new
+ * thread's stack, or null to have one allocated. */
+int thread_create(void *(*)(void *), void *, void *);
+void thread_exit(void *);
+int thread_join(int, void **);
+
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+
+int futex(int *, int, int);
+
+/* A mutex is 0 when unlocked, 1 when locked, and 2 when locked with threads
+ * possibly waiting for it. */
+typedef struct {
+    volatile int state;
+} mutex_t;
+
+#define MUTEX_INITIALIZER { 0 }
+
+void mutex_init(mutex_t *);
+void mutex_lock(mutex_t *);
+int mutex_trylock(mutex_t *);
+void mutex_unlock(mutex_t *);
+
+typedef struct {
+    volatile int seq;
+} cond_t;
+
+#define COND_INITIALIZER { 0 }
+
+void cond_init(cond_t *);
+void cond_wait(cond_t *, mutex_t *);
+void cond_signal(cond_t *);
+void cond_broadcast(cond_t *);
+
+#endif
@@ -0,0 +1,28 @@
+/**
+ * The SakuraOS Standard Library
+ * Copyright 2025 Adam Judge
+ */
+
+#ifndef _TIME_H
+#define _TIME_H
+
+#include <sys/types.h>
+
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+
+/* Flag for clock_nanosleep to sleep until an absolute time */
+#define TIMER_ABSTIME 1
+
+struct timespec {
+    time_t tv_sec;
+    long tv_nsec;
+};
+
+int clock_gettime(clockid_t clock, struct timespec *ts);
+time_t time(time_t *t);
+int nanosleep(const struct timespec *req, struct timespec *rem);
+int clock_nanosleep(clockid_t clock, int flags, const struct timespec *req,
+                    struct timespec *rem);
+
+#endif
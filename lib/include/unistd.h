@@ -19,8 +19,14 @@ int close(int);
 int dup(int);
 int execve(const char *, char *const [], char *const []);
 void _exit(int);
+int fdatasync(int);
 pid_t fork(void);
+int fsync(int);
+pid_t getpgid(pid_t);
+int nice(int);
 ssize_t read(int, void *, size_t);
+int setpgid(pid_t, pid_t);
+void sync(void);
 ssize_t write(int, const void *, size_t);
 
 #endif
@@ -7,6 +7,13 @@
 
 extern main
 
+section .data
+
+; Routine used to enter the kernel for system calls
+align 4
+_syscall_entry:
+    dd _int255
+
 section .bss
 
 ; The errno global variable, which indicates system call errors
@@ -24,6 +31,7 @@ section .text
 
 global start
 start:
+    call _init_syscall
     call main
     mov ebx, eax
     xor eax, eax
@@ -39,7 +47,7 @@ start:
 global %2
 %2:
     mov eax, %1
-    int 255
+    call [_syscall_entry]
     jmp _check_error
 %endmacro
 
@@ -50,7 +58,7 @@ global %2
     push ebx
     mov eax, %1
     mov ebx, [esp+8]
-    int 255
+    call [_syscall_entry]
     pop ebx
     jmp _check_error
 %endmacro
@@ -63,7 +71,7 @@ global %2
     mov eax, %1
     mov ebx, [esp+8]
     mov ecx, [esp+12]
-    int 255
+    call [_syscall_entry]
     pop ebx
     jmp _check_error
 %endmacro
@@ -77,7 +85,7 @@ global %2
     mov ebx, [esp+8]
     mov ecx, [esp+12]
     mov edx, [esp+16]
-    int 255
+    call [_syscall_entry]
     pop ebx
     jmp _check_error
 %endmacro
@@ -93,7 +101,7 @@ global %2
     mov ecx, [esp+16]
     mov edx, [esp+20]
     mov esi, [esp+24]
-    int 255
+    call [_syscall_entry]
     pop esi
     pop ebx
     jmp _check_error
@@ -112,13 +120,78 @@ global %2
     mov edx, [esp+24]
     mov esi, [esp+28]
     mov edi, [esp+32]
-    int 255
+    call [_syscall_entry]
     pop edi
     pop esi
     pop ebx
     jmp _check_error
 %endmacro
 
+; Stub for a system call with the given argument count.
+%macro syscall_stub 3
+%if %3 == 0
+    syscall0 %1, %2
+%elif %3 == 1
+    syscall1 %1, %2
+%elif %3 == 2
+    syscall2 %1, %2
+%elif %3 == 3
+    syscall3 %1, %2
+%elif %3 == 4
+    syscall4 %1, %2
+%else
+    syscall5 %1, %2
+%endif
+%endmacro
+
+; Start routine of threads made by thread_create() in thread.c, which the
+; kernel starts with the entry point and argument on the stack.
+global _thread_start
+_thread_start:
+    pop eax
+    call eax
+    push eax
+    call thread_exit
+    jmp $
+
+; Enter the kernel through int 255, taking the system call number in EAX and
+; arguments in EBX, ECX, EDX, ESI and EDI.
+_int255:
+    int 255
+    ret
+
+; Enter the kernel through SYSENTER, with the same registers as _int255. The
+; kernel finds the return address and the registers SYSEXIT clobbers on the
+; stack, at EBP.
+_sysenter:
+    push ecx
+    push edx
+    push ebp
+    push .return
+    mov ebp, esp
+    sysenter
+.return:
+    pop ebp
+    pop edx
+    pop ecx
+    ret
+
+; Use SYSENTER for system calls if the processor supports it. Early Pentium Pros
+; report SEP without actually supporting it.
+_init_syscall:
+    push ebx
+    mov eax, 1
+    cpuid
+    test edx, 1 << 11
+    jz .done
+    and eax, 0xfff
+    cmp eax, 0x633
+    jb .done
+    mov dword [_syscall_entry], _sysenter
+.done:
+    pop ebx
+    ret
+
 ; Update errno if needed after system call
 _check_error:
     cmp eax, 0
@@ -129,16 +202,8 @@ _check_error:
 .noerror:
     ret
 
-; System call table
-syscall1 0, _exit
-syscall0 1, fork
-syscall3 2, execve
-syscall3 3, waitpid
-syscall2 4, signal
-syscall1 5, alarm
-syscall2 6, kill
-syscall3 7, open
-syscall1 8, close
-syscall3 9, read
-syscall3 10, write
-syscall1 11, dup
+; System call table, generated from the list shared with the kernel. Each line
+; there gives the number, kernel handler name, library function name and
+; argument count.
+%define SYSCALL(nr, kname, uname, nargs) syscall_stub nr, uname, nargs
+%include "../kernel/include/syscalls.h"
@@ -0,0 +1,27 @@
+/**
+ * The SakuraOS Standard Library
+ * Copyright 2025 Adam Judge
+ * File: resource.c
+ * Description: Process scheduling priority.
+ */
+
+#include <sys/resource.h>
+
+/* System calls in lib.s. The kernel returns 20 minus the nice value from
+ * getpriority, since negative return values are errors. */
+extern int _getpriority(int which, int who);
+extern int _nice(int inc);
+
+int getpriority(int which, int who)
+{
+    int prio = _getpriority(which, who);
+
+    return prio < 0 ? prio : 20 - prio;
+}
+
+int nice(int inc)
+{
+    if (_nice(inc) < 0)
+        return -1;
+    return getpriority(PRIO_PROCESS, 0);
+}
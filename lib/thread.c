@@ -0,0 +1,105 @@
+/**
+ * The SakuraOS Standard Library
+ * Copyright 2025 Adam Judge
+ * File: thread.c
+ * Description: Threads, and mutexes and condition variables built on futexes.
+ */
+
+#include <thread.h>
+
+#define INT_MAX 0x7fffffff
+
+/* System call in lib.s, which starts the new thread at the start routine. */
+extern int _thread_create(void *(*)(void *), void *, void *, void (*)());
+extern void _thread_start();
+
+int thread_create(void *(*entry)(void *), void *stack, void *arg)
+{
+    return _thread_create(entry, stack, arg, _thread_start);
+}
+
+static inline int cmpxchg(volatile int *p, int old, int new)
+{
+    __asm__ __volatile__("lock cmpxchgl %2, %1"
+                 : "+a" (old), "+m" (*p)
+                 : "r" (new)
+                 : "memory");
+    return old;
+}
+
+static inline int xchg(volatile int *p, int val)
+{
+    __asm__ __volatile__("xchgl %0, %1"
+                 : "+r" (val), "+m" (*p)
+                 :
+                 : "memory");
+    return val;
+}
+
+static inline void atomic_inc(volatile int *p)
+{
+    __asm__ __volatile__("lock incl %0" : "+m" (*p) : : "memory");
+}
+
+void mutex_init(mutex_t *m)
+{
+    m->state = 0;
+}
+
+/* The kernel is only entered when the mutex is contended. */
+void mutex_lock(mutex_t *m)
+{
+    int c = cmpxchg(&m->state, 0, 1);
+
+    if (c == 0)
+        return;
+    if (c != 2)
+        c = xchg(&m->state, 2);
+    while (c != 0) {
+        futex((int *)&m->state, FUTEX_WAIT, 2);
+        c = xchg(&m->state, 2);
+    }
+}
+
+/* Returns 0 if the mutex was taken, or -1 if it's already locked. */
+int mutex_trylock(mutex_t *m)
+{
+    return cmpxchg(&m->state, 0, 1) == 0 ? 0 : -1;
+}
+
+void mutex_unlock(mutex_t *m)
+{
+    if (xchg(&m->state, 0) == 2)
+        futex((int *)&m->state, FUTEX_WAKE, 1);
+}
+
+void cond_init(cond_t *c)
+{
+    c->seq = 0;
+}
+
+/* Waiters sleep on a sequence number that every signal bumps, so a signal
+ * between unlocking the mutex and sleeping isn't lost. */
+void cond_wait(cond_t *c, mutex_t *m)
+{
+    int seq = c->seq;
+
+    mutex_unlock(m);
+    futex((int *)&c->seq, FUTEX_WAIT, seq);
+
+    /* Other waiters may have been woken too, so take the mutex as contended. */
+    while (xchg(&m->state, 2) != 0)
+        futex((int *)&m->state, FUTEX_WAIT, 2);
+}
+
+void cond_signal(cond_t *c)
+{
+    atomic_inc(&c->seq);
+    futex((int *)&c->seq, FUTEX_WAKE, 1);
+}
+
+void cond_broadcast(cond_t *c)
+{
+    atomic_inc(&c->seq);
+    futex((int *)&c->seq, FUTEX_WAKE, INT_MAX);
+}
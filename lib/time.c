@@ -0,0 +1,107 @@
+/**
+ * The SakuraOS Standard Library
+ * Copyright 2025 Adam Judge
+ * File: time.c
+ * Description: Clocks read from the kernel's shared time page.
+ */
+
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include "../kernel/include/vdso.h"
+
+static volatile struct vdso_data *const vdso = (struct vdso_data *)VDSO_BASE;
+
+#define NSEC_PER_SEC 1000000000
+#define NSEC_PER_USEC 1000
+
+/* There's no libgcc, so 64-bit division is done by hand. Divides n in place
+ * and returns the remainder. */
+static uint32_t div64_32(uint64_t *n, uint32_t d)
+{
+    uint32_t high = *n >> 32, low = *n, qhigh, qlow, rem;
+
+    qhigh = high / d;
+    rem = high % d;
+    __asm__("divl %4" : "=a"(qlow), "=d"(rem) : "0"(low), "1"(rem), "rm"(d));
+    *n = ((uint64_t)qhigh << 32) | qlow;
+    return rem;
+}
+
+static inline uint64_t rdtsc()
+{
+    uint64_t tsc;
+
+    __asm__ __volatile__("rdtsc" : "=A"(tsc));
+    return tsc;
+}
+
+/* Get the nanoseconds since boot and the boot time in seconds. Uses the TSC if
+ * the kernel calibrated it, otherwise the timer ticks. */
+static uint64_t read_clock(uint32_t *boot_time)
+{
+    uint32_t seq, jiffies, mult, shift;
+    uint64_t cycles, ns;
+
+    do {
+        seq = vdso->seq;
+        __asm__ __volatile__("" : : : "memory");
+        jiffies = vdso->jiffies;
+        mult = vdso->tsc_mult;
+        shift = vdso->tsc_shift;
+        *boot_time = vdso->boot_time;
+        if (mult) {
+            cycles = rdtsc() - vdso->tsc_base;
+            ns = vdso->clock_base;
+        } else {
+            cycles = 0;
+            ns = (uint64_t)jiffies * vdso->tick_nsec;
+        }
+        __asm__ __volatile__("" : : : "memory");
+    } while ((seq & 1) || seq != vdso->seq);
+
+    if (mult) {
+        ns += ((cycles >> 32) * mult) << (32 - shift);
+        ns += ((uint32_t)cycles * (uint64_t)mult) >> shift;
+    }
+    return ns;
+}
+
+int clock_gettime(clockid_t clock, struct timespec *ts)
+{
+    uint32_t boot_time;
+    uint64_t ns;
+
+    if (clock != CLOCK_REALTIME && clock != CLOCK_MONOTONIC) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ns = read_clock(&boot_time);
+    ts->tv_nsec = div64_32(&ns, NSEC_PER_SEC);
+    ts->tv_sec = ns;
+    if (clock == CLOCK_REALTIME)
+        ts->tv_sec += boot_time;
+    return 0;
+}
+
+int gettimeofday(struct timeval *tv, void *tz)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    tv->tv_sec = ts.tv_sec;
+    tv->tv_usec = ts.tv_nsec / NSEC_PER_USEC;
+    return 0;
+}
+
+time_t time(time_t *t)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (t)
+        *t = ts.tv_sec;
+    return ts.tv_sec;
+}
@@ -27,4 +27,4 @@ sudo cp test.txt /mnt
 
 sudo umount /mnt
 
-[ "$1" == "run" ] && qemu-system-i386 -fda sakura.img -serial stdio -m 16
+[ "$1" == "run" ] && qemu-system-i386 -fda sakura.img -serial stdio -m 16 -smp 4